@@ -0,0 +1,224 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+
+#ifdef KVERB_USE_CMSIS_DSP
+#include "arm_math.h"
+#endif
+
+/** Block kernels for the cheap stages of the KVerb audio path.
+ *
+ *  Each call runs one stage over a whole block with the filter state held
+ *  in registers, instead of one member-function call per sample. The
+ *  portable loops are written so the compiler can unroll and vectorize
+ *  them; with KVERB_USE_CMSIS_DSP the gain, mix and DC block stages go
+ *  through the equivalent CMSIS-DSP functions instead.
+ */
+
+/** out = in * gain, with a gain per frame. in and out may alias. */
+inline void ScaleGains(const float *in, const float *gain, float *out, size_t size) {
+#ifdef KVERB_USE_CMSIS_DSP
+    arm_mult_f32(in, gain, out, uint32_t(size));
+#else
+    for (size_t i = 0; i < size; i++) {
+        out[i] = in[i] * gain[i];
+    }
+#endif
+}
+
+/** out = dry * gain + wet, with a gain per frame. out may alias wet. */
+inline void MixGains(const float *dry, const float *gain, const float *wet, float *out, size_t size) {
+#ifdef KVERB_USE_CMSIS_DSP
+    if (out != wet) {
+        arm_mult_f32(dry, gain, out, uint32_t(size));
+        arm_add_f32(out, wet, out, uint32_t(size));
+        return;
+    }
+#endif
+    for (size_t i = 0; i < size; i++) {
+        out[i] = dry[i] * gain[i] + wet[i];
+    }
+}
+
+/** Largest absolute sample value across both channels. */
+inline float PeakLevel(const float *left, const float *right, size_t size) {
+    float peak = 0.0f;
+    for (size_t i = 0; i < size; i++) {
+        peak = fmaxf(peak, fmaxf(fabsf(left[i]), fabsf(right[i])));
+    }
+    return peak;
+}
+
+/** Largest absolute sample value across both channels, as PeakLevel(),
+ *  and in the same pass the sum of their squares into energy.
+ *
+ *  Each channel keeps its own peak and sum, so the two recursions overlap.
+ *  The maximum is a plain compare, which is one instruction on any FPU,
+ *  where fmaxf() can be a library call for its NaN handling.
+ */
+inline float PeakEnergy(const float *left, const float *right, size_t size, float &energy) {
+    float peak_l = 0.0f, peak_r = 0.0f;
+    float sum_l = 0.0f, sum_r = 0.0f;
+    for (size_t i = 0; i < size; i++) {
+        float l = left[i], r = right[i];
+        float abs_l = fabsf(l), abs_r = fabsf(r);
+        peak_l = abs_l > peak_l ? abs_l : peak_l;
+        peak_r = abs_r > peak_r ? abs_r : peak_r;
+        sum_l += l * l;
+        sum_r += r * r;
+    }
+    energy = sum_l + sum_r;
+    return peak_l > peak_r ? peak_l : peak_r;
+}
+
+/** High-pass output of daisysp::Svf for two channels.
+ *
+ *  Same double-sampled state variable filter, coefficients and drive as
+ *  Svf, but only the high-pass output is computed, and both channels run
+ *  in one loop so their independent recursions can overlap in the pipeline.
+ */
+class StereoHighPass {
+  public:
+    StereoHighPass() {}
+    ~StereoHighPass() {}
+
+    void Init(float samplerate) {
+        samplerate_ = samplerate;
+        freq_max_ = samplerate / 3.0f;
+        freq_ = 0.25f;
+        res_ = 0.5f;
+        drive_ = 0.25f;
+        damp_ = 0.0f;
+        for (int c = 0; c < 2; c++) {
+            low_[c] = 0.0f;
+            band_[c] = 0.0f;
+        }
+        SetFreq(200.0f);
+    }
+
+    /** \param freq cutoff in Hz, clamped to samplerate / 3 */
+    void SetFreq(float freq) {
+        freq = freq < 1.0e-6f ? 1.0e-6f : (freq > freq_max_ ? freq_max_ : freq);
+        // the filter runs at twice the sample rate
+        float ratio = freq / (samplerate_ * 2.0f);
+        freq_ = 2.0f * sinf(3.14159265358979f * (ratio < 0.25f ? ratio : 0.25f));
+        UpdateDamping();
+    }
+
+    /** \param res resonance, 0 to 1 */
+    void SetRes(float res) {
+        res_ = res < 0.0f ? 0.0f : (res > 1.0f ? 1.0f : res);
+        drive_ = 0.5f * res_;
+        UpdateDamping();
+    }
+
+    /** Filters both channels in place. */
+    void Process(float *left, float *right, size_t size) {
+        float lowL = low_[0], bandL = band_[0];
+        float lowR = low_[1], bandR = band_[1];
+        const float freq = freq_, damp = damp_, drive = drive_;
+
+        for (size_t i = 0; i < size; i++) {
+            float inL = left[i], inR = right[i];
+
+            // first pass
+            lowL += freq * bandL;
+            lowR += freq * bandR;
+            float highL = inL - damp * bandL - lowL;
+            float highR = inR - damp * bandR - lowR;
+            bandL = freq * highL + bandL - drive * bandL * bandL * bandL;
+            bandR = freq * highR + bandR - drive * bandR * bandR * bandR;
+            float outL = 0.5f * highL;
+            float outR = 0.5f * highR;
+
+            // second pass, averaged with the first
+            lowL += freq * bandL;
+            lowR += freq * bandR;
+            highL = inL - damp * bandL - lowL;
+            highR = inR - damp * bandR - lowR;
+            bandL = freq * highL + bandL - drive * bandL * bandL * bandL;
+            bandR = freq * highR + bandR - drive * bandR * bandR * bandR;
+            left[i] = outL + 0.5f * highL;
+            right[i] = outR + 0.5f * highR;
+        }
+
+        low_[0] = lowL;
+        band_[0] = bandL;
+        low_[1] = lowR;
+        band_[1] = bandR;
+    }
+
+  private:
+    void UpdateDamping() {
+        float damp = 2.0f * (1.0f - powf(res_, 0.25f));
+        float limit = 2.0f / freq_ - freq_ * 0.5f;
+        limit = limit < 2.0f ? limit : 2.0f;
+        damp_ = damp < limit ? damp : limit;
+    }
+
+    float samplerate_, freq_max_;
+    float freq_, res_, drive_, damp_;
+    float low_[2], band_[2];
+};
+
+/** daisysp::DcBlock for two channels: y = x - x[n-1] + 0.99 * y[n-1].
+ *  With CMSIS-DSP it runs as a one-stage DF1 biquad per channel.
+ */
+class StereoDcBlock {
+  public:
+    static constexpr float kGain = 0.99f;
+
+    StereoDcBlock() {}
+    ~StereoDcBlock() {}
+
+    void Init() {
+#ifdef KVERB_USE_CMSIS_DSP
+        for (int c = 0; c < 2; c++) {
+            for (int s = 0; s < 4; s++) {
+                state_[c][s] = 0.0f;
+            }
+            arm_biquad_cascade_df1_init_f32(&biquad_[c], 1, coeffs_, state_[c]);
+        }
+#else
+        for (int c = 0; c < 2; c++) {
+            input_[c] = 0.0f;
+            output_[c] = 0.0f;
+        }
+#endif
+    }
+
+    /** Filters both channels in place. */
+    void Process(float *left, float *right, size_t size) {
+#ifdef KVERB_USE_CMSIS_DSP
+        arm_biquad_cascade_df1_f32(&biquad_[0], left, left, uint32_t(size));
+        arm_biquad_cascade_df1_f32(&biquad_[1], right, right, uint32_t(size));
+#else
+        float xL = input_[0], yL = output_[0];
+        float xR = input_[1], yR = output_[1];
+        for (size_t i = 0; i < size; i++) {
+            float inL = left[i], inR = right[i];
+            yL = inL - xL + kGain * yL;
+            yR = inR - xR + kGain * yR;
+            xL = inL;
+            xR = inR;
+            left[i] = yL;
+            right[i] = yR;
+        }
+        input_[0] = xL;
+        output_[0] = yL;
+        input_[1] = xR;
+        output_[1] = yR;
+#endif
+    }
+
+  private:
+#ifdef KVERB_USE_CMSIS_DSP
+    // b0, b1, b2, a1, a2 in the CMSIS sign convention
+    const float32_t coeffs_[5] = {1.0f, -1.0f, 0.0f, kGain, 0.0f};
+    float32_t                  state_[2][4];
+    arm_biquad_casd_df1_inst_f32 biquad_[2];
+#else
+    float input_[2], output_[2];
+#endif
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <math.h>
+#include <stddef.h>
+
+/** Plays back control inputs sampled at a fixed rate as a piecewise-linear
+ *  trajectory on the audio sample clock.
+ *
+ *  An interrupt at the control sample rate Push()es frames into a
+ *  single-producer, single-consumer ring, and the audio callback Advance()s
+ *  through them, interpolating between consecutive frames. Playback settles
+ *  at the smallest lag that does not run dry: running dry holds the last
+ *  value, and a backlog beyond kMaxBacklog frames, from the two clocks
+ *  drifting apart, is skipped.
+ */
+template <size_t kChannels, size_t kSize = 64>
+class CvSampler {
+  public:
+    static_assert((kSize & (kSize - 1)) == 0, "the ring size must be a power of two");
+
+    // More than any block can consume, so only clock drift is skipped
+    static constexpr size_t kMaxBacklog = kSize / 2;
+
+    CvSampler() {}
+    ~CvSampler() {}
+
+    /** Reader side: restarts playback from the newest frame.
+     *  \param step control frames per audio frame
+     */
+    void Reset(float step) {
+        step_ = step;
+        phase_ = 0.0f;
+        have_next_ = false;
+        size_t head = head_.load(std::memory_order_acquire);
+        for (size_t c = 0; c < kChannels; c++) {
+            prev_[c] = head != 0 ? frames_[(head - 1) & kMask][c] : 0.0f;
+        }
+        tail_.store(head, std::memory_order_release);
+    }
+
+    /** Writer side, from the sampling interrupt. Drops the frame if the
+     *  ring is full.
+     */
+    void Push(const float *values) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= kSize) {
+            return;
+        }
+        for (size_t c = 0; c < kChannels; c++) {
+            frames_[head & kMask][c] = values[c];
+        }
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    /** Reader side: advances by up to max_frames audio frames, stopping at
+     *  the next captured frame, so the values move linearly over the span.
+     *  \param values the kChannels values reached at the end of the span
+     *  \return frames advanced, at least 1 if max_frames is
+     */
+    size_t Advance(size_t max_frames, float *values) {
+        if (!have_next_) {
+            size_t head = head_.load(std::memory_order_acquire);
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            if (head - tail > kMaxBacklog) {
+                tail = head - kMaxBacklog;
+            }
+            if (head == tail) {
+                // nothing new captured, hold
+                for (size_t c = 0; c < kChannels; c++) {
+                    values[c] = prev_[c];
+                }
+                return max_frames;
+            }
+            for (size_t c = 0; c < kChannels; c++) {
+                next_[c] = frames_[tail & kMask][c];
+            }
+            tail_.store(tail + 1, std::memory_order_release);
+            have_next_ = true;
+        }
+
+        size_t frames = size_t(ceilf((1.0f - phase_) / step_));
+        frames = frames < 1 ? 1 : frames;
+        if (frames > max_frames) {
+            phase_ += float(max_frames) * step_;
+            for (size_t c = 0; c < kChannels; c++) {
+                values[c] = prev_[c] + (next_[c] - prev_[c]) * phase_;
+            }
+            return max_frames;
+        }
+
+        // reached the captured frame, to within a fraction of a sample
+        phase_ = fmaxf(phase_ + float(frames) * step_ - 1.0f, 0.0f);
+        for (size_t c = 0; c < kChannels; c++) {
+            prev_[c] = next_[c];
+            values[c] = next_[c];
+        }
+        have_next_ = false;
+        return frames;
+    }
+
+  private:
+    static constexpr size_t kMask = kSize - 1;
+
+    float               frames_[kSize][kChannels];
+    std::atomic<size_t> head_{0}; // frames pushed, owned by the writer
+    std::atomic<size_t> tail_{0}; // frames taken, owned by the reader
+
+    // reader state: interpolating from prev_ to next_, phase_ of the way
+    float prev_[kChannels] = {};
+    float next_[kChannels] = {};
+    float phase_ = 0.0f;
+    float step_ = 1.0f;
+    bool  have_next_ = false;
+};
@@ -0,0 +1,126 @@
+#include "Diagnostics.h"
+
+#ifdef KVERB_DIAGNOSTICS
+
+#include <math.h>
+
+Diagnostics diagnostics;
+
+// Weight of the newest value in the running averages, about 100 callbacks
+static constexpr float kAverageCoeff = 0.01f;
+
+// Peaks are published and restarted once per second of audio
+static constexpr float kPeakWindowUs = 1e6f;
+
+static const char *timer_strings[Diagnostics::TIMER_COUNT] = {
+    "send", "hpf", "prDly", "early", "verb", "dcblk", "duck", "mix", "cb", "save", "oled", "recal"};
+
+void Diagnostics::Init(float samplerate) {
+    samplerate_ = samplerate;
+#ifdef __arm__
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->LAR = 0xC5ACCE55; // unlock, required on the Cortex-M7
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    ticks_per_us_ = float(SystemCoreClock) / 1e6f;
+#else
+    ticks_per_us_ = 1000.0f;
+#endif
+    Reset();
+    for (int t = 0; t < TIMER_COUNT; t++) {
+        timers_[t].average_us = 0.0f;
+    }
+    average_load_ = 0.0f;
+    started_ = false;
+}
+
+void Diagnostics::Reset() {
+    for (int t = 0; t < TIMER_COUNT; t++) {
+        timers_[t].peak_us = 0.0f;
+        timers_[t].worst_us = 0.0f;
+        window_peak_us_[t] = 0.0f;
+    }
+    for (int t = 0; t < TIMER_CALLBACK; t++) {
+        pending_[t] = 0;
+    }
+    peak_load_ = 0.0f;
+    worst_load_ = 0.0f;
+    window_peak_load_ = 0.0f;
+    window_us_ = 0.0f;
+    worst_jitter_us_ = 0.0f;
+    overruns_ = 0;
+}
+
+const char *Diagnostics::GetTimerName(Timer timer) {
+    return timer_strings[timer];
+}
+
+uint32_t Diagnostics::Lap(Timer timer, uint32_t start) {
+    uint32_t now = Now();
+    if (timer < TIMER_CALLBACK) {
+        pending_[timer] += now - start;
+    }
+    else {
+        Fold(timer, now - start);
+    }
+    return now;
+}
+
+void Diagnostics::BeginCallback() {
+    if (reset_requested_.exchange(false, std::memory_order_acquire)) {
+        Reset();
+    }
+    last_callback_start_ = callback_start_;
+    callback_start_ = Now();
+}
+
+void Diagnostics::EndCallback(size_t frames) {
+    uint32_t elapsed = Now() - callback_start_;
+    float    elapsed_us = float(elapsed) / ticks_per_us_;
+    float    period_us = float(frames) * 1e6f / samplerate_;
+
+    float load = 100.0f * elapsed_us / period_us;
+    average_load_ += (load - average_load_) * kAverageCoeff;
+    window_peak_load_ = fmaxf(window_peak_load_, load);
+    worst_load_ = fmaxf(worst_load_, load);
+    if (elapsed_us > period_us) {
+        overruns_++;
+    }
+
+    if (started_) {
+        float interval_us = float(callback_start_ - last_callback_start_) / ticks_per_us_;
+        worst_jitter_us_ = fmaxf(worst_jitter_us_, fabsf(interval_us - period_us));
+        // a callback that started one or more periods late means blocks were dropped
+        if (interval_us > 1.5f * period_us) {
+            overruns_ += uint32_t(interval_us / period_us + 0.5f) - 1;
+        }
+    }
+    started_ = true;
+
+    for (int t = 0; t < TIMER_CALLBACK; t++) {
+        Fold(Timer(t), pending_[t]);
+        pending_[t] = 0;
+    }
+    Fold(TIMER_CALLBACK, elapsed);
+
+    window_us_ += period_us;
+    if (window_us_ >= kPeakWindowUs) {
+        window_us_ = 0.0f;
+        peak_load_ = window_peak_load_;
+        window_peak_load_ = 0.0f;
+        for (int t = 0; t < TIMER_COUNT; t++) {
+            timers_[t].peak_us = window_peak_us_[t];
+            window_peak_us_[t] = 0.0f;
+        }
+    }
+}
+
+void Diagnostics::Fold(Timer timer, uint32_t ticks) {
+    float us = float(ticks) / ticks_per_us_;
+    TimerStats &stats = timers_[timer];
+    stats.average_us += (us - stats.average_us) * kAverageCoeff;
+    window_peak_us_[timer] = fmaxf(window_peak_us_[timer], us);
+    stats.worst_us = fmaxf(stats.worst_us, us);
+}
+
+#endif
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Timing instrumentation for the audio callback, its stages and the slow
+ * main loop tasks.
+ *
+ * Enabled in debug firmware, and in host builds made with
+ * KVERB_DIAGNOSTICS. In release firmware the KVERB_DIAG_* macros expand to
+ * nothing and the Diagnostics class is not compiled at all.
+ *
+ * On the Cortex-M7 the DWT cycle counter is the time base, on the host
+ * std::chrono::steady_clock in nanoseconds.
+ */
+#if !defined(KVERB_DIAGNOSTICS) && !defined(KVERB_RELEASE) && defined(__arm__)
+#define KVERB_DIAGNOSTICS
+#endif
+
+#ifdef KVERB_DIAGNOSTICS
+
+#include <atomic>
+
+#ifdef __arm__
+#include "stm32h7xx.h"
+#else
+#include <chrono>
+#endif
+
+class Diagnostics {
+  public:
+    // Stages of KVerbEngine, then the whole callback, then main loop tasks
+    enum Timer {
+        TIMER_SEND,
+        TIMER_HPF,
+        TIMER_PREDELAY,
+        TIMER_EARLY,
+        TIMER_REVERB,
+        TIMER_DCBLOCK,
+        TIMER_DUCK,
+        TIMER_MIX,
+        TIMER_CALLBACK,
+        TIMER_SAVE,
+        TIMER_OLED,
+        TIMER_RECALL,
+        TIMER_COUNT
+    };
+
+    struct TimerStats {
+        float average_us; // running average per callback or call
+        float peak_us;    // highest in the last second
+        float worst_us;   // highest since the last Reset()
+    };
+
+    Diagnostics() {}
+    ~Diagnostics() {}
+
+    /** Starts the time base, call before the audio starts. */
+    void Init(float samplerate);
+
+    /** Clears peaks, worst cases and the overrun count. Only while the
+     *  audio is stopped, the main loop uses RequestReset().
+     */
+    void Reset();
+
+    /** Has the next callback Reset() before it starts timing. */
+    void RequestReset() { reset_requested_.store(true, std::memory_order_release); }
+
+    static inline uint32_t Now() {
+#ifdef __arm__
+        return DWT->CYCCNT;
+#else
+        return uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    /** Adds the time since start to timer and returns the current time,
+     *  so consecutive stages can be timed from one running timestamp.
+     *  Engine stages are summed over the callback, other timers are
+     *  recorded per call.
+     */
+    uint32_t Lap(Timer timer, uint32_t start);
+
+    void BeginCallback();
+    void EndCallback(size_t frames);
+
+    const TimerStats &GetTimer(Timer timer) const { return timers_[timer]; }
+    static const char *GetTimerName(Timer timer);
+
+    /** Callback time as a percentage of the block period. */
+    float GetAverageLoad() const { return average_load_; }
+    float GetPeakLoad() const { return peak_load_; }
+    float GetWorstLoad() const { return worst_load_; }
+
+    /** Callbacks that took longer than their block period, or started
+     *  late enough that a whole block was missed.
+     */
+    uint32_t GetOverruns() const { return overruns_; }
+
+    /** Largest deviation of the callback interval from the block period. */
+    float GetWorstJitterUs() const { return worst_jitter_us_; }
+
+  private:
+    void Fold(Timer timer, uint32_t ticks);
+
+    float    ticks_per_us_ = 1.0f;
+    float    samplerate_ = 48000.0f;
+    uint32_t callback_start_ = 0;
+    uint32_t last_callback_start_ = 0;
+    bool     started_ = false;
+
+    uint32_t   pending_[TIMER_CALLBACK]; // stage ticks within the running callback
+    TimerStats timers_[TIMER_COUNT];
+    float      window_peak_us_[TIMER_COUNT];
+
+    float    average_load_ = 0.0f;
+    float    peak_load_ = 0.0f;
+    float    worst_load_ = 0.0f;
+    float    window_peak_load_ = 0.0f;
+    float    window_us_ = 0.0f; // audio time since the peaks were last published
+    float    worst_jitter_us_ = 0.0f;
+    uint32_t overruns_ = 0;
+
+    std::atomic<bool> reset_requested_{false};
+};
+
+extern Diagnostics diagnostics;
+
+#define KVERB_DIAG_START(name) uint32_t name = Diagnostics::Now()
+#define KVERB_DIAG_LAP(name, timer) name = diagnostics.Lap(Diagnostics::timer, name)
+#define KVERB_DIAG_BEGIN_CALLBACK() diagnostics.BeginCallback()
+#define KVERB_DIAG_END_CALLBACK(frames) diagnostics.EndCallback(frames)
+
+#else
+
+#define KVERB_DIAG_START(name)
+#define KVERB_DIAG_LAP(name, timer)
+#define KVERB_DIAG_BEGIN_CALLBACK()
+#define KVERB_DIAG_END_CALLBACK(frames)
+
+#endif
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "EarlyReflections.h"
+#include "FdnReverb.h"
+#include "KVerbEngine.h"
+#include "MemoryArena.h"
+#include "ReverbEngine.h"
+
+#include <new>
+
+// Capacity of the firmware's arena in each region. The contents at 96 kHz
+// take about 65 kB, 387 kB, 187 kB and 2.7 MB.
+static constexpr size_t DSP_ARENA_SIZES[MEMORY_REGION_COUNT] = {
+    72 * 1024,  // DTCM, next to the stack and the KVERB_DTCM objects
+    400 * 1024, // AXI SRAM
+    192 * 1024, // D2 SRAM, past the DMA buffers and their uncached window
+    4096 * 1024 // SDRAM
+};
+
+/** The large DSP objects and buffers of the firmware, carved from a
+ *  MemoryMap for one sample rate.
+ *
+ *  Allocate() frees the whole map and places everything again, sized for
+ *  the rate rather than for 96 kHz, each from the fastest region it
+ *  should run from:
+ *  - the FDN objects and the 4-line 16-bit FDN's delay memory from DTCM
+ *  - ReverbSc from AXI SRAM. Its delay memory is inside the DaisySP
+ *    object, a fixed size for any rate.
+ *  - the 8-line 16-bit FDN and the early reflection input spectra from D2
+ *    SRAM, both read all over every block
+ *  - the pre-delay, the float FDNs and the early reflection responses
+ *    from SDRAM: large, and either streamed or only read once per block
+ *  The objects are constructed in place, the caller initializes them.
+ */
+struct DspMemory {
+    ReverbScEngine            *verb_sc;
+    FdnReverb<8>              *verb_fdn8;
+    FdnReverb<4>              *verb_fdn4;
+    FdnReverb<8, int16_t>     *verb_fdn8_q15;
+    FdnReverb<4, int16_t>     *verb_fdn4_q15;
+    PreDelayLine::Frame       *predelay;
+    size_t                     predelay_size;
+    EarlyReflections::History *er_history;
+    EarlyReflections::Impulse *er_impulses; // two slots
+    float                     *er_response[2];
+
+    /** \return false if something did not fit, the map then holds what did */
+    bool Allocate(MemoryMap &map, float samplerate) {
+        map.Reset();
+
+        // the FDN objects themselves are small and hot
+        void *fdn8 = map.Allocate<FdnReverb<8>>("fdn8", 1, MEMORY_DTCM);
+        void *fdn4 = map.Allocate<FdnReverb<4>>("fdn4", 1, MEMORY_DTCM);
+        void *fdn8_q15 = map.Allocate<FdnReverb<8, int16_t>>("f8q", 1, MEMORY_DTCM);
+        void *fdn4_q15 = map.Allocate<FdnReverb<4, int16_t>>("f4q", 1, MEMORY_DTCM);
+        int16_t *fdn4_q15_buffer = map.Allocate<int16_t>("f4q", FdnReverb<4, int16_t>::BufferSize(samplerate), MEMORY_DTCM);
+        void *sc = map.Allocate<ReverbScEngine>("sc", 1, MEMORY_AXI_SRAM);
+        int16_t *fdn8_q15_buffer = map.Allocate<int16_t>("f8q", FdnReverb<8, int16_t>::BufferSize(samplerate), MEMORY_D2_SRAM);
+        er_history = map.Allocate<EarlyReflections::History>("erIn", 1, MEMORY_D2_SRAM);
+
+        predelay_size = KVerbEngine::PreDelayFrames(samplerate);
+        predelay = map.Allocate<PreDelayLine::Frame>("pdly", predelay_size, MEMORY_SDRAM);
+        float *fdn8_buffer = map.Allocate<float>("fdn8", FdnReverb<8>::BufferSize(samplerate), MEMORY_SDRAM);
+        float *fdn4_buffer = map.Allocate<float>("fdn4", FdnReverb<4>::BufferSize(samplerate), MEMORY_SDRAM);
+        er_impulses = map.Allocate<EarlyReflections::Impulse>("erIR", 2, MEMORY_SDRAM);
+        float *response = map.Allocate<float>("erWav", 2 * EarlyReflections::kMaxLength, MEMORY_SDRAM);
+
+        if (!fdn8 || !fdn4 || !fdn8_q15 || !fdn4_q15 || !fdn4_q15_buffer || !sc || !fdn8_q15_buffer || !er_history
+            || !predelay || !fdn8_buffer || !fdn4_buffer || !er_impulses || !response) {
+            return false;
+        }
+
+        verb_sc = new (sc) ReverbScEngine;
+        verb_fdn8 = new (fdn8) FdnReverb<8>(fdn8_buffer);
+        verb_fdn4 = new (fdn4) FdnReverb<4>(fdn4_buffer);
+        verb_fdn8_q15 = new (fdn8_q15) FdnReverb<8, int16_t>(fdn8_q15_buffer);
+        verb_fdn4_q15 = new (fdn4_q15) FdnReverb<4, int16_t>(fdn4_q15_buffer);
+        er_response[0] = response;
+        er_response[1] = response + EarlyReflections::kMaxLength;
+        return true;
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/** Stereo-linked sidechain ducker for the wet signal.
+ *
+ *  The detector and gain computer of daisysp::Compressor, run once on the
+ *  louder of the two key channels, with the resulting gain applied to both
+ *  wet channels. Compared to one compressor per channel this halves the
+ *  detection cost and keeps the stereo image steady while ducking.
+ *
+ *  A single amount control maps to threshold, ratio, attack and release;
+ *  the coefficients are only recomputed when the amount changes. The dB
+ *  conversions use the same approximations as Compressor (fastlog10f and
+ *  pow10f), with the exponent taken from the float's bits instead of a
+ *  frexpf call.
+ */
+class Ducker {
+  public:
+    Ducker() {}
+    ~Ducker() {}
+
+    void Init(float samplerate) {
+        samplerate_ = samplerate;
+        // fixed 10 ms smoothing of the gain reduction, as in Compressor
+        gain_slope_ = expf(-1.0f / (0.01f * samplerate_));
+        envelope_ = 0.1f;
+        reduction_ = 0.1f;
+        lowest_gain_ = 1.0f;
+        amount_ = -1.0f;
+        SetAmount(0.0f);
+    }
+
+    /** \param amount 0-1, higher ducks earlier, harder and faster */
+    void SetAmount(float amount) {
+        if (amount == amount_) {
+            return;
+        }
+        amount_ = amount;
+
+        float threshold = -30.0f + (amount * 25.0f);             // -30dB to -5dB
+        float ratio = 1.0f + (amount * 9.0f);                    // 1:1 to 10:1
+        float attack = 0.001f + ((1.0f - amount) * 0.019f);      // 1ms to 20ms
+        float release = 0.05f + ((1.0f - amount) * 0.45f);       // 50ms to 500ms
+
+        threshold_ = threshold;
+        ratio_mul_ = (1.0f - gain_slope_) * ((1.0f / ratio) - 1.0f);
+        attack_slope_ = expf(-1.0f / (attack * samplerate_));
+        release_slope_ = expf(-1.0f / (release * samplerate_));
+    }
+
+    /** Ducks wetL/wetR in place, keyed by keyL/keyR. */
+    void Process(const float *keyL, const float *keyR, float *wetL, float *wetR, size_t size) {
+        float envelope = envelope_;
+        float reduction = reduction_;
+        float lowest = lowest_gain_;
+
+        for (size_t i = 0; i < size; i++) {
+            float key = fmaxf(fabsf(keyL[i]), fabsf(keyR[i]));
+
+            float slope = envelope > key ? release_slope_ : attack_slope_;
+            envelope = envelope * slope + (1.0f - slope) * key;
+
+            float over = 20.0f * FastLog10(envelope + 1e-20f) - threshold_;
+            reduction = gain_slope_ * reduction + ratio_mul_ * fmaxf(over, 0.0f);
+
+            float gain = Pow10(0.05f * reduction);
+            wetL[i] *= gain;
+            wetR[i] *= gain;
+            lowest = fminf(lowest, gain);
+        }
+
+        envelope_ = envelope;
+        reduction_ = reduction;
+        lowest_gain_ = lowest;
+        gain_ = Pow10(0.05f * reduction);
+    }
+
+    /** Gain applied to the last processed frame, 1 when not ducking. */
+    float GetGain() const { return gain_; }
+
+    /** Lowest gain applied since the last call, for metering. */
+    float TakeLowestGain() {
+        float lowest = lowest_gain_;
+        lowest_gain_ = 1.0f;
+        return lowest;
+    }
+
+  private:
+    // daisysp::fastlog10f for positive normal x: frexpf's mantissa and
+    // exponent straight from the bits, then the same polynomial
+    static float FastLog10(float x) {
+        uint32_t bits;
+        memcpy(&bits, &x, sizeof(bits));
+        int   exponent = int((bits >> 23) & 0xFF) - 126;
+        bits = (bits & 0x007FFFFF) | 0x3F000000;
+        float frac;
+        memcpy(&frac, &bits, sizeof(frac));
+
+        float log2 = 1.23149591368684f;
+        log2 = log2 * frac - 4.11852516267426f;
+        log2 = log2 * frac + 6.02197014179219f;
+        log2 = log2 * frac - 3.13396450166353f;
+        return (log2 + float(exponent)) * 0.3010299956639812f;
+    }
+
+    // daisysp::pow10f
+    static float Pow10(float x) { return expf(2.302585092994046f * x); }
+
+    float samplerate_;
+    float amount_;
+    float threshold_, ratio_mul_;
+    float attack_slope_, release_slope_, gain_slope_;
+    float envelope_;  // detector level of the key
+    float reduction_; // smoothed gain reduction in dB, negative
+    float gain_ = 1.0f;
+    float lowest_gain_ = 1.0f;
+};
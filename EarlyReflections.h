@@ -0,0 +1,224 @@
+#pragma once
+
+#include "Fft.h"
+#include "Placement.h"
+
+#include <atomic>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/** Early reflections: a stereo impulse response convolved with the reverb
+ *  send, by uniformly partitioned overlap-save FFT convolution.
+ *
+ *  The response is cut into kPartitionSize-sample partitions, each kept as
+ *  the spectrum of a zero-padded kFftSize-point FFT, and the input spectra
+ *  of the last kMaxPartitions periods are kept in a ring. Every
+ *  kPartitionSize frames the newest input spectrum is multiplied with the
+ *  first partition, added to the products of the older spectra with the
+ *  later partitions, and transformed back.
+ *
+ *  The products with the older spectra do not depend on the newest input,
+ *  so they are spread over the calls of the period in proportion to the
+ *  frames processed. Whatever the block size, a call costs at most its
+ *  share of those plus one forward and one inverse FFT per channel.
+ *
+ *  The output lags the input by kPartitionSize frames. Prepare() leaves out
+ *  the first kPartitionSize samples of the response to make up for it:
+ *  the direct sound is in the dry path, and reflections come later.
+ *
+ *  Left input is convolved with the left response, right with the right.
+ *  The input spectra ring is passed in, like the delay memory of the
+ *  reverbs, and responses are handed over ready-transformed as Impulse.
+ */
+class EarlyReflections {
+  public:
+    static constexpr size_t kPartitionSize = 64;
+    static constexpr size_t kFftSize = kPartitionSize * 2;
+    static constexpr size_t kMaxPartitions = 64;
+
+    // Longest response in samples, including the skipped first partition
+    static constexpr size_t kMaxLength = kPartitionSize * (kMaxPartitions + 1);
+
+    typedef RealFft<kFftSize> Fft;
+
+    /** A stereo response as partition spectra, prepared off the audio path. */
+    struct Impulse {
+        float  spectra[2][kMaxPartitions][kFftSize];
+        size_t partitions;
+    };
+
+    /** The input spectra of past periods. */
+    struct History {
+        float spectra[2][kMaxPartitions][kFftSize];
+    };
+
+    EarlyReflections() {}
+    ~EarlyReflections() {}
+
+    void Init(History *history) {
+        history_ = history;
+        impulse_ = nullptr;
+        pending_.store(nullptr, std::memory_order_relaxed);
+        fft_.Init();
+        Reset();
+    }
+
+    /** Clears the input, so the next Process() starts from silence. Picks
+     *  up a pending impulse.
+     */
+    void Reset() {
+        TakePending();
+        memset(last_, 0, sizeof(last_));
+        memset(output_, 0, sizeof(output_));
+        memset(accumulator_, 0, sizeof(accumulator_));
+        fill_ = 0;
+        done_ = 0;
+        head_ = 0;
+        history_valid_ = 0;
+    }
+
+    /** Switches to impulse at the start of the next period. Call from
+     *  outside the audio callback, and only while IsImpulsePending() is
+     *  false; the previous impulse is free to be reused once it is.
+     */
+    void SetImpulse(const Impulse *impulse) { pending_.store(impulse, std::memory_order_release); }
+
+    bool IsImpulsePending() const { return pending_.load(std::memory_order_acquire) != nullptr; }
+
+    /** True if there is a response to convolve with. */
+    bool IsActive() const { return impulse_ && impulse_->partitions > 0; }
+
+    /** \param inL, inR the send
+     *  \param outL, outR the reflections, kPartitionSize frames behind
+     */
+    KVERB_ITCM void Process(const float *inL, const float *inR, float *outL, float *outR, size_t size) {
+        const float *in[2] = {inL, inR};
+        float *out[2] = {outL, outR};
+
+        for (size_t offset = 0; offset < size;) {
+            size_t frames = kPartitionSize - fill_;
+            frames = frames < size - offset ? frames : size - offset;
+            for (int c = 0; c < 2; c++) {
+                memcpy(&input_[c][fill_], in[c] + offset, frames * sizeof(float));
+                memcpy(out[c] + offset, &output_[c][fill_], frames * sizeof(float));
+            }
+            fill_ += frames;
+            offset += frames;
+
+            // this period's share of the older partitions
+            size_t tail = IsActive() ? impulse_->partitions - 1 : 0;
+            Accumulate((tail * fill_ + kPartitionSize - 1) / kPartitionSize);
+
+            if (fill_ == kPartitionSize) {
+                EndPeriod();
+            }
+        }
+    }
+
+    /** Transforms a stereo response into impulse. Not real-time safe.
+     *  \param fft initialized transform, not the one Process() uses
+     *  \param length samples in left and right, longer ones are cut off
+     */
+    static void Prepare(Fft &fft, Impulse &impulse, const float *left, const float *right, size_t length) {
+        length = length < kMaxLength ? length : kMaxLength;
+        size_t partitions = length > kPartitionSize ? (length - 1) / kPartitionSize : 0;
+        const float *response[2] = {left, right};
+        float block[kFftSize];
+
+        for (int c = 0; c < 2; c++) {
+            for (size_t p = 0; p < partitions; p++) {
+                size_t start = (p + 1) * kPartitionSize;
+                size_t count = length - start < kPartitionSize ? length - start : kPartitionSize;
+                memset(block, 0, sizeof(block));
+                memcpy(block, response[c] + start, count * sizeof(float));
+                fft.Forward(block, impulse.spectra[c][p]);
+            }
+        }
+        impulse.partitions = partitions;
+    }
+
+  private:
+    // acc += x * h over packed spectra, DC and Nyquist are real
+    static inline void MultiplyAdd(const float *x, const float *h, float *acc) {
+        acc[0] += x[0] * h[0];
+        acc[1] += x[1] * h[1];
+        for (size_t i = 2; i < kFftSize; i += 2) {
+            acc[i] += x[i] * h[i] - x[i + 1] * h[i + 1];
+            acc[i + 1] += x[i] * h[i + 1] + x[i + 1] * h[i];
+        }
+    }
+
+    void TakePending() {
+        const Impulse *next = pending_.load(std::memory_order_acquire);
+        if (next) {
+            impulse_ = next;
+            pending_.store(nullptr, std::memory_order_release);
+        }
+    }
+
+    // Adds partitions done_ + 1 up to target to the accumulator, each with
+    // the input spectrum it pairs with in the next output
+    void Accumulate(size_t target) {
+        target = target < history_valid_ ? target : history_valid_;
+        for (size_t p = done_ + 1; p <= target; p++) {
+            size_t slot = (head_ + kMaxPartitions - p) % kMaxPartitions;
+            for (int c = 0; c < 2; c++) {
+                MultiplyAdd(history_->spectra[c][slot], impulse_->spectra[c][p], accumulator_[c]);
+            }
+        }
+        done_ = target > done_ ? target : done_;
+    }
+
+    void EndPeriod() {
+        float block[kFftSize];
+        bool  active = IsActive();
+        if (active) {
+            Accumulate(impulse_->partitions - 1);
+        }
+
+        for (int c = 0; c < 2; c++) {
+            // overlap-save: the last two periods of input
+            memcpy(block, last_[c], sizeof(last_[c]));
+            memcpy(block + kPartitionSize, input_[c], sizeof(input_[c]));
+            memcpy(last_[c], input_[c], sizeof(input_[c]));
+            float *spectrum = history_->spectra[c][head_];
+            fft_.Forward(block, spectrum);
+
+            if (active) {
+                MultiplyAdd(spectrum, impulse_->spectra[c][0], accumulator_[c]);
+                fft_.Inverse(accumulator_[c], block);
+                // the first half wrapped around, the second is the output
+                memcpy(output_[c], block + kPartitionSize, sizeof(output_[c]));
+            }
+            else {
+                memset(output_[c], 0, sizeof(output_[c]));
+            }
+            memset(accumulator_[c], 0, sizeof(accumulator_[c]));
+        }
+
+        head_ = (head_ + 1) % kMaxPartitions;
+        history_valid_ = history_valid_ < kMaxPartitions - 1 ? history_valid_ + 1 : kMaxPartitions - 1;
+        fill_ = 0;
+        done_ = 0;
+
+        // only here no products with the old response are in flight
+        TakePending();
+    }
+
+    Fft      fft_;
+    History *history_;
+
+    const Impulse *impulse_;
+    std::atomic<const Impulse *> pending_;
+
+    float  input_[2][kPartitionSize];  // this period so far
+    float  last_[2][kPartitionSize];   // the previous period
+    float  output_[2][kPartitionSize]; // played back during this period
+    float  accumulator_[2][kFftSize];  // products for the next output
+    size_t fill_;          // frames into this period
+    size_t done_;          // older partitions accumulated this period
+    size_t head_;          // ring slot of the next input spectrum
+    size_t history_valid_; // past input spectra since Reset()
+};
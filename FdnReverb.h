@@ -0,0 +1,180 @@
+#pragma once
+
+#include "ReverbEngine.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Delay line lengths in samples at 48 kHz, mutually prime and in the same
+// 50-120 ms range as ReverbSc, so equal FEED values give similar decays
+template <size_t kLines>
+struct FdnLengths;
+
+template <>
+struct FdnLengths<4> {
+    static uint16_t Get(size_t line) {
+        static const uint16_t lengths[4] = {2851, 3511, 4513, 5623};
+        return lengths[line];
+    }
+    static constexpr size_t kTotal = 16498;
+};
+
+template <>
+struct FdnLengths<8> {
+    static uint16_t Get(size_t line) {
+        static const uint16_t lengths[8] = {2521, 2851, 3209, 3511, 4127, 4513, 5087, 5623};
+        return lengths[line];
+    }
+    static constexpr size_t kTotal = 31442;
+};
+
+/** Storage format of the FDN delay lines.
+ *  float is stored as is. int16_t is Q15 over -kRange..kRange, which
+ *  leaves room for resonances to build up inside the loop, with plain
+ *  rounding: truncating towards zero would rule out limit cycles, but its
+ *  bias builds up around the loop and audibly shortens long tails.
+ */
+template <typename T>
+struct FdnSample;
+
+template <>
+struct FdnSample<float> {
+    static inline float Encode(float in) { return in; }
+    static inline float Decode(float in) { return in; }
+};
+
+template <>
+struct FdnSample<int16_t> {
+    static constexpr float kRange = 4.0f;
+
+    static inline int16_t Encode(float in) {
+        float scaled = in * (32767.0f / kRange);
+        scaled = scaled > 32767.0f ? 32767.0f : (scaled < -32767.0f ? -32767.0f : scaled);
+        return int16_t(scaled + (scaled >= 0.0f ? 0.5f : -0.5f));
+    }
+    static inline float Decode(int16_t in) { return float(in) * (kRange / 32767.0f); }
+};
+
+/** Feedback delay network with kLines delay lines and a Hadamard
+ *  feedback matrix.
+ *
+ *  Every line has a one-pole damping low-pass and the feedback gain in
+ *  its loop, and the lines are mixed by a fast Walsh-Hadamard transform.
+ *  Left input and output use the even lines, right the odd ones. Far
+ *  cheaper than ReverbSc: no modulation, no interpolated reads.
+ *
+ *  The delay memory is passed in, BufferSize() samples of T for the rate
+ *  it runs at, at most kBufferSize for kMaxSampleRate. With T = int16_t it
+ *  takes half the memory, small enough for the on-chip SRAM, and all
+ *  processing stays in float.
+ */
+template <size_t kLines, typename T = float>
+class FdnReverb : public ReverbEngine {
+  public:
+    static_assert(kLines >= 2 && (kLines & (kLines - 1)) == 0, "the Hadamard matrix needs a power of two");
+
+    static constexpr float  kMaxSampleRate = 96000.0f;
+    static constexpr size_t kBufferSize = FdnLengths<kLines>::kTotal * 2;
+
+    FdnReverb(T *buffer) : buffer_(buffer) {}
+    ~FdnReverb() {}
+
+    /** Samples of delay memory Init() needs at samplerate. */
+    static size_t BufferSize(float samplerate) {
+        size_t size = 0;
+        for (size_t l = 0; l < kLines; l++) {
+            size += LineLength(l, samplerate);
+        }
+        return size;
+    }
+
+    void Init(float samplerate) override {
+        samplerate_ = samplerate;
+
+        T *line = buffer_;
+        for (size_t l = 0; l < kLines; l++) {
+            length_[l] = LineLength(l, samplerate);
+            line_[l] = line;
+            line += length_[l];
+            pos_[l] = 0;
+            state_[l] = 0.0f;
+        }
+        for (T *p = buffer_; p < line; p++) {
+            *p = T(0);
+        }
+
+        SetFeedback(0.97f);
+        SetLpFreq(10000.0f);
+    }
+
+    void SetFeedback(float feedback) override {
+        // the Hadamard transform below is unnormalized, fold its scale in here
+        gain_ = feedback / sqrtf(float(kLines));
+    }
+
+    void SetLpFreq(float freq) override {
+        // same damping filter as ReverbSc
+        float damp = 2.0f - cosf(freq * 2.0f * 3.14159265358979f / samplerate_);
+        damp_ = damp - sqrtf(damp * damp - 1.0f);
+    }
+
+    KVERB_ITCM void Process(const float *inL, const float *inR, float *outL, float *outR, size_t size) override {
+        // ReverbSc's output level with 8 lines, scaled for the line count
+        const float out_gain = 0.35f * sqrtf(8.0f / float(kLines));
+
+        for (size_t i = 0; i < size; i++) {
+            float y[kLines];
+            float left = 0.0f, right = 0.0f;
+            for (size_t l = 0; l < kLines; l++) {
+                float out = FdnSample<T>::Decode(line_[l][pos_[l]]);
+                state_[l] = (state_[l] - out) * damp_ + out;
+                y[l] = state_[l];
+                if (l & 1) {
+                    right += y[l];
+                }
+                else {
+                    left += y[l];
+                }
+            }
+
+            // fast Walsh-Hadamard transform
+            for (size_t h = 1; h < kLines; h *= 2) {
+                for (size_t j = 0; j < kLines; j += h * 2) {
+                    for (size_t k = j; k < j + h; k++) {
+                        float a = y[k], b = y[k + h];
+                        y[k] = a + b;
+                        y[k + h] = a - b;
+                    }
+                }
+            }
+
+            for (size_t l = 0; l < kLines; l++) {
+                line_[l][pos_[l]] = FdnSample<T>::Encode(y[l] * gain_ + ((l & 1) ? inR[i] : inL[i]));
+                pos_[l] = pos_[l] + 1 < length_[l] ? pos_[l] + 1 : 0;
+            }
+
+            outL[i] = left * out_gain;
+            outR[i] = right * out_gain;
+        }
+    }
+
+  private:
+    static size_t LineLength(size_t line, float samplerate) {
+        float scale = fminf(samplerate / 48000.0f, kMaxSampleRate / 48000.0f);
+        return size_t(float(FdnLengths<kLines>::Get(line)) * scale);
+    }
+
+    T     *buffer_;
+    T     *line_[kLines];
+    size_t length_[kLines];
+    size_t pos_[kLines];
+    float  state_[kLines]; // damping filters
+    float  samplerate_;
+    float  gain_, damp_;
+};
+
+template <size_t kLines, typename T>
+constexpr float FdnReverb<kLines, T>::kMaxSampleRate;
+template <size_t kLines, typename T>
+constexpr size_t FdnReverb<kLines, T>::kBufferSize;
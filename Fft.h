@@ -0,0 +1,162 @@
+#pragma once
+
+#include "Placement.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef KVERB_USE_CMSIS_DSP
+#include "arm_math.h"
+#endif
+
+/** Real FFT of kSize points.
+ *
+ *  Spectra are packed as by CMSIS-DSP's arm_rfft_fast_f32: the real parts
+ *  of DC and Nyquist first, then the real and imaginary parts of bins 1 to
+ *  kSize / 2 - 1. Forward() is unscaled and Inverse() scales by 1 / kSize,
+ *  so one undoes the other.
+ *
+ *  With KVERB_USE_CMSIS_DSP it runs on arm_rfft_fast_f32, otherwise on a
+ *  portable radix-2 FFT of kSize / 2 complex points, split into the real
+ *  spectrum with one more pass.
+ */
+template <size_t kSize>
+class RealFft {
+  public:
+    static_assert(kSize >= 32 && kSize <= 4096 && (kSize & (kSize - 1)) == 0,
+                  "the FFT size must be a power of two from 32 to 4096");
+
+    RealFft() {}
+    ~RealFft() {}
+
+    void Init() {
+#ifdef KVERB_USE_CMSIS_DSP
+        arm_rfft_fast_init_f32(&rfft_, uint16_t(kSize));
+#else
+        const float pi = 3.14159265358979f;
+        for (size_t k = 0; k < kHalf; k++) {
+            split_[k * 2] = cosf(2.0f * pi * float(k) / float(kSize));
+            split_[k * 2 + 1] = -sinf(2.0f * pi * float(k) / float(kSize));
+        }
+        for (size_t k = 0; k < kHalf / 2; k++) {
+            twiddle_[k * 2] = cosf(2.0f * pi * float(k) / float(kHalf));
+            twiddle_[k * 2 + 1] = -sinf(2.0f * pi * float(k) / float(kHalf));
+        }
+        for (size_t i = 0, j = 0; i < kHalf; i++) {
+            reverse_[i] = uint16_t(j);
+            size_t bit = kHalf >> 1;
+            for (; j & bit; bit >>= 1) {
+                j ^= bit;
+            }
+            j |= bit;
+        }
+#endif
+    }
+
+    /** \param in kSize samples, overwritten
+     *  \param out packed spectrum
+     */
+    KVERB_ITCM void Forward(float *in, float *out) {
+#ifdef KVERB_USE_CMSIS_DSP
+        arm_rfft_fast_f32(&rfft_, in, out, 0);
+#else
+        // even samples as the real part, odd ones as the imaginary part
+        Complex(in, out, false);
+
+        float dc = out[0];
+        float ny = out[1];
+        out[0] = dc + ny;
+        out[1] = dc - ny;
+        // the middle bin is its own mirror, only conjugated
+        out[kHalf + 1] = -out[kHalf + 1];
+        for (size_t k = 1; k < kHalf / 2; k++) {
+            float *a = &out[k * 2];
+            float *b = &out[(kHalf - k) * 2];
+            // even and odd halves of bins k and kHalf - k
+            float even_re = 0.5f * (a[0] + b[0]), even_im = 0.5f * (a[1] - b[1]);
+            float odd_re = 0.5f * (a[1] + b[1]), odd_im = -0.5f * (a[0] - b[0]);
+            const float *w = &split_[k * 2];
+            float t_re = w[0] * odd_re - w[1] * odd_im;
+            float t_im = w[0] * odd_im + w[1] * odd_re;
+            // bin kHalf - k has the conjugate halves and the mirrored twiddle
+            a[0] = even_re + t_re;
+            a[1] = even_im + t_im;
+            b[0] = even_re - t_re;
+            b[1] = -even_im + t_im;
+        }
+#endif
+    }
+
+    /** \param in packed spectrum, overwritten
+     *  \param out kSize samples
+     */
+    KVERB_ITCM void Inverse(float *in, float *out) {
+#ifdef KVERB_USE_CMSIS_DSP
+        arm_rfft_fast_f32(&rfft_, in, out, 1);
+#else
+        float dc = in[0];
+        float ny = in[1];
+        in[0] = 0.5f * (dc + ny);
+        in[1] = 0.5f * (dc - ny);
+        in[kHalf + 1] = -in[kHalf + 1];
+        for (size_t k = 1; k < kHalf / 2; k++) {
+            float *a = &in[k * 2];
+            float *b = &in[(kHalf - k) * 2];
+            float even_re = 0.5f * (a[0] + b[0]), even_im = 0.5f * (a[1] - b[1]);
+            float diff_re = 0.5f * (a[0] - b[0]), diff_im = 0.5f * (a[1] + b[1]);
+            // odd half: the difference turned back by the twiddle
+            const float *w = &split_[k * 2];
+            float odd_re = w[0] * diff_re + w[1] * diff_im;
+            float odd_im = w[0] * diff_im - w[1] * diff_re;
+            // even + i * odd for bin k, and the same for kHalf - k
+            a[0] = even_re - odd_im;
+            a[1] = even_im + odd_re;
+            b[0] = even_re + odd_im;
+            b[1] = -even_im + odd_re;
+        }
+        Complex(in, out, true);
+
+        const float scale = 1.0f / float(kHalf);
+        for (size_t i = 0; i < kSize; i++) {
+            out[i] *= scale;
+        }
+#endif
+    }
+
+  private:
+#ifdef KVERB_USE_CMSIS_DSP
+    arm_rfft_fast_instance_f32 rfft_;
+#else
+    static constexpr size_t kHalf = kSize / 2;
+
+    // Unscaled complex FFT of kHalf interleaved points, out of place
+    void Complex(const float *in, float *out, bool inverse) {
+        for (size_t i = 0; i < kHalf; i++) {
+            out[reverse_[i] * 2] = in[i * 2];
+            out[reverse_[i] * 2 + 1] = in[i * 2 + 1];
+        }
+        float sign = inverse ? -1.0f : 1.0f;
+        for (size_t span = 1, step = kHalf / 2; span < kHalf; span *= 2, step /= 2) {
+            for (size_t start = 0; start < kHalf; start += span * 2) {
+                for (size_t j = 0; j < span; j++) {
+                    float w_re = twiddle_[j * step * 2];
+                    float w_im = sign * twiddle_[j * step * 2 + 1];
+                    float *a = &out[(start + j) * 2];
+                    float *b = &out[(start + j + span) * 2];
+                    float t_re = w_re * b[0] - w_im * b[1];
+                    float t_im = w_re * b[1] + w_im * b[0];
+                    b[0] = a[0] - t_re;
+                    b[1] = a[1] - t_im;
+                    a[0] += t_re;
+                    a[1] += t_im;
+                }
+            }
+        }
+    }
+
+    float    split_[kHalf * 2];   // e^(-2 pi i k / kSize), for the real split
+    float    twiddle_[kHalf];     // e^(-2 pi i k / kHalf), k < kHalf / 2
+    uint16_t reverse_[kHalf];     // bit-reversed indices
+#endif
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/** The responses the early reflections can load: a few built-in
+ *  reflection patterns, then the entries of an image flashed to QSPI.
+ *
+ *  The image is read in place through the memory-mapped QSPI, and built
+ *  from WAV files by host/build/kverb_irbank:
+ *
+ *      Header                  magic "KVIR", entry count
+ *      Entry[count]            name, sample rate, length, offset, CRC
+ *      int16 stereo samples    interleaved, at offset from the image start
+ *
+ *  Load() checks an entry's CRC and resamples it to the running sample
+ *  rate, so the image can hold responses at any rate. Without a valid
+ *  image only the built-in patterns are listed. Entry 0 is "off", a
+ *  response of length 0.
+ */
+class IrBank {
+  public:
+    // Flash set aside for the image
+    static constexpr uint32_t kRegionSize = 512 * 1024;
+
+    static constexpr uint32_t kMagic = 0x5249564B; // "KVIR"
+    static constexpr size_t   kMaxEntries = 16;
+    static constexpr size_t   kNameSize = 8; // including the terminating zero
+
+    struct Header {
+        uint32_t magic;
+        uint32_t count;
+    };
+
+    struct Entry {
+        char     name[kNameSize];
+        uint32_t samplerate;
+        uint32_t length; // frames
+        uint32_t offset; // bytes from the image start
+        uint32_t crc;    // of the samples
+    };
+
+    IrBank() {}
+    ~IrBank() {}
+
+    /** \param image start of the flashed image, nullptr for none */
+    void Init(const uint8_t *image) {
+        image_ = image;
+        count_ = 0;
+        if (!image_) {
+            return;
+        }
+
+        const Header *header = reinterpret_cast<const Header *>(image_);
+        if (header->magic != kMagic || header->count > kMaxEntries) {
+            return;
+        }
+        const Entry *entries = reinterpret_cast<const Entry *>(image_ + sizeof(Header));
+        for (size_t e = 0; e < header->count; e++) {
+            const Entry &entry = entries[e];
+            if (entry.name[kNameSize - 1] != '\0' || entry.samplerate == 0 || entry.offset > kRegionSize
+                || entry.length > (kRegionSize - entry.offset) / (2 * sizeof(int16_t))) {
+                return;
+            }
+        }
+        count_ = header->count;
+    }
+
+    /** True if Init() found a valid image. */
+    bool HasImage() const { return count_ > 0; }
+
+    size_t Count() const { return kPatternCount + count_; }
+
+    const char *Name(size_t index) const {
+        return index < kPatternCount ? GetPattern(index).name : GetEntry(index).name;
+    }
+
+    /** Renders a response at samplerate.
+     *  \param max_length frames left and right can take
+     *  \return frames rendered, 0 for "off" or a corrupt entry
+     */
+    size_t Load(size_t index, float samplerate, float *left, float *right, size_t max_length) const {
+        if (index < kPatternCount) {
+            return Synthesize(GetPattern(index), samplerate, left, right, max_length);
+        }
+
+        const Entry   &entry = GetEntry(index);
+        const int16_t *samples = reinterpret_cast<const int16_t *>(image_ + entry.offset);
+        if (entry.length == 0
+            || Crc32(reinterpret_cast<const uint8_t *>(samples), entry.length * 2 * sizeof(int16_t)) != entry.crc) {
+            return 0;
+        }
+
+        // linear interpolation, good enough for sparse reflections
+        float  step = float(entry.samplerate) / samplerate;
+        size_t length = size_t(float(entry.length - 1) / step) + 1;
+        length = length < max_length ? length : max_length;
+        for (size_t i = 0; i < length; i++) {
+            float  position = float(i) * step;
+            size_t s = size_t(position);
+            size_t next = s + 1 < entry.length ? s + 1 : s;
+            float  fraction = position - float(s);
+            left[i] = (samples[s * 2] + (samples[next * 2] - samples[s * 2]) * fraction) / 32768.0f;
+            right[i] = (samples[s * 2 + 1] + (samples[next * 2 + 1] - samples[s * 2 + 1]) * fraction) / 32768.0f;
+        }
+        return length;
+    }
+
+    static uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc = 0xFFFFFFFF) {
+        for (size_t i = 0; i < size; i++) {
+            crc ^= data[i];
+            for (int b = 0; b < 8; b++) {
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+            }
+        }
+        return crc;
+    }
+
+  private:
+    // Taps spread over first..last ms, fading from first_gain to last_gain,
+    // with a random pan and jitter from seed
+    struct Pattern {
+        const char *name;
+        float       first_ms, last_ms;
+        int         taps;
+        float       first_gain, last_gain;
+        uint32_t    seed;
+    };
+
+    static constexpr size_t kPatternCount = 4;
+
+    static const Pattern &GetPattern(size_t index) {
+        static const Pattern patterns[kPatternCount] = {
+            {"off", 0.0f, 0.0f, 0, 0.0f, 0.0f, 0},
+            {"room", 4.0f, 35.0f, 28, 0.6f, 0.1f, 0x1234567},
+            {"hall", 12.0f, 80.0f, 36, 0.5f, 0.12f, 0x2345678},
+            {"slap", 55.0f, 80.0f, 5, 0.7f, 0.4f, 0x3456789},
+        };
+        return patterns[index];
+    }
+
+    const Entry &GetEntry(size_t index) const {
+        return reinterpret_cast<const Entry *>(image_ + sizeof(Header))[index - kPatternCount];
+    }
+
+    static size_t Synthesize(const Pattern &pattern, float samplerate, float *left, float *right, size_t max_length) {
+        if (pattern.taps == 0) {
+            return 0;
+        }
+        size_t length = size_t(pattern.last_ms * 0.001f * samplerate) + 1;
+        length = length < max_length ? length : max_length;
+        memset(left, 0, length * sizeof(float));
+        memset(right, 0, length * sizeof(float));
+
+        uint32_t random = pattern.seed;
+        float spacing = (pattern.last_ms - pattern.first_ms) / float(pattern.taps);
+        for (int t = 0; t < pattern.taps; t++) {
+            random = random * 1664525u + 1013904223u;
+            float jitter = float(random >> 8) / 16777216.0f - 0.5f;
+            random = random * 1664525u + 1013904223u;
+            float pan = float(random >> 8) / 16777216.0f;
+
+            float  ms = pattern.first_ms + spacing * (float(t) + 0.5f + 0.8f * jitter);
+            size_t at = size_t(ms * 0.001f * samplerate);
+            if (at >= length) {
+                continue;
+            }
+            float gain = pattern.first_gain * powf(pattern.last_gain / pattern.first_gain, float(t) / float(pattern.taps));
+            left[at] += gain * sqrtf(1.0f - pan);
+            right[at] += gain * sqrtf(pan);
+        }
+        return length;
+    }
+
+    const uint8_t *image_ = nullptr;
+    size_t         count_ = 0;
+};
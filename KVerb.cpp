@@ -1,5 +1,17 @@
 #include "daisysp.h"
 #include "kxmx_bluemchen/src/kxmx_bluemchen.h"
+#include "CvSampler.h"
+#include "Diagnostics.h"
+#include "DspMemory.h"
+#include "FdnReverb.h"
+#include "IrBank.h"
+#include "KVerbEngine.h"
+#include "MidiInput.h"
+#include "ModMatrix.h"
+#include "Placement.h"
+#include "PresetBank.h"
+#include "SettingsJournal.h"
+#include "TripleBuffer.h"
 #include <string.h>
 
 using namespace kxmx;
@@ -8,39 +20,55 @@ using namespace daisysp;
 
 Bluemchen bluemchen;
 
-static ReverbSc   verb;
-static DcBlock    blk[2];
-static Compressor sidechain[2]; // Stereo compressor for ducking wet signal
-static Svf        hpf[2]; // Stereo high-pass filter before reverb
-
-// Pre-delay
-static constexpr float PRE_DELAY_MAX_SECONDS = 3.0f;
-static constexpr size_t PRE_DELAY_BUFFER_SIZE = static_cast<size_t>(96000 * PRE_DELAY_MAX_SECONDS); // Buffer size for max 96kHz sample rate
-static DelayLine<float, PRE_DELAY_BUFFER_SIZE> predelay[2] __attribute__((section(".sdram_bss"))); // Stereo pre-delay before reverb
-
-static float samplerate; // Made static so AudioCallback can access it
+static KVerbEngine engine KVERB_DTCM;
+
+// The arena of each memory region, and the reverbs, pre-delay and early
+// reflection memory placed in them for the running sample rate. Each
+// reverb has its own memory, so one can be initialized while another is
+// running. The early reflections have two response slots, so one can be
+// prepared while the other is in use, and the selected response is
+// rendered into er_response first.
+alignas(MemoryArena::kAlignment) static uint8_t dtcm_arena[DSP_ARENA_SIZES[MEMORY_DTCM]] __attribute__((section(".dtcmram_bss")));
+alignas(MemoryArena::kAlignment) static uint8_t axi_arena[DSP_ARENA_SIZES[MEMORY_AXI_SRAM]];
+alignas(MemoryArena::kAlignment) static uint8_t d2_arena[DSP_ARENA_SIZES[MEMORY_D2_SRAM]] __attribute__((section(".d2_arena_bss")));
+alignas(MemoryArena::kAlignment) static uint8_t sdram_arena[DSP_ARENA_SIZES[MEMORY_SDRAM]] __attribute__((section(".sdram_bss")));
+static MemoryMap memory_map;
+static DspMemory dsp;
+static EarlyReflections::Fft er_fft;
+static IrBank ir_bank;
+
+static float samplerate;
+
+// Sample rate and block size indices the audio is running with
+static int active_samplerate;
+static int active_blocksize;
 
 Parameter knob1;
 Parameter knob2;
 Parameter cv1;
 Parameter cv2;
 
-enum Params {
-    DRY,
-    WET,
-    LPF,
-    HPF,
-    FEED,
-    DUCK,
-    PREDLY,
-    PARAM_COUNT
-};
+// The CV inputs again, read by the sampling timer for the audio-rate path,
+// with their slew filters at the timer's rate
+AnalogControl cv1_fast;
+AnalogControl cv2_fast;
+TimerHandle cv_timer;
+
+// MIDI in on the Seed's USART1 RX pin (D14), received by DMA
+UartHandler midi_uart;
 
 enum MenuState {
     MENU_MAIN,
     MENU_PARAMETER,
     MENU_MAPPING,
-    MENU_CONFIRMATION
+    MENU_CONFIRMATION,
+    MENU_REVERB,
+    MENU_REFLECTIONS,
+    MENU_AUDIO,
+    MENU_PRESET,
+    MENU_MIDI,
+    MENU_METER,
+    MENU_DIAGNOSTICS // hidden, long press on the main menu in debug builds
 };
 
 enum ControlIndex {
@@ -48,6 +76,8 @@ enum ControlIndex {
     CTRL_KNOB2,
     CTRL_CV1,
     CTRL_CV2,
+    CTRL_MIDI1, // two assignable MIDI CCs, 0-1
+    CTRL_MIDI2,
     CTRL_COUNT
 };
 
@@ -57,6 +87,9 @@ enum MappingType {
     MAP_POT2,
     MAP_CV1,
     MAP_CV2,
+    MAP_MIDI1,
+    MAP_MIDI2,
+    MAP_CURVE,
     MAP_TYPE_COUNT
 };
 
@@ -82,6 +115,92 @@ enum MappingMenuOption {
     MAPOPT_COUNT
 };
 
+// Entries of the main menu after the parameters
+enum MainMenuOption {
+    MAIN_REVERB = PARAM_COUNT,
+    MAIN_REFLECTIONS,
+    MAIN_PRESET,
+    MAIN_AUDIO,
+    MAIN_MIDI,
+    MAIN_METER,
+    MAIN_INIT,
+    MAIN_OPTION_COUNT
+};
+
+enum ReverbType {
+    REVERB_SC,
+    REVERB_FDN8,
+    REVERB_FDN4,
+    REVERB_FDN8_Q15,
+    REVERB_FDN4_Q15,
+    REVERB_COUNT
+};
+
+enum SampleRateOption {
+    SR_32K,
+    SR_48K,
+    SR_96K,
+    SR_COUNT
+};
+
+enum BlockSizeOption {
+    BLOCK_4,
+    BLOCK_8,
+    BLOCK_16,
+    BLOCK_24,
+    BLOCK_32,
+    BLOCK_48,
+    BLOCK_COUNT
+};
+
+enum AudioMenuOption {
+    AUDIO_SAMPLERATE,
+    AUDIO_BLOCKSIZE,
+    AUDIO_CV_RATE,
+    AUDIO_LOAD, // projected load, read only
+    AUDIO_OPTION_COUNT
+};
+
+enum MidiMenuOption {
+    MIDI_ROW_CHANNEL,
+    MIDI_ROW_CC1,
+    MIDI_ROW_CC2,
+    MIDI_ROW_COUNT
+};
+
+enum PresetMenuOption {
+    PRESET_ROW_SLOT,
+    PRESET_ROW_LOAD,
+    PRESET_ROW_SAVE,
+    PRESET_ROW_CV,
+    PRESET_ROW_COUNT
+};
+
+// How a CV input selects presets
+enum PresetCvOption {
+    PRESET_CV_OFF,
+    PRESET_CV_CV1,  // the voltage selects the slot
+    PRESET_CV_CV2,
+    PRESET_CV_GATE1, // each rising edge steps to the next stored preset
+    PRESET_CV_GATE2,
+    PRESET_CV_COUNT
+};
+
+// How often the CV inputs reach the audio-rate parameters (DRY, WET, PREDLY)
+enum CvRateOption {
+    CV_RATE_BLOCK, // once per block, with the other parameters
+    CV_RATE_AUDIO, // sampled by a timer and interpolated per sample
+    CV_RATE_COUNT
+};
+
+// Parameters the audio-rate CV path drives
+enum AudioRateParam {
+    AUDIO_RATE_DRY,
+    AUDIO_RATE_WET,
+    AUDIO_RATE_PREDLY,
+    AUDIO_RATE_COUNT
+};
+
 enum ConfirmOption {
     CONFIRM_NO,
     CONFIRM_YES,
@@ -89,10 +208,41 @@ enum ConfirmOption {
 };
 
 /* Store for CV and Knob values*/
-float cv_values[CTRL_COUNT] = {0, 0, 0, 0};
+float cv_values[CTRL_COUNT] = {0, 0, 0, 0, 0, 0};
 
 // values for each parameter
-float param_values[PARAM_COUNT] = {0, 0, 0, 0, 0, 0, 0};
+float param_values[PARAM_COUNT] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+// param_values as seen by the audio callback, published by the control task
+struct ParamSnapshot {
+    float values[PARAM_COUNT];
+
+    // Whether the callback maps the parameters itself, from base and the
+    // coefficients below, so MIDI applies sample-accurately. Otherwise, while
+    // a preset fades in, values is used as it is.
+    bool  mapped;
+
+    // Each parameter summed without the MIDI CCs, and without the CV inputs
+    // where they run at audio rate
+    float base[PARAM_COUNT];
+    float midi_coefficients[PARAM_COUNT][2];
+
+    // Response curve of each parameter, applied with mod_curves
+    ModCurve curves[PARAM_COUNT];
+
+    // For the audio-rate CV path: the CV coefficients of the audio-rate
+    // parameters
+    bool  cv_audio_rate;
+    float cv_coefficients[AUDIO_RATE_COUNT][2];
+
+    // MIDI channel, 0 for any, and the controller numbers of CTRL_MIDI1/2
+    int midi_channel;
+    int midi_cc[2];
+};
+TripleBuffer<ParamSnapshot> param_snapshot KVERB_DTCM;
+
+// Number of audio blocks processed, paces the control task in the main loop
+volatile uint32_t audio_block_count = 0;
 
 /* value for the menu that is showing on screen */
 MenuState currentMenu = MENU_MAIN;
@@ -112,11 +262,135 @@ bool menuSwapped = false;
 /* confirmation menu selection */
 ConfirmOption confirmSelection = CONFIRM_NO;
 
+#ifdef KVERB_DIAGNOSTICS
+enum DiagnosticsMode {
+    DIAG_AVERAGE,
+    DIAG_PEAK,
+    DIAG_WORST,
+    DIAG_MODE_COUNT
+};
+
+// Rows of the diagnostics page: load figures, one per timer, then the
+// memory map: each region's use followed by its components
+enum DiagnosticsRow {
+    DIAG_ROW_LOAD,
+    DIAG_ROW_PEAK_LOAD,
+    DIAG_ROW_WORST_LOAD,
+    DIAG_ROW_OVERRUNS,
+    DIAG_ROW_JITTER,
+    DIAG_ROW_TIMERS,
+    DIAG_ROW_MEMORY = DIAG_ROW_TIMERS + Diagnostics::TIMER_COUNT
+};
+
+const char *diagnostics_mode_strings[DIAG_MODE_COUNT] {"avg", "pk", "max"};
+
+/* first row shown and which figure the timer rows show, in microseconds */
+int diagnosticsRow = 0;
+DiagnosticsMode diagnosticsMode = DIAG_AVERAGE;
+
+// The diagnostics page redraws at this rate while it is open
+static constexpr uint32_t DIAG_REFRESH_MS = 250;
+#endif
+
 /* variables for CV settings menu */
-std::string parameter_strings[PARAM_COUNT] {"dry", "wet", "LPF", "HPF", "feed", "duck", "prDly"};
-std::string mapping_strings[MAP_TYPE_COUNT] {"bias", "Pot1", "Pot2", "CV1", "CV2"};
-std::string sign_strings[SIGN_COUNT] {"-", "0", "+"};
-std::string multiplier_strings[MULT_COUNT] {"/4", "/2", "x1", "x2", "x4"};
+const char *parameter_strings[PARAM_COUNT] {"dry", "wet", "LPF", "HPF", "feed", "duck", "prDly", "early"};
+const char *mapping_strings[MAP_TYPE_COUNT] {"bias", "Pot1", "Pot2", "CV1", "CV2", "MIDI1", "MIDI2", "curve"};
+const char *sign_strings[SIGN_COUNT] {"-", "0", "+"};
+const char *multiplier_strings[MULT_COUNT] {"/4", "/2", "x1", "x2", "x4"};
+const char *curve_strings[CURVE_COUNT] {"lin", "exp", "log", "S"};
+const char *reverb_strings[REVERB_COUNT] {"SC", "FDN8", "FDN4", "F8Q", "F4Q"};
+
+// Filled in by allocateDsp()
+ReverbEngine *reverbs[REVERB_COUNT];
+
+const char *samplerate_strings[SR_COUNT] {"32k", "48k", "96k"};
+const SaiHandle::Config::SampleRate sai_samplerates[SR_COUNT] = {
+    SaiHandle::Config::SampleRate::SAI_32KHZ,
+    SaiHandle::Config::SampleRate::SAI_48KHZ,
+    SaiHandle::Config::SampleRate::SAI_96KHZ,
+};
+const float samplerate_values[SR_COUNT] = {32000.0f, 48000.0f, 96000.0f};
+const size_t blocksize_values[BLOCK_COUNT] = {4, 8, 16, 24, 32, 48};
+
+AudioMenuOption audioMenuSelection = AUDIO_SAMPLERATE;
+
+const char *cv_rate_strings[CV_RATE_COUNT] {"blk", "smp"};
+const int audio_rate_params[AUDIO_RATE_COUNT] = {DRY, WET, PREDLY};
+
+// Rate of the CV sampling timer, a few points per block even at 48 frames
+static constexpr float CV_SAMPLE_RATE = 8000.0f;
+
+// Sampled CV1 and CV2, handed from the timer interrupt to the audio callback
+CvSampler<2> cv_sampler KVERB_DTCM;
+
+// the CV rate running on the timer, and whether the audio callback is using it
+int active_cv_rate = CV_RATE_BLOCK;
+bool cv_sampler_running = false;
+
+// Control changes from the UART, timestamped on the TIM2 tick that
+// System::GetTick() reads, and the circular buffer the DMA receives into.
+// It reports every 3 bytes at most, so a message waits no more than 0.64 ms.
+MidiInput<> midi_input KVERB_DTCM;
+static constexpr size_t MIDI_RX_SIZE = 6;
+static uint8_t midi_rx_buffer[MIDI_RX_SIZE] __attribute__((section(".sram1_bss")));
+
+// CTRL_MIDI1/2 as the audio callback last set them, for the control task
+volatile float midi_values[2] = {0.0f, 0.0f};
+
+MidiMenuOption midiMenuSelection = MIDI_ROW_CHANNEL;
+
+const char *preset_cv_strings[PRESET_CV_COUNT] {"off", "CV1", "CV2", "G1", "G2"};
+
+// Preset slots in the bank
+static constexpr int PRESET_COUNT = 16;
+
+// Recalled presets fade in from the previous parameter values over this time
+static constexpr float PRESET_FADE_TIME = 0.05f;
+
+// Gate levels for stepping through presets, on the -1 to 1 CV scale
+static constexpr float GATE_HIGH = 0.5f;
+static constexpr float GATE_LOW = 0.25f;
+
+PresetMenuOption presetMenuSelection = PRESET_ROW_SLOT;
+
+/* slot shown on the preset page */
+int presetMenuSlot = 0;
+
+// fade state of the last recall, in audio blocks since it started
+float recall_from[PARAM_COUNT];
+uint32_t recall_start_block = 0;
+bool recall_fading = false;
+
+// last slot selected by CV, and the gate state, so each is acted on once
+int cv_preset_slot = -1;
+bool preset_gate = false;
+
+// Estimated audio callback cost on the Seed at 480 MHz: cycles per frame
+// for each reverb and for the rest of the engine, and per callback for
+// the interrupt, the sample conversion setup and the control-rate updates.
+// With diagnostics compiled in, projections are scaled by the measured load.
+static constexpr float CPU_HZ = 480e6f;
+const float reverb_cycles[REVERB_COUNT] = {1200.0f, 320.0f, 170.0f, 300.0f, 160.0f};
+static constexpr float ENGINE_CYCLES = 260.0f;
+static constexpr float CALLBACK_CYCLES = 6000.0f;
+// per engine span in the audio-rate CV path, and per timer interrupt
+static constexpr float CV_SEGMENT_CYCLES = 700.0f;
+// early reflections with a full-length response
+static constexpr float EARLY_CYCLES = 900.0f;
+
+// Projected loads above this are flagged, the rest of the time is needed
+// by the controls, display and flash writes in the main loop
+static constexpr float MAX_AUDIO_LOAD = 80.0f;
+
+// the reverb the engine runs, or was last told to switch to
+int active_reverb = REVERB_SC;
+
+// the response the early reflections run, and the slot it was prepared in
+int active_reflections = 0;
+int er_slot = 0;
+
+const float sign_factors[SIGN_COUNT] = {-1.0f, 0.0f, 1.0f};
+const float multiplier_factors[MULT_COUNT] = {0.25f, 0.5f, 1.0f, 2.0f, 4.0f};
 
 float bias_limits[PARAM_COUNT][3] = {
     // min, max
@@ -127,99 +401,275 @@ float bias_limits[PARAM_COUNT][3] = {
     {-1, 1}, // feedback
     {-1, 1}, // ducking
     {-PRE_DELAY_MAX_SECONDS, PRE_DELAY_MAX_SECONDS}, // pre-delay
+    {-1, 1}, // early reflections
 };
 
 struct Settings {
     float biases[PARAM_COUNT];
 
-    // Pot1 sign, Pot1 multiplier, Pot2 sign, Pot2 multiplier, CV1 sign, CV1 multiplier, CV2 sign, CV2 multiplier
-    int mapping_indices[PARAM_COUNT][8];
+    // sign and multiplier of each ControlIndex: Pot1, Pot2, CV1, CV2, MIDI1, MIDI2
+    int mapping_indices[PARAM_COUNT][CTRL_COUNT*2];
+
+    // ModCurve of each parameter
+    int curves[PARAM_COUNT];
+
+    // ReverbType
+    int reverb;
+
+    // IrBank entry of the early reflections
+    int reflections;
+
+    // SampleRateOption and BlockSizeOption
+    int samplerate;
+    int blocksize;
+
+    // Last recalled or saved preset slot, and PresetCvOption
+    int preset;
+    int preset_cv;
+
+    // CvRateOption
+    int cv_rate;
+
+    // MIDI channel, 0 for any, and the CC numbers MIDI1 and MIDI2 follow
+    int midi_channel;
+    int midi_cc[2];
 
     bool operator!=(const Settings& a) const {
-        return !(a.biases==biases && a.mapping_indices==mapping_indices);
+        return memcmp(this, &a, sizeof(Settings)) != 0;
     };
 };
 
 Settings LocalSettings;
 
-PersistentStorage<Settings> SavedSettings(bluemchen.seed.qspi);
+SettingsJournal<Settings> SavedSettings(bluemchen.seed.qspi);
+
+// The sound part of Settings, packed to keep the bank small. The reverb
+// type and audio settings stay global, recalling must not re-init the DSP.
+struct Preset {
+    int16_t biases[PARAM_COUNT];               // thousandths
+    uint8_t mappings[PARAM_COUNT][CTRL_COUNT]; // sign * MULT_COUNT + multiplier
+    uint8_t curves[PARAM_COUNT];
+};
+
+// Stored in the flash after the settings journal
+PresetBank<Preset, PRESET_COUNT> presets(bluemchen.seed.qspi);
 
 bool trigger_save = false;
 
+// LocalSettings compiled into coefficients, rebuilt whenever they are edited
+ModMatrix<PARAM_COUNT, CTRL_COUNT> mod_matrix;
+
 /* Value of the encoder */
 int enc_val = 0;
 
 // Store default settings for reset
 Settings DefaultSettings;
 
+// Display refresh is capped to this rate, and only happens when something changed
+static constexpr uint32_t OLED_MAX_FPS = 30;
+
+// Everything the menus draw, the display is only redrawn when this changes
+struct OledState {
+    int menu;
+    int param;
+    int mapping;
+    int selection;
+    int editing;
+    int confirm;
+    int bars[PARAM_COUNT];
+    int bias; // hundredths, as shown
+    int mapping_indices[CTRL_COUNT*2];
+    int curve;
+    int reverb;
+    int audio[5]; // sample rate, block size, CV rate, projected load and menu selection
+    int preset[4]; // slot, menu selection, slot stored, CV option
+    int midi[6]; // channel, CC numbers, menu selection and CC values while on the MIDI page
+    uint32_t meter; // level snapshot shown while on the meter page
+    int diagnostics[3]; // row, mode and refresh period while on the diagnostics page
+};
+
+// Meter page: levels from -METER_RANGE_DB to 0 dB across the bars, and the
+// wet RMS of the last METER_HISTORY snapshots, scrolling along the bottom
+static constexpr float METER_RANGE_DB = 60.0f;
+static constexpr float METER_DUCK_RANGE_DB = 24.0f;
+static constexpr int METER_BAR_X = 18;
+static constexpr int METER_BAR_WIDTH = 64 - METER_BAR_X;
+static constexpr int METER_HISTORY = 64;
+uint8_t meter_history[METER_HISTORY];
+int meter_history_pos = 0;
+uint32_t meter_count = 0;
+
+OledState drawn_state;
+bool oled_drawn = false;
+uint32_t last_oled_update = 0;
+
+int paramVisualWidth(int index) {
+    return std::min(int(param_values[index]*10), 10);
+}
+
 void drawParamVisual(int index, int x, int y) {
-    bluemchen.display.DrawRect(x, y, x+std::min(int(param_values[index]*10), 10), y+8, true, true);
+    bluemchen.display.DrawRect(x, y, x+paramVisualWidth(index), y+8, true, true);
 }
 
-void resetToDefaults() {
-    // Copy default settings to local settings
+void buildModMatrix() {
     for (int p = 0; p < PARAM_COUNT; p++) {
-        LocalSettings.biases[p] = DefaultSettings.biases[p];
-        for (int m = 0; m < 8; m++) {
-            LocalSettings.mapping_indices[p][m] = DefaultSettings.mapping_indices[p][m];
+        mod_matrix.SetBias(p, LocalSettings.biases[p]);
+        for (int cv = 0; cv < CTRL_COUNT; cv++) {
+            mod_matrix.SetCoefficient(p, cv,
+                sign_factors[LocalSettings.mapping_indices[p][cv*2]] * multiplier_factors[LocalSettings.mapping_indices[p][cv*2+1]]);
         }
+        mod_matrix.SetCurve(p, static_cast<ModCurve>(LocalSettings.curves[p]));
     }
+}
+
+// Call after every edit of LocalSettings
+void settingsChanged() {
+    buildModMatrix();
     trigger_save = true;
 }
 
+void packPreset(const Settings &settings, Preset &preset) {
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        preset.biases[p] = int16_t(roundf(settings.biases[p] * 1000.0f));
+        for (int cv = 0; cv < CTRL_COUNT; cv++) {
+            preset.mappings[p][cv] = uint8_t(settings.mapping_indices[p][cv*2] * MULT_COUNT + settings.mapping_indices[p][cv*2+1]);
+        }
+        preset.curves[p] = uint8_t(settings.curves[p]);
+    }
+}
+
+void unpackPreset(const Preset &preset, Settings &settings) {
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        settings.biases[p] = float(preset.biases[p]) / 1000.0f;
+        for (int cv = 0; cv < CTRL_COUNT; cv++) {
+            settings.mapping_indices[p][cv*2] = preset.mappings[p][cv] / MULT_COUNT;
+            settings.mapping_indices[p][cv*2+1] = preset.mappings[p][cv] % MULT_COUNT;
+        }
+        settings.curves[p] = preset.curves[p];
+    }
+}
+
+// Loads a preset straight from flash. The parameters glide from their
+// current values to the preset's over PRESET_FADE_TIME, through the usual
+// snapshot, so no DSP state is touched.
+bool recallPreset(int slot) {
+    KVERB_DIAG_START(recall_start);
+    const Preset *preset = presets.Get(slot);
+    if (!preset) {
+        return false;
+    }
+
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        recall_from[p] = param_values[p];
+    }
+    recall_start_block = audio_block_count;
+    recall_fading = true;
+
+    unpackPreset(*preset, LocalSettings);
+    LocalSettings.preset = slot;
+    settingsChanged();
+    KVERB_DIAG_LAP(recall_start, TIMER_RECALL);
+    return true;
+}
+
+void savePreset(int slot) {
+    Preset preset;
+    packPreset(LocalSettings, preset);
+    if (presets.Store(slot, preset)) {
+        LocalSettings.preset = slot;
+        settingsChanged();
+    }
+}
+
+void resetToDefaults() {
+    // Copy default settings to local settings
+    LocalSettings = DefaultSettings;
+    settingsChanged();
+}
+
+// "omni" or the channel number of LocalSettings.midi_channel
+const char *midiChannelString() {
+    static char channel_str[8];
+    if (LocalSettings.midi_channel == 0) {
+        return "omni";
+    }
+    snprintf(channel_str, sizeof(channel_str), "ch%d", LocalSettings.midi_channel);
+    return channel_str;
+}
+
+// Last value received for MIDI1 or MIDI2, 0-127
+int midiValue(int index) {
+    return int(midi_values[index] * 127.0f + 0.5f);
+}
+
 void MainMenu() {
     bluemchen.display.SetCursor(0, 0);
-    std::string str = "  KVERB";
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString("  KVERB", Font_6x8, true);
 
     // draw up to 3 of the options, starting with the one before the current selection
-    int firstOptionToDraw = std::min(std::max(currentParam - 1, 0), PARAM_COUNT - 2);
-    for(int p = firstOptionToDraw; p < PARAM_COUNT + 1 && p-firstOptionToDraw < 3; p++){
+    int firstOptionToDraw = std::min(std::max(currentParam - 1, 0), MAIN_OPTION_COUNT - 3);
+    for(int p = firstOptionToDraw; p < MAIN_OPTION_COUNT && p-firstOptionToDraw < 3; p++){
         if (p == currentParam) {
             bluemchen.display.SetCursor(0, 8*(1+p-firstOptionToDraw));
-            str = ">";
-            bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+            bluemchen.display.WriteString(">", Font_6x8, true);
         }
         bluemchen.display.SetCursor(6, 8*(1+p-firstOptionToDraw));
         if (p < PARAM_COUNT) {
-            str = parameter_strings[p];
-            bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+            bluemchen.display.WriteString(parameter_strings[p], Font_6x8, true);
             drawParamVisual(p, 36, 8*(1+p-firstOptionToDraw));
+        } else if (p == MAIN_REVERB) {
+            bluemchen.display.WriteString("verb", Font_6x8, true);
+            bluemchen.display.SetCursor(36, 8*(1+p-firstOptionToDraw));
+            bluemchen.display.WriteString(reverb_strings[LocalSettings.reverb], Font_6x8, true);
+        } else if (p == MAIN_REFLECTIONS) {
+            bluemchen.display.WriteString("refl", Font_6x8, true);
+            bluemchen.display.SetCursor(36, 8*(1+p-firstOptionToDraw));
+            bluemchen.display.WriteString(ir_bank.Name(LocalSettings.reflections), Font_6x8, true);
+        } else if (p == MAIN_PRESET) {
+            bluemchen.display.WriteString("prst", Font_6x8, true);
+            char slot_str[8];
+            snprintf(slot_str, sizeof(slot_str), "P%d", LocalSettings.preset + 1);
+            bluemchen.display.SetCursor(36, 8*(1+p-firstOptionToDraw));
+            bluemchen.display.WriteString(slot_str, Font_6x8, true);
+        } else if (p == MAIN_AUDIO) {
+            bluemchen.display.WriteString("audio", Font_6x8, true);
+            bluemchen.display.SetCursor(42, 8*(1+p-firstOptionToDraw));
+            bluemchen.display.WriteString(samplerate_strings[LocalSettings.samplerate], Font_6x8, true);
+        } else if (p == MAIN_MIDI) {
+            bluemchen.display.WriteString("midi", Font_6x8, true);
+            bluemchen.display.SetCursor(36, 8*(1+p-firstOptionToDraw));
+            bluemchen.display.WriteString(midiChannelString(), Font_6x8, true);
+        } else if (p == MAIN_METER) {
+            bluemchen.display.WriteString("meter", Font_6x8, true);
         } else {
             // INIT option
-            str = "INIT";
-            bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+            bluemchen.display.WriteString("INIT", Font_6x8, true);
         }
     }
 }
 
 void ParameterMenu() {
     bluemchen.display.SetCursor(0, 0);
-    std::string str = parameter_strings[currentParam];
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString(parameter_strings[currentParam], Font_6x8, true);
 
     // draw up to 3 of the options, starting with the one before the current selection
     int firstOptionToDraw = std::min(std::max(currentMapping - 1, 0), MAP_TYPE_COUNT - 3);
     for(int p = firstOptionToDraw; p < MAP_TYPE_COUNT && p-firstOptionToDraw < 4; p++){
         if (p == currentMapping) {
             bluemchen.display.SetCursor(0, 8*(1+p-firstOptionToDraw));
-            str = ">";
-            bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+            bluemchen.display.WriteString(">", Font_6x8, true);
         }
         bluemchen.display.SetCursor(6, 8*(1+p-firstOptionToDraw));
-        str = mapping_strings[p];
-        bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+        bluemchen.display.WriteString(mapping_strings[p], Font_6x8, true);
     }
 }
 
 void MappingMenu() {
     bluemchen.display.SetCursor(0, 0);
-    std::string str = parameter_strings[currentParam];
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString(parameter_strings[currentParam], Font_6x8, true);
 
     bluemchen.display.SetCursor(6, 8);
-    str = mapping_strings[currentMapping];
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString(mapping_strings[currentMapping], Font_6x8, true);
 
     if (currentMapping == MAP_BIAS) {
         // bias mapping
@@ -227,64 +677,436 @@ void MappingMenu() {
         // Format bias to 2 decimal places
         char bias_str[8];
         snprintf(bias_str, sizeof(bias_str), "%.2f", LocalSettings.biases[currentParam]);
-        str = std::string(bias_str);
-        bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+        bluemchen.display.WriteString(bias_str, Font_6x8, true);
+    }
+    else if (currentMapping == MAP_CURVE) {
+        bluemchen.display.SetCursor(6, 16);
+        bluemchen.display.WriteString(curve_strings[LocalSettings.curves[currentParam]], Font_6x8, true);
     }
     else {
         // CV or pot mapping
         bluemchen.display.SetCursor(0, 16 + 8*mappingMenuSelection);
-        str = ">";
-        bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+        bluemchen.display.WriteString(">", Font_6x8, true);
 
         bool inverted = editing && mappingMenuSelection == MAPOPT_SIGN;
         if (inverted) {
             bluemchen.display.DrawRect(11, 16, 17, 22, true, true);
         }
         bluemchen.display.SetCursor(12, 16);
-        str = sign_strings[LocalSettings.mapping_indices[currentParam][(currentMapping - MAP_POT1)*2]];
-        bluemchen.display.WriteString(str.c_str(), Font_6x8, !inverted);
+        bluemchen.display.WriteString(sign_strings[LocalSettings.mapping_indices[currentParam][(currentMapping - MAP_POT1)*2]], Font_6x8, !inverted);
 
         inverted = editing && mappingMenuSelection == MAPOPT_MULTIPLIER;
         if (inverted) {
             bluemchen.display.DrawRect(11, 24, 17, 32, true, true);
         }
         bluemchen.display.SetCursor(12, 24);
-        str = multiplier_strings[LocalSettings.mapping_indices[currentParam][(currentMapping - MAP_POT1)*2+1]];
-        bluemchen.display.WriteString(str.c_str(), Font_6x8, !inverted);
+        bluemchen.display.WriteString(multiplier_strings[LocalSettings.mapping_indices[currentParam][(currentMapping - MAP_POT1)*2+1]], Font_6x8, !inverted);
+    }
+}
+
+void ReverbMenu() {
+    bluemchen.display.SetCursor(0, 0);
+    bluemchen.display.WriteString("REVERB", Font_6x8, true);
+
+    // draw 3 of the options, starting with the one before the current selection
+    int firstOptionToDraw = std::min(std::max(LocalSettings.reverb - 1, 0), REVERB_COUNT - 3);
+    for (int r = firstOptionToDraw; r < REVERB_COUNT && r - firstOptionToDraw < 3; r++) {
+        if (r == LocalSettings.reverb) {
+            bluemchen.display.SetCursor(0, 8*(1+r-firstOptionToDraw));
+            bluemchen.display.WriteString(">", Font_6x8, true);
+        }
+        bluemchen.display.SetCursor(6, 8*(1+r-firstOptionToDraw));
+        bluemchen.display.WriteString(reverb_strings[r], Font_6x8, true);
+    }
+}
+
+void ReflectionsMenu() {
+    bluemchen.display.SetCursor(0, 0);
+    bluemchen.display.WriteString("REFLECT", Font_6x8, true);
+
+    // draw 3 of the responses, starting with the one before the current selection
+    int count = int(ir_bank.Count());
+    int firstOptionToDraw = std::min(std::max(LocalSettings.reflections - 1, 0), std::max(count - 3, 0));
+    for (int r = firstOptionToDraw; r < count && r - firstOptionToDraw < 3; r++) {
+        if (r == LocalSettings.reflections) {
+            bluemchen.display.SetCursor(0, 8*(1+r-firstOptionToDraw));
+            bluemchen.display.WriteString(">", Font_6x8, true);
+        }
+        bluemchen.display.SetCursor(6, 8*(1+r-firstOptionToDraw));
+        bluemchen.display.WriteString(ir_bank.Name(r), Font_6x8, true);
+    }
+}
+
+// Estimated audio load in percent for a sample rate and block size, with
+// the reverb that is selected
+float estimatedLoad(int samplerate_index, int blocksize_index) {
+    float rate = samplerate_values[samplerate_index];
+    float callbacks = rate / float(blocksize_values[blocksize_index]);
+    float cycles = rate * (reverb_cycles[LocalSettings.reverb] + ENGINE_CYCLES) + callbacks * CALLBACK_CYCLES;
+    if (LocalSettings.reflections != 0) {
+        cycles += rate * EARLY_CYCLES;
+    }
+    if (LocalSettings.cv_rate == CV_RATE_AUDIO) {
+        // the blocks are split at every CV point
+        cycles += (callbacks + 2.0f * CV_SAMPLE_RATE) * CV_SEGMENT_CYCLES;
+    }
+    return 100.0f * cycles / CPU_HZ;
+}
+
+float projectedLoad() {
+    float load = estimatedLoad(LocalSettings.samplerate, LocalSettings.blocksize);
+#ifdef KVERB_DIAGNOSTICS
+    // correct the estimate by how far off it is for the running settings,
+    // unless the engine is asleep and the measurement says nothing
+    float measured = diagnostics.GetAverageLoad();
+    if (measured > 0.0f && !engine.IsSleeping() && LocalSettings.reverb == active_reverb
+        && LocalSettings.reflections == active_reflections && LocalSettings.cv_rate == active_cv_rate) {
+        load *= measured / estimatedLoad(active_samplerate, active_blocksize);
+    }
+#endif
+    return load;
+}
+
+void AudioMenu() {
+    bluemchen.display.SetCursor(0, 0);
+    bluemchen.display.WriteString("AUDIO", Font_6x8, true);
+
+    // draw 3 of the rows, starting with the one before the current selection
+    int firstRow = std::min(std::max(audioMenuSelection - 1, 0), AUDIO_OPTION_COUNT - 3);
+    char row_str[16];
+    for (int r = firstRow; r < AUDIO_OPTION_COUNT && r - firstRow < 3; r++) {
+        int y = 8*(1+r-firstRow);
+        if (r == audioMenuSelection) {
+            bluemchen.display.SetCursor(0, y);
+            bluemchen.display.WriteString(">", Font_6x8, true);
+        }
+        bool inverted = editing && r == audioMenuSelection;
+        switch (r) {
+            case AUDIO_SAMPLERATE:
+                snprintf(row_str, sizeof(row_str), "rate %s", samplerate_strings[LocalSettings.samplerate]);
+                break;
+            case AUDIO_BLOCKSIZE:
+                snprintf(row_str, sizeof(row_str), "blk  %u", unsigned(blocksize_values[LocalSettings.blocksize]));
+                break;
+            case AUDIO_CV_RATE:
+                snprintf(row_str, sizeof(row_str), "cv   %s", cv_rate_strings[LocalSettings.cv_rate]);
+                break;
+            default: {
+                float load = projectedLoad();
+                snprintf(row_str, sizeof(row_str), "ld %3.0f%%%s", load, load > MAX_AUDIO_LOAD ? "!" : "");
+                break;
+            }
+        }
+        if (inverted) {
+            bluemchen.display.DrawRect(5, y, 63, y+7, true, true);
+        }
+        bluemchen.display.SetCursor(6, y);
+        bluemchen.display.WriteString(row_str, Font_6x8, !inverted);
+    }
+}
+
+void MidiMenu() {
+    bluemchen.display.SetCursor(0, 0);
+    bluemchen.display.WriteString("MIDI", Font_6x8, true);
+
+    for (int r = 0; r < MIDI_ROW_COUNT; r++) {
+        int y = 8*(1+r);
+        if (r == midiMenuSelection) {
+            bluemchen.display.SetCursor(0, y);
+            bluemchen.display.WriteString(">", Font_6x8, true);
+        }
+
+        // the CC rows show MIDI1/2's controller number and its last value
+        char row_str[16];
+        if (r == MIDI_ROW_CHANNEL) {
+            snprintf(row_str, sizeof(row_str), "in   %s", midiChannelString());
+        }
+        else {
+            int m = r - MIDI_ROW_CC1;
+            snprintf(row_str, sizeof(row_str), "%d:%3d %3d", m + 1, LocalSettings.midi_cc[m], midiValue(m));
+        }
+        bool inverted = editing && r == midiMenuSelection;
+        if (inverted) {
+            bluemchen.display.DrawRect(5, y, 63, y+7, true, true);
+        }
+        bluemchen.display.SetCursor(6, y);
+        bluemchen.display.WriteString(row_str, Font_6x8, !inverted);
+    }
+}
+
+// Pixels of width for a linear level, 0 at -range_db and below
+int meterWidth(float level, float range_db, int width) {
+    float db = 20.0f * log10f(level + 1e-9f);
+    return std::min(std::max(int((db + range_db) * float(width) / range_db), 0), width);
+}
+
+// RMS as a filled bar, with the peak as a line past its end
+void drawMeter(const char *label, int y, float rms, float peak) {
+    bluemchen.display.SetCursor(0, y);
+    bluemchen.display.WriteString(label, Font_6x8, true);
+    int rms_width = meterWidth(rms, METER_RANGE_DB, METER_BAR_WIDTH);
+    if (rms_width > 0) {
+        bluemchen.display.DrawRect(METER_BAR_X, y + 1, METER_BAR_X + rms_width - 1, y + 6, true, true);
+    }
+    int peak_x = METER_BAR_X + std::max(meterWidth(peak, METER_RANGE_DB, METER_BAR_WIDTH) - 1, 0);
+    bluemchen.display.DrawLine(peak_x, y, peak_x, y + 7, true);
+}
+
+// Reads the latest levels, and adds each new snapshot to the history
+const LevelMeter::Levels &readLevels() {
+    const LevelMeter::Levels &levels = engine.ReadLevels();
+    if (levels.count != meter_count) {
+        meter_count = levels.count;
+        meter_history[meter_history_pos] = uint8_t(meterWidth(levels.wet_rms, METER_RANGE_DB, 8));
+        meter_history_pos = (meter_history_pos + 1) % METER_HISTORY;
+    }
+    return levels;
+}
+
+void MeterMenu() {
+    const LevelMeter::Levels &levels = readLevels();
+    drawMeter("in", 0, levels.in_rms, levels.in_peak);
+    drawMeter("wet", 8, levels.wet_rms, levels.wet_peak);
+
+    // gain reduction grows from the right
+    bluemchen.display.SetCursor(0, 16);
+    bluemchen.display.WriteString("GR", Font_6x8, true);
+    int reduction = METER_BAR_WIDTH - meterWidth(levels.duck_gain, METER_DUCK_RANGE_DB, METER_BAR_WIDTH);
+    if (reduction > 0) {
+        bluemchen.display.DrawRect(63 - reduction + 1, 17, 63, 22, true, true);
+    }
+
+    // the tail, oldest on the left
+    for (int x = 0; x < METER_HISTORY; x++) {
+        int height = meter_history[(meter_history_pos + x) % METER_HISTORY];
+        if (height > 0) {
+            bluemchen.display.DrawLine(x, 31 - height + 1, x, 31, true);
+        }
+    }
+}
+
+void PresetMenu() {
+    bluemchen.display.SetCursor(0, 0);
+    bluemchen.display.WriteString("PRESET", Font_6x8, true);
+
+    // draw 3 of the rows, starting with the one before the current selection
+    int firstRow = std::min(std::max(presetMenuSelection - 1, 0), PRESET_ROW_COUNT - 3);
+    for (int r = firstRow; r < PRESET_ROW_COUNT && r - firstRow < 3; r++) {
+        int y = 8*(1+r-firstRow);
+        if (r == presetMenuSelection) {
+            bluemchen.display.SetCursor(0, y);
+            bluemchen.display.WriteString(">", Font_6x8, true);
+        }
+
+        char row_str[16];
+        switch (r) {
+            case PRESET_ROW_SLOT:
+                // "-" marks an empty slot
+                snprintf(row_str, sizeof(row_str), "slot %d%s", presetMenuSlot + 1, presets.Get(presetMenuSlot) ? "" : "-");
+                break;
+            case PRESET_ROW_LOAD:
+                snprintf(row_str, sizeof(row_str), "load");
+                break;
+            case PRESET_ROW_SAVE:
+                snprintf(row_str, sizeof(row_str), "save");
+                break;
+            default:
+                snprintf(row_str, sizeof(row_str), "cv   %s", preset_cv_strings[LocalSettings.preset_cv]);
+                break;
+        }
+        bool inverted = editing && r == presetMenuSelection;
+        if (inverted) {
+            bluemchen.display.DrawRect(5, y, 63, y+7, true, true);
+        }
+        bluemchen.display.SetCursor(6, y);
+        bluemchen.display.WriteString(row_str, Font_6x8, !inverted);
     }
 }
 
 void ConfirmationMenu() {
     bluemchen.display.SetCursor(0, 0);
-    std::string str = "RESET TO";
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString("RESET TO", Font_6x8, true);
     
     bluemchen.display.SetCursor(0, 8);
-    str = "DEFAULTS?";
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString("DEFAULTS?", Font_6x8, true);
     
     // NO option
     if (confirmSelection == CONFIRM_NO) {
         bluemchen.display.SetCursor(0, 16);
-        str = ">";
-        bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+        bluemchen.display.WriteString(">", Font_6x8, true);
     }
     bluemchen.display.SetCursor(6, 16);
-    str = "NO";
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString("NO", Font_6x8, true);
     
     // YES option
     if (confirmSelection == CONFIRM_YES) {
         bluemchen.display.SetCursor(0, 24);
-        str = ">";
-        bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+        bluemchen.display.WriteString(">", Font_6x8, true);
     }
     bluemchen.display.SetCursor(6, 24);
-    str = "YES";
-    bluemchen.display.WriteString(str.c_str(), Font_6x8, true);
+    bluemchen.display.WriteString("YES", Font_6x8, true);
+}
+
+#ifdef KVERB_DIAGNOSTICS
+// Rows of the memory map on the diagnostics page
+int memoryRowCount() {
+    int rows = 0;
+    for (int r = 0; r < MEMORY_REGION_COUNT; r++) {
+        rows += 1 + int(memory_map.GetArena(static_cast<MemoryRegion>(r)).GetAllocationCount());
+    }
+    return rows;
+}
+
+int diagnosticsRowCount() {
+    return DIAG_ROW_MEMORY + memoryRowCount();
+}
+
+// Bytes in 4 characters, kilobytes up to 999k
+void formatBytes(char *str, size_t size, size_t bytes) {
+    if (bytes < 1000 * 1024) {
+        snprintf(str, size, "%uk", unsigned((bytes + 1023) / 1024));
+    }
+    else {
+        snprintf(str, size, "%.1fM", float(bytes) / (1024.0f * 1024.0f));
+    }
+}
+
+// A region's use, or one of its components, indented
+void memoryRow(int row, char *str, size_t size) {
+    char bytes_str[8];
+    for (int r = 0; r < MEMORY_REGION_COUNT; r++) {
+        const MemoryArena &arena = memory_map.GetArena(static_cast<MemoryRegion>(r));
+        if (row == 0) {
+            formatBytes(bytes_str, sizeof(bytes_str), arena.GetUsed());
+            snprintf(str, size, "%-6s%4s", memory_region_strings[r], bytes_str);
+            return;
+        }
+        if (row <= int(arena.GetAllocationCount())) {
+            const MemoryArena::Allocation &allocation = arena.GetAllocation(row - 1);
+            formatBytes(bytes_str, sizeof(bytes_str), allocation.bytes);
+            snprintf(str, size, " %-5s%4s", allocation.owner, bytes_str);
+            return;
+        }
+        row -= 1 + int(arena.GetAllocationCount());
+    }
+    str[0] = '\0';
+}
+
+void DiagnosticsMenu() {
+    bluemchen.display.SetCursor(0, 0);
+    bluemchen.display.WriteString("DIAG", Font_6x8, true);
+    bluemchen.display.SetCursor(36, 0);
+    bluemchen.display.WriteString(diagnostics_mode_strings[diagnosticsMode], Font_6x8, true);
+
+    for (int r = diagnosticsRow; r < diagnosticsRowCount() && r - diagnosticsRow < 3; r++) {
+        char row_str[16];
+        switch (r) {
+            case DIAG_ROW_LOAD:
+                snprintf(row_str, sizeof(row_str), "ld %5.1f%%", diagnostics.GetAverageLoad());
+                break;
+            case DIAG_ROW_PEAK_LOAD:
+                snprintf(row_str, sizeof(row_str), "pk %5.1f%%", diagnostics.GetPeakLoad());
+                break;
+            case DIAG_ROW_WORST_LOAD:
+                snprintf(row_str, sizeof(row_str), "max%5.1f%%", diagnostics.GetWorstLoad());
+                break;
+            case DIAG_ROW_OVERRUNS:
+                snprintf(row_str, sizeof(row_str), "xrun %lu", (unsigned long)diagnostics.GetOverruns());
+                break;
+            case DIAG_ROW_JITTER:
+                snprintf(row_str, sizeof(row_str), "jit %6.1f", diagnostics.GetWorstJitterUs());
+                break;
+            default: {
+                if (r >= DIAG_ROW_MEMORY) {
+                    memoryRow(r - DIAG_ROW_MEMORY, row_str, sizeof(row_str));
+                    break;
+                }
+                Diagnostics::Timer timer = static_cast<Diagnostics::Timer>(r - DIAG_ROW_TIMERS);
+                const Diagnostics::TimerStats &stats = diagnostics.GetTimer(timer);
+                float us = diagnosticsMode == DIAG_AVERAGE ? stats.average_us
+                         : (diagnosticsMode == DIAG_PEAK ? stats.peak_us : stats.worst_us);
+                snprintf(row_str, sizeof(row_str), "%-5s%5.0f", Diagnostics::GetTimerName(timer), us);
+                break;
+            }
+        }
+        bluemchen.display.SetCursor(0, 8*(1+r-diagnosticsRow));
+        bluemchen.display.WriteString(row_str, Font_6x8, true);
+    }
+}
+#endif
+
+void getOledState(OledState &state) {
+    memset(&state, 0, sizeof(state));
+    state.menu = currentMenu;
+    state.param = currentParam;
+    state.mapping = currentMapping;
+    state.selection = mappingMenuSelection;
+    state.editing = editing;
+    state.confirm = confirmSelection;
+    state.reverb = LocalSettings.reverb;
+    if (currentMenu == MENU_AUDIO) {
+        state.audio[0] = LocalSettings.samplerate;
+        state.audio[1] = LocalSettings.blocksize;
+        state.audio[2] = LocalSettings.cv_rate;
+        state.audio[3] = int(projectedLoad());
+        state.audio[4] = audioMenuSelection;
+    }
+    state.preset[0] = LocalSettings.preset;
+    if (currentMenu == MENU_PRESET) {
+        state.preset[0] = presetMenuSlot;
+        state.preset[1] = presetMenuSelection;
+        state.preset[2] = presets.Get(presetMenuSlot) != nullptr;
+        state.preset[3] = LocalSettings.preset_cv;
+    }
+    state.midi[0] = LocalSettings.midi_channel;
+    if (currentMenu == MENU_MIDI) {
+        state.midi[1] = LocalSettings.midi_cc[0];
+        state.midi[2] = LocalSettings.midi_cc[1];
+        state.midi[3] = midiMenuSelection;
+        state.midi[4] = midiValue(0);
+        state.midi[5] = midiValue(1);
+    }
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        state.bars[p] = paramVisualWidth(p);
+    }
+    if (currentParam < PARAM_COUNT) {
+        state.bias = int(roundf(LocalSettings.biases[currentParam] * 100.0f));
+        for (int m = 0; m < CTRL_COUNT*2; m++) {
+            state.mapping_indices[m] = LocalSettings.mapping_indices[currentParam][m];
+        }
+        state.curve = LocalSettings.curves[currentParam];
+    }
+    if (currentMenu == MENU_METER) {
+        // redrawn for every new snapshot, at most at OLED_MAX_FPS
+        state.meter = engine.ReadLevels().count;
+    }
+#ifdef KVERB_DIAGNOSTICS
+    if (currentMenu == MENU_DIAGNOSTICS) {
+        // the figures change all the time, refresh at a fixed rate instead
+        state.diagnostics[0] = diagnosticsRow;
+        state.diagnostics[1] = diagnosticsMode;
+        state.diagnostics[2] = int(System::GetNow() / DIAG_REFRESH_MS);
+    }
+#endif
 }
 
 void UpdateOled() {
+    uint32_t now = System::GetNow();
+    if (oled_drawn && now - last_oled_update < 1000 / OLED_MAX_FPS) {
+        return;
+    }
+
+    OledState state;
+    getOledState(state);
+    if (oled_drawn && memcmp(&state, &drawn_state, sizeof(state)) == 0) {
+        return;
+    }
+    drawn_state = state;
+    oled_drawn = true;
+    last_oled_update = now;
+
+    KVERB_DIAG_START(oled_start);
+
     bluemchen.display.Fill(false);
 
     switch (currentMenu) {
@@ -300,20 +1122,56 @@ void UpdateOled() {
         case MENU_CONFIRMATION:
             ConfirmationMenu();
             break;
+        case MENU_REVERB:
+            ReverbMenu();
+            break;
+        case MENU_REFLECTIONS:
+            ReflectionsMenu();
+            break;
+        case MENU_AUDIO:
+            AudioMenu();
+            break;
+        case MENU_PRESET:
+            PresetMenu();
+            break;
+        case MENU_MIDI:
+            MidiMenu();
+            break;
+        case MENU_METER:
+            MeterMenu();
+            break;
+        case MENU_DIAGNOSTICS:
+#ifdef KVERB_DIAGNOSTICS
+            DiagnosticsMenu();
+#endif
+            break;
     }
 
     bluemchen.display.Update();
+    KVERB_DIAG_LAP(oled_start, TIMER_OLED);
 }
 
 void processEncoder() {
     if (!menuSwapped && bluemchen.encoder.Pressed()) {
         if (bluemchen.encoder.TimeHeldMs() > 500) {
             // long press - go back
-            if (currentMenu == MENU_CONFIRMATION) {
+            if (currentMenu == MENU_CONFIRMATION || currentMenu == MENU_REVERB || currentMenu == MENU_REFLECTIONS
+                || currentMenu == MENU_AUDIO || currentMenu == MENU_PRESET || currentMenu == MENU_MIDI
+                || currentMenu == MENU_METER || currentMenu == MENU_DIAGNOSTICS) {
                 // Reset confirmation selection and go back to main menu
                 confirmSelection = CONFIRM_NO;
+                editing = false;
                 currentMenu = MENU_MAIN;
-            } else {
+            }
+#ifdef KVERB_DIAGNOSTICS
+            else if (currentMenu == MENU_MAIN) {
+                // hidden diagnostics page, measuring from when it is opened
+                diagnostics.RequestReset();
+                diagnosticsRow = 0;
+                currentMenu = MENU_DIAGNOSTICS;
+            }
+#endif
+            else {
                 currentMenu = static_cast<MenuState>(std::max(static_cast<int>(currentMenu) - 1, int(MENU_MAIN)));
             }
             menuSwapped = true;
@@ -323,7 +1181,7 @@ void processEncoder() {
     if (bluemchen.encoder.FallingEdge()) {
         if (!menuSwapped) {
             // short press
-            if (currentMenu == MENU_MAPPING && currentMapping != MAP_BIAS) {
+            if (currentMenu == MENU_MAPPING && currentMapping != MAP_BIAS && currentMapping != MAP_CURVE) {
                 if (editing) {
                     trigger_save = true;
                 }
@@ -339,7 +1197,56 @@ void processEncoder() {
                 confirmSelection = CONFIRM_NO;
                 currentMenu = MENU_MAIN;
             }
-            else if (currentMenu == MENU_MAIN && currentParam == PARAM_COUNT) {
+#ifdef KVERB_DIAGNOSTICS
+            else if (currentMenu == MENU_DIAGNOSTICS) {
+                diagnosticsMode = static_cast<DiagnosticsMode>((diagnosticsMode + 1) % DIAG_MODE_COUNT);
+            }
+#endif
+            else if (currentMenu == MENU_REVERB || currentMenu == MENU_REFLECTIONS || currentMenu == MENU_METER) {
+                currentMenu = MENU_MAIN;
+            }
+            else if (currentMenu == MENU_AUDIO) {
+                // the load row is only a readout
+                editing = !editing && audioMenuSelection != AUDIO_LOAD;
+            }
+            else if (currentMenu == MENU_MIDI) {
+                editing = !editing;
+            }
+            else if (currentMenu == MENU_PRESET) {
+                if (presetMenuSelection == PRESET_ROW_LOAD) {
+                    recallPreset(presetMenuSlot);
+                }
+                else if (presetMenuSelection == PRESET_ROW_SAVE) {
+                    savePreset(presetMenuSlot);
+                }
+                else {
+                    editing = !editing;
+                }
+            }
+            else if (currentMenu == MENU_MAIN && currentParam == MAIN_PRESET) {
+                presetMenuSlot = LocalSettings.preset;
+                presetMenuSelection = PRESET_ROW_SLOT;
+                currentMenu = MENU_PRESET;
+            }
+            else if (currentMenu == MENU_MAIN && currentParam == MAIN_AUDIO) {
+                audioMenuSelection = AUDIO_SAMPLERATE;
+                currentMenu = MENU_AUDIO;
+            }
+            else if (currentMenu == MENU_MAIN && currentParam == MAIN_MIDI) {
+                midiMenuSelection = MIDI_ROW_CHANNEL;
+                currentMenu = MENU_MIDI;
+            }
+            else if (currentMenu == MENU_MAIN && currentParam == MAIN_METER) {
+                std::fill(meter_history, meter_history + METER_HISTORY, 0);
+                currentMenu = MENU_METER;
+            }
+            else if (currentMenu == MENU_MAIN && currentParam == MAIN_REVERB) {
+                currentMenu = MENU_REVERB;
+            }
+            else if (currentMenu == MENU_MAIN && currentParam == MAIN_REFLECTIONS) {
+                currentMenu = MENU_REFLECTIONS;
+            }
+            else if (currentMenu == MENU_MAIN && currentParam == MAIN_INIT) {
                 // Selected INIT from main menu
                 currentMenu = MENU_CONFIRMATION;
                 confirmSelection = CONFIRM_NO;
@@ -354,11 +1261,11 @@ void processEncoder() {
     switch (currentMenu) {
         case MENU_MAIN:
             // main menu
-            currentParam = std::min(std::max(int(currentParam+bluemchen.encoder.Increment()), 0), int(PARAM_COUNT));
+            currentParam = std::min(std::max(int(currentParam+bluemchen.encoder.Increment()), 0), int(MAIN_OPTION_COUNT - 1));
             break;
         case MENU_PARAMETER:
             // parameter menu
-            currentMapping = static_cast<MappingType>(std::min(std::max(int(currentMapping+bluemchen.encoder.Increment()), int(MAP_BIAS)), int(MAP_CV2)));
+            currentMapping = static_cast<MappingType>(std::min(std::max(int(currentMapping+bluemchen.encoder.Increment()), int(MAP_BIAS)), int(MAP_CURVE)));
             break;
         case MENU_MAPPING:
             // mapping menu
@@ -379,7 +1286,15 @@ void processEncoder() {
                         LocalSettings.biases[currentParam] + delta,
                         bias_limits[currentParam][0]),
                         bias_limits[currentParam][1]);
-                    trigger_save = true;
+                    settingsChanged();
+                }
+            }
+            else if (currentMapping == MAP_CURVE) {
+                int increment = bluemchen.encoder.Increment();
+                if (increment != 0) {
+                    LocalSettings.curves[currentParam] = std::min(std::max(
+                        LocalSettings.curves[currentParam] + increment, 0), CURVE_COUNT - 1);
+                    settingsChanged();
                 }
             }
             else {
@@ -390,7 +1305,7 @@ void processEncoder() {
                             int(LocalSettings.mapping_indices[currentParam][mappingMenuSelection+(currentMapping - MAP_POT1)*2] + increment),
                             0),
                             mappingMenuSelection == MAPOPT_SIGN ? SIGN_COUNT - 1 : MULT_COUNT - 1);
-                        trigger_save = true;
+                        settingsChanged();
                     }
                 }
                 else {
@@ -402,57 +1317,118 @@ void processEncoder() {
             // confirmation menu
             confirmSelection = static_cast<ConfirmOption>(std::min(std::max(int(confirmSelection + bluemchen.encoder.Increment()), int(CONFIRM_NO)), int(CONFIRM_YES)));
             break;
+        case MENU_REVERB: {
+            int increment = bluemchen.encoder.Increment();
+            if (increment != 0) {
+                LocalSettings.reverb = std::min(std::max(LocalSettings.reverb + increment, 0), REVERB_COUNT - 1);
+                settingsChanged();
+            }
+            break;
+        }
+        case MENU_REFLECTIONS: {
+            int increment = bluemchen.encoder.Increment();
+            if (increment != 0) {
+                LocalSettings.reflections = std::min(std::max(LocalSettings.reflections + increment, 0), int(ir_bank.Count()) - 1);
+                settingsChanged();
+            }
+            break;
+        }
+        case MENU_AUDIO: {
+            int increment = bluemchen.encoder.Increment();
+            if (editing && increment != 0) {
+                if (audioMenuSelection == AUDIO_SAMPLERATE) {
+                    LocalSettings.samplerate = std::min(std::max(LocalSettings.samplerate + increment, 0), SR_COUNT - 1);
+                }
+                else if (audioMenuSelection == AUDIO_BLOCKSIZE) {
+                    LocalSettings.blocksize = std::min(std::max(LocalSettings.blocksize + increment, 0), BLOCK_COUNT - 1);
+                }
+                else {
+                    LocalSettings.cv_rate = std::min(std::max(LocalSettings.cv_rate + increment, 0), CV_RATE_COUNT - 1);
+                }
+                settingsChanged();
+            }
+            else if (!editing) {
+                audioMenuSelection = static_cast<AudioMenuOption>(std::min(std::max(int(audioMenuSelection + increment), int(AUDIO_SAMPLERATE)), int(AUDIO_LOAD)));
+            }
+            break;
+        }
+        case MENU_PRESET: {
+            int increment = bluemchen.encoder.Increment();
+            if (editing && increment != 0) {
+                if (presetMenuSelection == PRESET_ROW_SLOT) {
+                    presetMenuSlot = std::min(std::max(presetMenuSlot + increment, 0), PRESET_COUNT - 1);
+                }
+                else {
+                    LocalSettings.preset_cv = std::min(std::max(LocalSettings.preset_cv + increment, 0), PRESET_CV_COUNT - 1);
+                    cv_preset_slot = -1;
+                    settingsChanged();
+                }
+            }
+            else if (!editing) {
+                presetMenuSelection = static_cast<PresetMenuOption>(std::min(std::max(int(presetMenuSelection + increment), 0), PRESET_ROW_COUNT - 1));
+            }
+            break;
+        }
+        case MENU_MIDI: {
+            int increment = bluemchen.encoder.Increment();
+            if (editing && increment != 0) {
+                if (midiMenuSelection == MIDI_ROW_CHANNEL) {
+                    LocalSettings.midi_channel = std::min(std::max(LocalSettings.midi_channel + increment, 0), 16);
+                }
+                else {
+                    int &cc = LocalSettings.midi_cc[midiMenuSelection - MIDI_ROW_CC1];
+                    cc = std::min(std::max(cc + increment, 0), 127);
+                }
+                settingsChanged();
+            }
+            else if (!editing) {
+                midiMenuSelection = static_cast<MidiMenuOption>(std::min(std::max(int(midiMenuSelection + increment), 0), MIDI_ROW_COUNT - 1));
+            }
+            break;
+        }
+        case MENU_METER:
+            break;
+        case MENU_DIAGNOSTICS:
+#ifdef KVERB_DIAGNOSTICS
+            diagnosticsRow = std::min(std::max(int(diagnosticsRow + bluemchen.encoder.Increment()), 0), diagnosticsRowCount() - 3);
+#endif
+            break;
     }
 }
 
-float calculateMappingEffect(int controlIndex, int mappingIndex) {
-    // Normalize the control value based on its range
-    // Pots (CTRL_KNOB1, CTRL_KNOB2): range 0-1 → normalized to 0-1
-    // CVs (CTRL_CV1, CTRL_CV2): range -1 to +1 → normalized to -1 to +1 (already bipolar)
-    float normalizedValue = cv_values[controlIndex];
-    
-    // Apply multiplier to normalized value
-    switch (mappingIndex) {
-        case MULT_DIV4:
-            return normalizedValue / 4.0f;
-        case MULT_DIV2:
-            return normalizedValue / 2.0f;
-        case MULT_X1:
-            return normalizedValue;
-        case MULT_X2:
-            return normalizedValue * 2.0f;
-        case MULT_X4:
-            return normalizedValue * 4.0f;
+// Preset selection by CV: the voltage picks a slot, or a gate steps
+// through the stored presets
+void processPresetCv() {
+    if (LocalSettings.preset_cv == PRESET_CV_OFF) {
+        return;
     }
-
-    return 0.0f;
-}
-
-void calculateValues() {
-    for (int p = 0; p < PARAM_COUNT; p++) {
-        param_values[p] = LocalSettings.biases[p];
-
-        for (int cv = 0; cv < CTRL_COUNT; cv ++) {
-            switch (LocalSettings.mapping_indices[p][cv*2]) {
-                case SIGN_NEGATIVE:
-                    // negative mapping
-                    param_values[p] -= calculateMappingEffect(cv, LocalSettings.mapping_indices[p][cv*2+1]);
-                    break;
-                case SIGN_OFF:
-                    // no mapping
-                    break;
-                case SIGN_POSITIVE:
-                    // positive mapping
-                    param_values[p] += calculateMappingEffect(cv, LocalSettings.mapping_indices[p][cv*2+1]);
-                    break;
+    bool first_cv = LocalSettings.preset_cv == PRESET_CV_CV1 || LocalSettings.preset_cv == PRESET_CV_GATE1;
+    float value = cv_values[first_cv ? CTRL_CV1 : CTRL_CV2];
+
+    if (LocalSettings.preset_cv == PRESET_CV_CV1 || LocalSettings.preset_cv == PRESET_CV_CV2) {
+        float position = (value + 1.0f) * 0.5f * float(PRESET_COUNT);
+        // a little hysteresis around the slot boundaries
+        if (cv_preset_slot < 0 || position < float(cv_preset_slot) - 0.1f || position > float(cv_preset_slot) + 1.1f) {
+            cv_preset_slot = std::min(std::max(int(position), 0), PRESET_COUNT - 1);
+            if (cv_preset_slot != LocalSettings.preset) {
+                recallPreset(cv_preset_slot);
             }
         }
-
-        // clamp all values between 0 and 1
-        param_values[p] = std::min(std::max(param_values[p], 0.0f), 1.0f);
+    }
+    else if (!preset_gate && value > GATE_HIGH) {
+        preset_gate = true;
+        for (int i = 1; i <= PRESET_COUNT; i++) {
+            if (recallPreset((LocalSettings.preset + i) % PRESET_COUNT)) {
+                break;
+            }
+        }
+    }
+    else if (preset_gate && value < GATE_LOW) {
+        preset_gate = false;
     }
 }
 
+// Control task: runs in the main loop, never in the audio interrupt
 void UpdateControls() {
     bluemchen.ProcessAllControls();
 
@@ -460,171 +1436,419 @@ void UpdateControls() {
     cv_values[CTRL_KNOB2] = knob2.Process();
     cv_values[CTRL_CV1] = cv1.Process();
     cv_values[CTRL_CV2] = cv2.Process();
+    cv_values[CTRL_MIDI1] = midi_values[0];
+    cv_values[CTRL_MIDI2] = midi_values[1];
+
+    processPresetCv();
 
-    calculateValues();
+    mod_matrix.Process(cv_values, param_values);
+
+    if (recall_fading) {
+        float elapsed = float((audio_block_count - recall_start_block) * blocksize_values[active_blocksize]) / samplerate;
+        float fade = elapsed / PRESET_FADE_TIME;
+        if (fade >= 1.0f) {
+            recall_fading = false;
+        }
+        else {
+            for (int p = 0; p < PARAM_COUNT; p++) {
+                param_values[p] = recall_from[p] + (param_values[p] - recall_from[p]) * fade;
+            }
+        }
+    }
 
     processEncoder();
 }
 
-void AudioCallback(AudioHandle::InputBuffer in, AudioHandle::OutputBuffer out, size_t size) {
-    float dryL, dryR, wetL, wetR, sendL, sendR;
-   
-    bluemchen.ProcessAnalogControls();
-    
-    // Update compressor parameters based on ducking amount
-    float duck_amount = param_values[DUCK];
-    if (duck_amount > 0.01f) {
-        // Convert 0-1 range to useful compressor parameters
-        // Higher duck_amount = more aggressive ducking
-        float threshold = -30.0f + (duck_amount * 25.0f); // -30dB to -5dB
-        float ratio = 1.0f + (duck_amount * 9.0f);         // 1:1 to 10:1
-        float attack = 0.001f + ((1.0f - duck_amount) * 0.019f); // 1ms to 20ms
-        float release = 0.05f + ((1.0f - duck_amount) * 0.45f);  // 50ms to 500ms
-        
-        sidechain[0].SetThreshold(threshold);
-        sidechain[0].SetRatio(ratio);
-        sidechain[0].SetAttack(attack);
-        sidechain[0].SetRelease(release);
-        
-        sidechain[1].SetThreshold(threshold);
-        sidechain[1].SetRatio(ratio);
-        sidechain[1].SetAttack(attack);
-        sidechain[1].SetRelease(release);
+void PublishParams() {
+    ParamSnapshot &snapshot = param_snapshot.WriteBuffer();
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        snapshot.values[p] = param_values[p];
     }
-    
-    for(size_t i = 0; i < size; i++) {
-        verb.SetFeedback(param_values[FEED]);
-
-        // transform the LPF value from a 0-1 range to exponential hertz
-        float lpf_freq = param_values[LPF] * 100.0f;
-        lpf_freq = lpf_freq * lpf_freq * 2.0f;
-        verb.SetLpFreq(lpf_freq);
-
-        // transform the HPF value from a 0-1 range to exponential hertz
-        float hpf_freq = param_values[HPF] * 100.0f;
-        hpf_freq = hpf_freq * hpf_freq * 2.0f;
-        hpf[0].SetFreq(hpf_freq);
-        hpf[1].SetFreq(hpf_freq);
-
-        // Read Inputs (only stereo in are used)
-        dryL = in[0][i];
-        dryR = in[1][i];
-
-        // Send Signal to Reverb with high-pass filtering and pre-delay
-        sendL = dryL * param_values[WET];
-        sendR = dryR * param_values[WET];
-        
-        // Apply high-pass filter before reverb
-        hpf[0].Process(sendL);
-        sendL = hpf[0].High();
-        hpf[1].Process(sendR);
-        sendR = hpf[1].High();
-        
-        // Apply pre-delay
-        float predly_samples = param_values[PREDLY] * samplerate;
-        predelay[0].Write(sendL);
-        predelay[1].Write(sendR);
-        sendL = predelay[0].Read(predly_samples);
-        sendR = predelay[1].Read(predly_samples);
-        
-        verb.Process(sendL, sendR, &wetL, &wetR);
-
-        // Dc Block
-        wetL = blk[0].Process(wetL);
-        wetR = blk[1].Process(wetR);
-
-        // Apply sidechain ducking if enabled
-        if (duck_amount > 0.01f) {
-            // Use dry signal as sidechain key to duck the wet signal
-            wetL = sidechain[0].Process(wetL, dryL);
-            wetR = sidechain[1].Process(wetR, dryR);
-        }
-
-        // Out 1 and 2 are Mixed
-        out[0][i] = (dryL * param_values[DRY]) + wetL;
-        out[1][i] = (dryR * param_values[DRY]) + wetR;
-
-        // Out 3 and 4 are just wet
-        out[2][i] = wetL;
-        out[3][i] = wetR;
+
+    // preset recalls fade at block rate
+    snapshot.mapped = !recall_fading;
+    snapshot.cv_audio_rate = active_cv_rate == CV_RATE_AUDIO && !recall_fading;
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        snapshot.base[p] = mod_matrix.GetBias(p);
+        for (int c = CTRL_KNOB1; c < CTRL_MIDI1; c++) {
+            snapshot.base[p] += mod_matrix.GetCoefficient(p, c) * cv_values[c];
+        }
+        snapshot.midi_coefficients[p][0] = mod_matrix.GetCoefficient(p, CTRL_MIDI1);
+        snapshot.midi_coefficients[p][1] = mod_matrix.GetCoefficient(p, CTRL_MIDI2);
+        snapshot.curves[p] = mod_matrix.GetCurve(p);
     }
-    UpdateControls();
+    for (int a = 0; a < AUDIO_RATE_COUNT; a++) {
+        int p = audio_rate_params[a];
+        snapshot.cv_coefficients[a][0] = mod_matrix.GetCoefficient(p, CTRL_CV1);
+        snapshot.cv_coefficients[a][1] = mod_matrix.GetCoefficient(p, CTRL_CV2);
+        if (snapshot.cv_audio_rate) {
+            snapshot.base[p] -= snapshot.cv_coefficients[a][0] * cv_values[CTRL_CV1]
+                              + snapshot.cv_coefficients[a][1] * cv_values[CTRL_CV2];
+        }
+    }
+
+    snapshot.midi_channel = LocalSettings.midi_channel;
+    snapshot.midi_cc[0] = LocalSettings.midi_cc[0];
+    snapshot.midi_cc[1] = LocalSettings.midi_cc[1];
+
+    param_snapshot.Publish();
 }
 
-int main(void) {
-    bluemchen.Init();
-    samplerate = bluemchen.AudioSampleRate();
+// Sampling timer interrupt for the audio-rate CV path
+void CvTimerCallback(void *data) {
+    // -1 to 1, as cv1 and cv2
+    float values[2] = {cv1_fast.Process() * 2.0f - 1.0f, cv2_fast.Process() * 2.0f - 1.0f};
+    cv_sampler.Push(values);
+}
 
-    verb.Init(samplerate);
-    verb.SetFeedback(param_values[FEED]);
-    verb.SetLpFreq(param_values[LPF]);
+// UART receive interrupt, once the line goes idle or the DMA reaches a half
+// of the buffer
+void MidiRxCallback(uint8_t *data, size_t size, void *context, UartHandler::Result result) {
+    if (result == UartHandler::Result::OK) {
+        midi_input.Receive(data, size, System::GetTick());
+    }
+}
 
-    DefaultSettings = {
-        {1, 0, 1, 0.2, 0.5, 0, 0}, //biases (added pre-delay = 0)
+// Applies a control change to MIDI1 and MIDI2, if it is for them
+KVERB_ITCM void applyMidi(const ParamSnapshot &snapshot, const MidiInput<>::ControlChange &message) {
+    if (snapshot.midi_channel != 0 && message.channel != snapshot.midi_channel - 1) {
+        return;
+    }
+    for (int m = 0; m < 2; m++) {
+        if (message.controller == snapshot.midi_cc[m]) {
+            midi_values[m] = float(message.value) / 127.0f;
+        }
+    }
+}
 
-        { // mapping_indices - all set to SIGN_OFF and MULT_X1
-            {SIGN_NEGATIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // dry
-            {SIGN_POSITIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // wet
-            {SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // LPF
-            {SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // HPF
-            {SIGN_OFF, MULT_X1, SIGN_POSITIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // feedback
-            {SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // ducking
-            {SIGN_OFF, MULT_X1, SIGN_POSITIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // pre-delay
+// Splits the block at each MIDI message, at its offset, and wherever the
+// sampled CV trajectory bends, and maps the parameters for each span. The
+// engine ramps the audio-rate parameters linearly over each span, so they
+// follow the CV sample by sample and a MIDI change starts where it is due,
+// and runs its stages and per-block work once for the whole block.
+KVERB_ITCM void ProcessMapped(const ParamSnapshot &snapshot, AudioHandle::InputBuffer in, AudioHandle::OutputBuffer out, size_t size) {
+    float values[PARAM_COUNT];
+    float cv[2] = {0.0f, 0.0f};
+    MidiInput<>::ControlChange message;
+    size_t message_offset;
+    bool have_message = midi_input.Next(message, message_offset);
+
+    engine.BeginBlock(in, out, size);
+    for (size_t offset = 0; offset < size;) {
+        while (have_message && message_offset <= offset) {
+            applyMidi(snapshot, message);
+            have_message = midi_input.Next(message, message_offset);
+        }
+        size_t frames = (have_message ? message_offset : size) - offset;
+        if (snapshot.cv_audio_rate) {
+            frames = cv_sampler.Advance(frames, cv);
         }
-    };
 
-    SavedSettings.Init(DefaultSettings);
+        for (int p = 0; p < PARAM_COUNT; p++) {
+            values[p] = snapshot.base[p] + snapshot.midi_coefficients[p][0] * midi_values[0]
+                                         + snapshot.midi_coefficients[p][1] * midi_values[1];
+        }
+        if (snapshot.cv_audio_rate) {
+            for (int a = 0; a < AUDIO_RATE_COUNT; a++) {
+                values[audio_rate_params[a]] += snapshot.cv_coefficients[a][0] * cv[0] + snapshot.cv_coefficients[a][1] * cv[1];
+            }
+        }
+        for (int p = 0; p < PARAM_COUNT; p++) {
+            values[p] = mod_curves.Map(snapshot.curves[p], values[p]);
+        }
 
-    // Load saved settings into LocalSettings
-    LocalSettings = SavedSettings.GetSettings();
+        engine.AddSpan(frames, values);
+        offset += frames;
+    }
+    engine.EndBlock();
+}
+
+KVERB_ITCM void AudioCallback(AudioHandle::InputBuffer in, AudioHandle::OutputBuffer out, size_t size) {
+    KVERB_DIAG_BEGIN_CALLBACK();
 
-    // Initialize sidechain compressors
-    sidechain[0].Init(samplerate);
-    sidechain[1].Init(samplerate);
-    sidechain[0].AutoMakeup(false); // No makeup gain for ducking
-    sidechain[1].AutoMakeup(false);
+    midi_input.BeginBlock(System::GetTick(), size);
 
-    // Initialize high-pass filters
-    hpf[0].Init(samplerate);
-    hpf[1].Init(samplerate);
-    hpf[0].SetRes(0.5f); // Set resonance to a neutral value
-    hpf[1].SetRes(0.5f);
+    const ParamSnapshot &snapshot = param_snapshot.Read();
+    if (snapshot.cv_audio_rate && !cv_sampler_running) {
+        cv_sampler.Reset(CV_SAMPLE_RATE / samplerate);
+        cv_sampler_running = true;
+    }
+    cv_sampler_running = snapshot.cv_audio_rate;
+
+    if (snapshot.mapped) {
+        ProcessMapped(snapshot, in, out, size);
+    }
+    else {
+        // the control task picks the messages up for the next block
+        MidiInput<>::ControlChange message;
+        size_t message_offset;
+        while (midi_input.Next(message, message_offset)) {
+            applyMidi(snapshot, message);
+        }
+        engine.SetParams(snapshot.values);
+        engine.Process(in, out, size);
+    }
 
-    // Initialize pre-delay lines
-    predelay[0].Init();
-    predelay[1].Init();
-    predelay[0].SetDelay(1.0f); // Start with minimal delay
-    predelay[1].SetDelay(1.0f);
+    KVERB_DIAG_END_CALLBACK(size);
 
+    audio_block_count = audio_block_count + 1;
+}
+
+void initControls() {
+    // Parameter keeps its own copy of the control, including the filter
+    // coefficients for the control rate, so this follows the block size
     knob1.Init(bluemchen.controls[bluemchen.CTRL_1], 0.0f, 1.0f, Parameter::LINEAR);
     knob2.Init(bluemchen.controls[bluemchen.CTRL_2], 0.0f, 1.0f, Parameter::LINEAR);
 
     cv1.Init(bluemchen.controls[bluemchen.CTRL_3], -1.0f, 1.0f, Parameter::LINEAR);
     cv2.Init(bluemchen.controls[bluemchen.CTRL_4], -1.0f, 1.0f, Parameter::LINEAR);
-    
-    blk[0].Init(samplerate);
-    blk[1].Init(samplerate);
 
-    bluemchen.StartAdc();
+    // copies of the board's controls, so they keep its ADC channel and
+    // polarity, then set for the timer's rate instead of the block rate
+    cv1_fast = bluemchen.controls[bluemchen.CTRL_3];
+    cv2_fast = bluemchen.controls[bluemchen.CTRL_4];
+    cv1_fast.SetSampleRate(CV_SAMPLE_RATE);
+    cv2_fast.SetSampleRate(CV_SAMPLE_RATE);
+}
+
+void initCvTimer() {
+    TimerHandle::Config config;
+    config.periph = TimerHandle::Config::Peripheral::TIM_5;
+    config.dir = TimerHandle::Config::CounterDir::UP;
+    config.enable_irq = true;
+    cv_timer.Init(config);
+    cv_timer.SetPeriod(uint32_t(float(cv_timer.GetFreq()) / CV_SAMPLE_RATE) - 1);
+    cv_timer.SetCallback(CvTimerCallback);
+}
+
+// Receives MIDI by DMA into midi_rx_buffer, from then on until power-off
+void initMidi() {
+    midi_input.Init(float(System::GetTickFreq()), MIDI_RX_SIZE / 2);
+
+    UartHandler::Config config;
+    config.periph = UartHandler::Config::Peripheral::USART_1;
+    config.mode = UartHandler::Config::Mode::RX;
+    config.baudrate = 31250;
+    config.pin_config.rx = seed::D14;
+    config.pin_config.tx = seed::D13;
+    midi_uart.Init(config);
+    midi_uart.DmaListenStart(midi_rx_buffer, MIDI_RX_SIZE, MidiRxCallback, nullptr);
+}
+
+// Runs the sampling timer only while the audio-rate CV path is selected
+void applyCvRate() {
+    active_cv_rate = LocalSettings.cv_rate;
+    if (active_cv_rate == CV_RATE_AUDIO) {
+        cv_timer.Start();
+    }
+    else {
+        cv_timer.Stop();
+    }
+}
+
+// Renders the selected early reflection response for the running sample
+// rate, transforms it into the slot the engine is not using and hands it
+// over. Not for the audio callback.
+void loadReflections() {
+    active_reflections = LocalSettings.reflections;
+    size_t length = ir_bank.Load(active_reflections, samplerate, dsp.er_response[0], dsp.er_response[1], EarlyReflections::kMaxLength);
+    er_slot = 1 - er_slot;
+    EarlyReflections::Prepare(er_fft, dsp.er_impulses[er_slot], dsp.er_response[0], dsp.er_response[1], length);
+    engine.SetEarlyReflections(&dsp.er_impulses[er_slot]);
+}
+
+// Places the DSP memory for the sample rate, with the audio stopped. The
+// arenas are sized for 96 kHz, and kverb_bench checks the plan fits at
+// every rate, so this only stops on a build that broke it.
+void allocateDsp() {
+    if (!dsp.Allocate(memory_map, samplerate)) {
+        bluemchen.display.Fill(false);
+        bluemchen.display.SetCursor(0, 0);
+        bluemchen.display.WriteString("NO MEM", Font_6x8, true);
+        bluemchen.display.Update();
+        while (1) {
+        }
+    }
+    reverbs[REVERB_SC] = dsp.verb_sc;
+    reverbs[REVERB_FDN8] = dsp.verb_fdn8;
+    reverbs[REVERB_FDN4] = dsp.verb_fdn4;
+    reverbs[REVERB_FDN8_Q15] = dsp.verb_fdn8_q15;
+    reverbs[REVERB_FDN4_Q15] = dsp.verb_fdn4_q15;
+}
+
+// Starts the audio at the sample rate and block size in LocalSettings,
+// with every DSP object initialized for them
+void startAudio() {
+    active_samplerate = LocalSettings.samplerate;
+    active_blocksize = LocalSettings.blocksize;
+    bluemchen.SetAudioSampleRate(sai_samplerates[active_samplerate]);
+    bluemchen.SetAudioBlockSize(blocksize_values[active_blocksize]);
+    samplerate = bluemchen.AudioSampleRate();
+
+    // the sampling timer reads cv1_fast and cv2_fast, stop it while they
+    // are initialized again
+    cv_timer.Stop();
+    initControls();
+    applyCvRate();
+
+    // the CV playback restarts with the step for the new rate, and the
+    // MIDI timeline with the new block period
+    cv_sampler_running = false;
+    midi_input.Reset();
+
+    allocateDsp();
+
+    // the engine initializes the reverb, no switch is left pending
+    active_reverb = LocalSettings.reverb;
+    engine.Init(samplerate, reverbs[active_reverb], dsp.predelay, dsp.predelay_size, dsp.er_history);
+    // the response depends on the sample rate
+    loadReflections();
+#ifdef KVERB_DIAGNOSTICS
+    diagnostics.Init(samplerate);
+#endif
+
     bluemchen.StartAudio(AudioCallback);
+}
+
+// Fades the output out through the engine's gain ramps before stopping
+// the audio, then starts it again with the new settings. The engine
+// starts from zero gain, so it fades back in by itself.
+void restartAudio() {
+    ParamSnapshot &snapshot = param_snapshot.WriteBuffer();
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        snapshot.values[p] = param_values[p];
+    }
+    snapshot.values[DRY] = 0.0f;
+    snapshot.values[WET] = 0.0f;
+    snapshot.mapped = false;
+    snapshot.cv_audio_rate = false;
+    param_snapshot.Publish();
+
+    // one block to pick up the snapshot, one to ramp down
+    uint32_t start_block = audio_block_count;
+    while (audio_block_count - start_block < 2) {
+    }
+
+    bluemchen.StopAudio();
+    startAudio();
+}
+
+int main(void) {
+    LoadItcm();
+
+    bluemchen.Init();
+
+    DefaultSettings = {
+        {1, 0, 1, 0.2, 0.5, 0, 0, 0}, //biases (added pre-delay = 0, early reflections = 0)
+
+        { // mapping_indices - all set to SIGN_OFF and MULT_X1
+            {SIGN_NEGATIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // dry
+            {SIGN_POSITIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // wet
+            {SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // LPF
+            {SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // HPF
+            {SIGN_OFF, MULT_X1, SIGN_POSITIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // feedback
+            {SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // ducking
+            {SIGN_OFF, MULT_X1, SIGN_POSITIVE, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // pre-delay
+            {SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1, SIGN_OFF, MULT_X1}, // early reflections
+        },
+
+        {CURVE_LINEAR, CURVE_LINEAR, CURVE_LINEAR, CURVE_LINEAR, CURVE_LINEAR, CURVE_LINEAR, CURVE_LINEAR, CURVE_LINEAR}, // curves
+
+        REVERB_SC,
+        1, // "room" reflections, mixed in with the early bias
+
+        SR_48K,
+        BLOCK_48,
+
+        0, // preset
+        PRESET_CV_OFF,
+
+        CV_RATE_BLOCK,
+
+        0, // any MIDI channel
+        {1, 11}, // mod wheel and expression
+    };
+
+    SavedSettings.Init(DefaultSettings);
+    presets.Init(SettingsJournal<Settings>::kRegionSize);
+    // an image of early reflection responses may be flashed after the presets
+    ir_bank.Init(reinterpret_cast<const uint8_t *>(
+        bluemchen.seed.qspi.GetData(SettingsJournal<Settings>::kRegionSize + PresetBank<Preset, PRESET_COUNT>::kRegionSize)));
+    er_fft.Init();
+    memory_map.Init(MEMORY_DTCM, dtcm_arena, sizeof(dtcm_arena));
+    memory_map.Init(MEMORY_AXI_SRAM, axi_arena, sizeof(axi_arena));
+    memory_map.Init(MEMORY_D2_SRAM, d2_arena, sizeof(d2_arena));
+    memory_map.Init(MEMORY_SDRAM, sdram_arena, sizeof(sdram_arena));
+
+    // Load saved settings into LocalSettings
+    LocalSettings = SavedSettings.GetSettings();
+    if (LocalSettings.reflections >= int(ir_bank.Count())) {
+        // saved with a bank image that is gone
+        LocalSettings.reflections = 0;
+    }
+    mod_matrix.Init();
+    buildModMatrix();
+
+    bluemchen.StartAdc();
+
+    initControls();
+    initCvTimer();
+    initMidi();
+    UpdateControls();
+    param_snapshot.Init(ParamSnapshot());
+    PublishParams();
+
+    startAudio();
+
+    uint32_t last_control_block = audio_block_count;
 
     while (1) {
-        UpdateOled();
-		if(trigger_save) {
-			trigger_save = false;
+        // Run the controls once per audio block, at the rate they were
+        // initialized for, and hand the new values to the audio callback
+        if (audio_block_count != last_control_block) {
+            last_control_block = audio_block_count;
+            UpdateControls();
+            PublishParams();
+        }
 
-            Settings &SavedSettingsPointer = SavedSettings.GetSettings();
+        // Reverbs are switched one at a time, the new one is cleared here
+        // rather than in the audio callback
+        if (LocalSettings.reverb != active_reverb && !engine.IsReverbPending()) {
+            active_reverb = LocalSettings.reverb;
+            reverbs[active_reverb]->Init(samplerate);
+            engine.SetReverb(reverbs[active_reverb]);
+        }
 
-            // copy over the settings
-            for (int p = 0; p < PARAM_COUNT; p++) {
-                for (int m = 0; m < 8; m++) {
-                    SavedSettingsPointer.mapping_indices[p][m] = LocalSettings.mapping_indices[p][m];
-                }
+        // and the reverb the engine went to sleep with is cleared here too
+        engine.ClearReverb();
 
-                SavedSettingsPointer.biases[p] = LocalSettings.biases[p];
-            }
+        // Likewise for the early reflection responses
+        if (LocalSettings.reflections != active_reflections && !engine.IsEarlyReflectionsPending()) {
+            loadReflections();
+        }
+
+        if (LocalSettings.cv_rate != active_cv_rate) {
+            applyCvRate();
+        }
 
-            SavedSettings.Save(); // Writing locally stored settings to the external flash
-		}
+        // Audio settings are applied once the audio page is left, as the
+        // audio restarts for them
+        if (currentMenu != MENU_AUDIO
+            && (LocalSettings.samplerate != active_samplerate || LocalSettings.blocksize != active_blocksize)) {
+            restartAudio();
+        }
+
+        UpdateOled();
+        if (trigger_save) {
+            trigger_save = false;
+            SavedSettings.RequestSave(LocalSettings, System::GetNow());
+        }
+
+        // Writes to the external flash once the user has stopped editing,
+        // and stores presets
+        KVERB_DIAG_START(save_start);
+        if (SavedSettings.Process(System::GetNow()) || presets.Process()) {
+            KVERB_DIAG_LAP(save_start, TIMER_SAVE);
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,351 @@
+#include "KVerbEngine.h"
+#include "Diagnostics.h"
+#include "Placement.h"
+
+#include <algorithm>
+
+// Out-of-class definitions, for when the constants are bound to a
+// reference, as by std::min
+constexpr size_t KVerbEngine::kMaxChunkSize;
+constexpr size_t KVerbEngine::kPreDelayStagingSize;
+constexpr float  KVerbEngine::kSmoothingTime;
+constexpr float  KVerbEngine::kSleepThreshold;
+constexpr float  KVerbEngine::kSleepHoldTime;
+constexpr float  KVerbEngine::kMeterRate;
+
+// Parameters that can change every sample; the rest drive filter coefficients
+static inline bool IsAudioRate(int param) {
+    return param == DRY || param == WET || param == PREDLY || param == EARLY;
+}
+
+// transform a 0-1 range to exponential hertz
+static inline float ToFrequency(float value) {
+    float freq = value * 100.0f;
+    return freq * freq * 2.0f;
+}
+
+void KVerbEngine::Init(float samplerate, ReverbEngine *verb, PreDelayLine::Frame *predelay_buffer, size_t predelay_size,
+                       EarlyReflections::History *er_history) {
+    samplerate_ = samplerate;
+    verb_ = verb;
+    pending_verb_.store(nullptr, std::memory_order_relaxed);
+    clear_verb_.store(nullptr, std::memory_order_relaxed);
+
+    std::fill(target_, target_ + PARAM_COUNT, 0.0f);
+    std::fill(current_, current_ + PARAM_COUNT, 0.0f);
+    std::fill(applied_, applied_ + PARAM_COUNT, -1.0f); // forces the first update
+    chunk_frames_ = 0;
+    chunk_early_ = false;
+    smoothing_frames_ = 0;
+    smoothing_coeff_ = 1.0f;
+    quiet_frames_ = 0;
+    sleeping_ = false;
+    SetSleep(kSleepThreshold, kSleepHoldTime);
+
+    verb_->Init(samplerate_);
+
+    ducker_.Init(samplerate_);
+
+    // Initialize high-pass filters
+    hpf_.Init(samplerate_);
+    hpf_.SetRes(0.5f); // Set resonance to a neutral value
+
+    // Initialize pre-delay lines
+    predelay_.Init(predelay_buffer, predelay_size);
+
+    er_.Init(er_history);
+    er_running_ = false;
+
+    blk_.Init();
+
+    meter_.Init(samplerate_, kMeterRate);
+
+    UpdateCoefficients();
+}
+
+void KVerbEngine::SetSleep(float threshold, float hold_time) {
+    sleep_threshold_ = threshold;
+    sleep_hold_frames_ = size_t(hold_time * samplerate_);
+}
+
+void KVerbEngine::SetParams(const float *values) {
+    std::copy(values, values + PARAM_COUNT, target_);
+}
+
+KVERB_ITCM void KVerbEngine::Process(const float *const *in, float **out, size_t frames) {
+    if (frames == 0) {
+        return;
+    }
+    BeginBlock(in, out, frames);
+    AddSpan(frames, target_);
+    EndBlock();
+}
+
+KVERB_ITCM void KVerbEngine::BeginBlock(const float *const *in, float **out, size_t frames) {
+    block_in_[0] = in[0];
+    block_in_[1] = in[1];
+    for (int c = 0; c < 4; c++) {
+        block_out_[c] = out[c];
+    }
+    block_frames_ = frames;
+    block_offset_ = 0;
+    chunk_frames_ = 0;
+    chunk_early_ = false;
+
+    ReverbEngine *next_verb = pending_verb_.load(std::memory_order_acquire);
+    if (next_verb) {
+        verb_ = next_verb;
+        pending_verb_.store(nullptr, std::memory_order_release);
+        // the new reverb needs the current feedback and damping
+        applied_[FEED] = -1.0f;
+        applied_[LPF] = -1.0f;
+    }
+
+    UpdateControlRate(frames);
+
+    input_peak_ = PeakEnergy(in[0], in[1], frames, input_energy_);
+    if (sleeping_ && input_peak_ >= sleep_threshold_ && !clear_verb_.load(std::memory_order_acquire)) {
+        // wake up, the state was cleared when going to sleep, the reverb
+        // by ClearReverb() before this. The reverb may have been switched
+        // meanwhile, either way it needs the current feedback and damping.
+        sleeping_ = false;
+        quiet_frames_ = 0;
+        applied_[FEED] = -1.0f;
+        applied_[LPF] = -1.0f;
+        UpdateCoefficients();
+    }
+}
+
+KVERB_ITCM void KVerbEngine::AddSpan(size_t frames, const float *values) {
+    static const int ramp_params[RAMP_COUNT] = {DRY, WET, PREDLY, EARLY};
+
+    if (frames == 0) {
+        return;
+    }
+    if (values != target_) {
+        std::copy(values, values + PARAM_COUNT, target_);
+    }
+
+    // ramp from where the last span ended to the new target, the pre-delay
+    // in samples
+    float start[RAMP_COUNT], step[RAMP_COUNT];
+    float per_frame = 1.0f / float(frames);
+    for (int r = 0; r < RAMP_COUNT; r++) {
+        int p = ramp_params[r];
+        float scale = p == PREDLY ? samplerate_ : 1.0f;
+        start[r] = current_[p] * scale;
+        step[r] = (target_[p] - current_[p]) * scale * per_frame;
+        current_[p] = target_[p];
+    }
+    bool early = start[RAMP_EARLY] > 0.0f || current_[EARLY] > 0.0f;
+
+    // The pre-delay line reads whole spans per chunk, so keep a chunk's
+    // worth of margin
+    float predly_min = 1.0f;
+    float predly_max = predelay_.GetMaxDelay() - float(kMaxChunkSize);
+
+    for (size_t offset = 0; offset < frames;) {
+        size_t size = std::min(kMaxChunkSize - chunk_frames_, frames - offset);
+        if (early && !chunk_early_) {
+            // the chunk's earlier spans left the ramp unwritten
+            std::fill(ramps_[RAMP_EARLY], ramps_[RAMP_EARLY] + chunk_frames_, 0.0f);
+            chunk_early_ = true;
+        }
+        for (int r = 0; r < RAMP_COUNT; r++) {
+            if (r == RAMP_EARLY && !chunk_early_) {
+                continue;
+            }
+            float *ramp = ramps_[r] + chunk_frames_;
+            float value = start[r] + step[r] * float(offset);
+            for (size_t i = 0; i < size; i++) {
+                ramp[i] = value + step[r] * float(i);
+            }
+            if (r == RAMP_PREDLY) {
+                for (size_t i = 0; i < size; i++) {
+                    ramp[i] = std::min(std::max(ramp[i], predly_min), predly_max);
+                }
+            }
+        }
+        chunk_frames_ += size;
+        offset += size;
+        if (chunk_frames_ == kMaxChunkSize) {
+            ProcessChunk();
+        }
+    }
+}
+
+KVERB_ITCM void KVerbEngine::EndBlock() {
+    if (chunk_frames_ > 0) {
+        ProcessChunk();
+    }
+
+    size_t frames = block_frames_;
+    if (sleeping_) {
+        meter_.Add(frames, input_peak_, input_energy_, 0.0f, 0.0f, 1.0f);
+        return;
+    }
+
+    float wet_energy;
+    float wet_peak = PeakEnergy(block_out_[2], block_out_[3], frames, wet_energy);
+    meter_.Add(frames, input_peak_, input_energy_, wet_peak, wet_energy, ducker_.TakeLowestGain());
+
+    if (input_peak_ < sleep_threshold_ && wet_peak < sleep_threshold_) {
+        quiet_frames_ += frames;
+        // wait for anything still in the pre-delay to come out
+        size_t predelay_frames = size_t(current_[PREDLY] * samplerate_);
+        if (quiet_frames_ >= sleep_hold_frames_ + predelay_frames) {
+            Sleep();
+        }
+    }
+    else {
+        quiet_frames_ = 0;
+    }
+}
+
+void KVerbEngine::Sleep() {
+    // Clear the tail rather than freezing it, so waking up does not bring
+    // back stale signal. The reverb's memory is hundreds of kB, too much
+    // for one callback at small block sizes, so it is handed to
+    // ClearReverb(); the rest is small enough to clear here.
+    sleeping_ = true;
+    hpf_.Init(samplerate_);
+    hpf_.SetRes(0.5f);
+    blk_.Init();
+    ducker_.Init(samplerate_);
+    er_.Reset();
+
+    // the cleared modules need their coefficients again, the reverb's
+    // once it has been cleared
+    applied_[HPF] = -1.0f;
+    applied_[DUCK] = -1.0f;
+    UpdateCoefficients();
+
+    // from here on the reverb belongs to ClearReverb() until it is done
+    clear_verb_.store(verb_, std::memory_order_release);
+}
+
+KVERB_ITCM void KVerbEngine::UpdateControlRate(size_t frames) {
+    // the glide coefficient only depends on the block length
+    if (frames != smoothing_frames_) {
+        smoothing_frames_ = frames;
+        smoothing_coeff_ = 1.0f - expf(-float(frames) / (kSmoothingTime * samplerate_));
+    }
+
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        if (!IsAudioRate(p)) {
+            current_[p] += (target_[p] - current_[p]) * smoothing_coeff_;
+            // snap once close enough, so settled values stop triggering updates
+            if (fabsf(target_[p] - current_[p]) < 1e-4f) {
+                current_[p] = target_[p];
+            }
+        }
+    }
+
+    UpdateCoefficients();
+}
+
+KVERB_ITCM void KVerbEngine::UpdateCoefficients() {
+    // a sleeping reverb may be being cleared, waking up sets it again
+    if (!sleeping_ && current_[FEED] != applied_[FEED]) {
+        verb_->SetFeedback(current_[FEED]);
+        applied_[FEED] = current_[FEED];
+    }
+
+    if (!sleeping_ && current_[LPF] != applied_[LPF]) {
+        verb_->SetLpFreq(ToFrequency(current_[LPF]));
+        applied_[LPF] = current_[LPF];
+    }
+
+    if (current_[HPF] != applied_[HPF]) {
+        hpf_.SetFreq(ToFrequency(current_[HPF]));
+        applied_[HPF] = current_[HPF];
+    }
+
+    // Higher duck amount = more aggressive ducking
+    float duck_amount = current_[DUCK];
+    if (duck_amount != applied_[DUCK] && duck_amount > 0.01f) {
+        ducker_.SetAmount(duck_amount);
+        applied_[DUCK] = duck_amount;
+    }
+}
+
+KVERB_ITCM void KVerbEngine::ProcessChunk() {
+    size_t size = chunk_frames_;
+    const float *inL = block_in_[0] + block_offset_;
+    const float *inR = block_in_[1] + block_offset_;
+    float *mixL = block_out_[0] + block_offset_;
+    float *mixR = block_out_[1] + block_offset_;
+    float *wetL = block_out_[2] + block_offset_;
+    float *wetR = block_out_[3] + block_offset_;
+    bool early = chunk_early_;
+    block_offset_ += size;
+    chunk_frames_ = 0;
+    chunk_early_ = false;
+
+    if (sleeping_) {
+        // nothing to reverberate, pass the dry signal only
+        ScaleGains(inL, ramps_[RAMP_DRY], mixL, size);
+        ScaleGains(inR, ramps_[RAMP_DRY], mixR, size);
+        std::fill(wetL, wetL + size, 0.0f);
+        std::fill(wetR, wetR + size, 0.0f);
+        return;
+    }
+
+    // The early reflections only run while they are mixed in, and start
+    // from silence when they come back. While off, a new response is
+    // taken straight away.
+    if ((early && !er_running_) || (!early && er_.IsImpulsePending())) {
+        er_.Reset();
+    }
+    er_running_ = early;
+    early = early && er_.IsActive();
+
+    float sendL[kMaxChunkSize], sendR[kMaxChunkSize];
+    float earlyL[kMaxChunkSize], earlyR[kMaxChunkSize];
+
+    KVERB_DIAG_START(lap);
+
+    // Send Signal to Reverb
+    ScaleGains(inL, ramps_[RAMP_WET], sendL, size);
+    ScaleGains(inR, ramps_[RAMP_WET], sendR, size);
+    KVERB_DIAG_LAP(lap, TIMER_SEND);
+
+    // Apply high-pass filter before reverb
+    hpf_.Process(sendL, sendR, size);
+    KVERB_DIAG_LAP(lap, TIMER_HPF);
+
+    // Apply pre-delay, following the delay time frame by frame
+    predelay_.Process(sendL, sendR, size, ramps_[RAMP_PREDLY], predelay_staging_, kPreDelayStagingSize);
+    KVERB_DIAG_LAP(lap, TIMER_PREDELAY);
+
+    // Early reflections, fed into the reverb and added to its output
+    if (early) {
+        er_.Process(sendL, sendR, earlyL, earlyR, size);
+        MixGains(earlyL, ramps_[RAMP_EARLY], sendL, sendL, size);
+        MixGains(earlyR, ramps_[RAMP_EARLY], sendR, sendR, size);
+    }
+    KVERB_DIAG_LAP(lap, TIMER_EARLY);
+
+    // Out 3 and 4 are just wet
+    verb_->Process(sendL, sendR, wetL, wetR, size);
+    if (early) {
+        MixGains(earlyL, ramps_[RAMP_EARLY], wetL, wetL, size);
+        MixGains(earlyR, ramps_[RAMP_EARLY], wetR, wetR, size);
+    }
+    KVERB_DIAG_LAP(lap, TIMER_REVERB);
+
+    // Dc Block
+    blk_.Process(wetL, wetR, size);
+    KVERB_DIAG_LAP(lap, TIMER_DCBLOCK);
+
+    // Apply sidechain ducking if enabled, using the dry signal as the key
+    if (current_[DUCK] > 0.01f) {
+        ducker_.Process(inL, inR, wetL, wetR, size);
+    }
+    KVERB_DIAG_LAP(lap, TIMER_DUCK);
+
+    // Out 1 and 2 are Mixed
+    MixGains(inL, ramps_[RAMP_DRY], wetL, mixL, size);
+    MixGains(inR, ramps_[RAMP_DRY], wetR, mixR, size);
+    KVERB_DIAG_LAP(lap, TIMER_MIX);
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "BlockKernels.h"
+#include "Ducker.h"
+#include "EarlyReflections.h"
+#include "LevelMeter.h"
+#include "ReverbEngine.h"
+#include "StereoPreDelay.h"
+
+#include <atomic>
+#include <math.h>
+
+enum Params {
+    DRY,
+    WET,
+    LPF,
+    HPF,
+    FEED,
+    DUCK,
+    PREDLY,
+    EARLY,
+    PARAM_COUNT
+};
+
+// Pre-delay
+static constexpr float PRE_DELAY_MAX_SECONDS = 3.0f;
+static constexpr size_t PRE_DELAY_BUFFER_SIZE = static_cast<size_t>(96000 * PRE_DELAY_MAX_SECONDS); // Buffer size for max 96kHz sample rate
+
+// Build with KVERB_PREDELAY_16BIT to store the pre-delay as 16-bit samples,
+// which halves its SDRAM footprint and bandwidth (1.1 MB instead of 2.3 MB)
+#ifdef KVERB_PREDELAY_16BIT
+typedef StereoPreDelay<int16_t> PreDelayLine;
+#else
+typedef StereoPreDelay<float> PreDelayLine;
+#endif
+
+/** The KVerb audio path: high-pass, pre-delay and early reflections in
+ *  front of a reverb, DC blocking and linked sidechain ducking on the wet
+ *  signal, and a dry/wet mix.
+ *
+ *  Parameters are taken as a snapshot once per block and every stage runs
+ *  over the whole block before the next one starts.
+ *
+ *  Gains and the pre-delay time ramp linearly across each block. Filter,
+ *  feedback and ducking values glide towards their target at control rate,
+ *  and their coefficients are only recomputed when the value moved, at
+ *  most once per block.
+ *
+ *  Once the input and the wet output have stayed below the sleep threshold
+ *  for the hold time plus the pre-delay time, the engine sleeps: the
+ *  reverb, filters and ducker are cleared and skipped, and only the dry
+ *  signal is passed on. The reverb's memory is too large to clear within
+ *  one block, so that is left to ClearReverb() outside the callback. The
+ *  first block with input above the threshold after it is processed
+ *  normally again.
+ *
+ *  The peak and RMS levels of the input and the wet output, and the
+ *  ducking gain, are metered from the same passes the sleep detection
+ *  makes and published kMeterRate times a second for the UI.
+ */
+class KVerbEngine {
+  public:
+    // Longest run of frames each stage processes at a time, longer blocks are split
+    static constexpr size_t kMaxChunkSize = 64;
+
+    // Frames of pre-delay staged in internal memory per chunk, which covers
+    // the chunk itself plus a delay sweep of up to ~950 samples within it
+    static constexpr size_t kPreDelayStagingSize = 1024;
+
+    /** Pre-delay frames for the full PRE_DELAY_MAX_SECONDS at samplerate,
+     *  with the headroom the engine keeps below the end of the line. For
+     *  hosts that know their rate up front; the firmware sizes for 96 kHz.
+     */
+    static size_t PreDelayFrames(float samplerate) {
+        return size_t(ceilf(samplerate * PRE_DELAY_MAX_SECONDS)) + kMaxChunkSize + 2;
+    }
+
+    // Time constant of the control-rate glide on LPF, HPF, FEED and DUCK
+    static constexpr float kSmoothingTime = 0.02f;
+
+    // Default sleep threshold, -100 dBFS, and how long input and wet output
+    // must stay below it before the engine sleeps
+    static constexpr float kSleepThreshold = 1e-5f;
+    static constexpr float kSleepHoldTime = 1.0f;
+
+    // Level snapshots per second, the display's refresh rate
+    static constexpr float kMeterRate = 30.0f;
+
+    KVerbEngine() {}
+    ~KVerbEngine() {}
+
+    /** Initializes all DSP state.
+     *  The engine object itself only holds small, hot state; the large
+     *  buffers are passed in so the caller decides which memory they live in.
+     *  \param samplerate audio sample rate
+     *  \param verb reverb to start with, initialized here
+     *  \param predelay_buffer pre-delay storage (SDRAM on the hardware)
+     *  \param predelay_size length of predelay_buffer in frames
+     *  \param er_history input spectra of the early reflections
+     */
+    void Init(float samplerate, ReverbEngine *verb, PreDelayLine::Frame *predelay_buffer, size_t predelay_size,
+              EarlyReflections::History *er_history);
+
+    /** Switches to another reverb from the next Process() call on.
+     *  Call from outside the audio callback, with verb already initialized
+     *  for the sample rate, and only while IsReverbPending() is false.
+     *  The previous reverb is free to be reused once it is.
+     */
+    void SetReverb(ReverbEngine *verb) { pending_verb_.store(verb, std::memory_order_release); }
+
+    /** True until the audio callback has picked up the last SetReverb(). */
+    bool IsReverbPending() const { return pending_verb_.load(std::memory_order_acquire) != nullptr; }
+
+    /** Switches the early reflections to another response, under the same
+     *  rules as SetReverb(). The EARLY parameter mixes them in; at 0 the
+     *  stage is skipped.
+     */
+    void SetEarlyReflections(const EarlyReflections::Impulse *impulse) { er_.SetImpulse(impulse); }
+
+    bool IsEarlyReflectionsPending() const { return er_.IsImpulsePending(); }
+
+    /** Takes a snapshot of PARAM_COUNT values in the 0-1 range as the
+     *  target for the following Process() calls.
+     */
+    void SetParams(const float *values);
+
+    /** Processes one block.
+     *  \param in two input channels
+     *  \param out four output channels: 1/2 dry+wet mix, 3/4 wet only.
+     *         Outputs 3/4 are used as scratch, so they must not alias the inputs.
+     */
+    void Process(const float *const *in, float **out, size_t frames);
+
+    /** Processes one block in spans with a parameter snapshot each, for
+     *  parameters that change within the block: BeginBlock(), AddSpan()
+     *  for consecutive spans that cover it, then EndBlock(). The audio-rate
+     *  parameters ramp linearly over each span to its values. A span only
+     *  writes its ramps into per-frame buffers; the stages run over the
+     *  buffered frames once per kMaxChunkSize and at EndBlock(), so a block
+     *  of up to kMaxChunkSize frames runs each stage once however many
+     *  spans it has. The glide of the others, metering and sleep detection
+     *  run once per block, the glide towards the values of the previous
+     *  block's last span. Process() is a block of one span.
+     */
+    void BeginBlock(const float *const *in, float **out, size_t frames);
+    void AddSpan(size_t frames, const float *values);
+    void EndBlock();
+
+    float GetSampleRate() const { return samplerate_; }
+
+    /** \param threshold linear level counted as silence, 0 never sleeps
+     *  \param hold_time seconds of silence before sleeping, on top of the pre-delay
+     */
+    void SetSleep(float threshold, float hold_time);
+
+    bool IsSleeping() const { return sleeping_; }
+
+    /** Clears the reverb the engine went to sleep with, which it does not
+     *  wake up to before this. Call from outside the audio callback: from
+     *  the main loop on the hardware, between Process() calls on a host.
+     *  \return true if there was a reverb to clear
+     */
+    bool ClearReverb() {
+        ReverbEngine *verb = clear_verb_.load(std::memory_order_acquire);
+        if (!verb) {
+            return false;
+        }
+        verb->Init(samplerate_);
+        clear_verb_.store(nullptr, std::memory_order_release);
+        return true;
+    }
+
+    /** The levels over the last meter period. Call from one reader only,
+     *  outside the audio callback.
+     */
+    const LevelMeter::Levels &ReadLevels() { return meter_.Read(); }
+
+  private:
+    // Rows of ramps_, one per audio-rate parameter
+    enum Ramp {
+        RAMP_DRY,
+        RAMP_WET,
+        RAMP_PREDLY,
+        RAMP_EARLY,
+        RAMP_COUNT
+    };
+
+    void UpdateControlRate(size_t frames);
+    void UpdateCoefficients();
+    void Sleep();
+    void ProcessChunk();
+
+    ReverbEngine       *verb_;
+    std::atomic<ReverbEngine *> pending_verb_;
+    std::atomic<ReverbEngine *> clear_verb_; // left behind by Sleep() for ClearReverb()
+    StereoDcBlock       blk_;
+    Ducker              ducker_; // Linked stereo ducking of the wet signal
+    StereoHighPass      hpf_; // Stereo high-pass filter before reverb
+    PreDelayLine        predelay_; // Stereo pre-delay before reverb
+    PreDelayLine::Frame predelay_staging_[kPreDelayStagingSize];
+    EarlyReflections    er_; // Early reflections between pre-delay and reverb
+    bool                er_running_;
+    LevelMeter          meter_;
+
+    float samplerate_;
+    float target_[PARAM_COUNT];  // latest snapshot from SetParams()
+    float current_[PARAM_COUNT]; // value reached at the end of the current block
+    float applied_[PARAM_COUNT]; // value the coefficients were last computed for
+
+    // per-frame values of the audio-rate parameters for the chunk being
+    // collected, the pre-delay in samples. EARLY is only written while the
+    // early reflections are mixed in.
+    float  ramps_[RAMP_COUNT][kMaxChunkSize];
+    size_t chunk_frames_; // frames in ramps_ so far
+    bool   chunk_early_;  // whether any of them mixes in the early reflections
+
+    size_t smoothing_frames_;
+    float  smoothing_coeff_;
+
+    float  sleep_threshold_;
+    size_t sleep_hold_frames_;
+    size_t quiet_frames_; // consecutive frames of input and wet output below the threshold
+    bool   sleeping_;
+
+    // the block between BeginBlock() and EndBlock()
+    const float *block_in_[2];
+    float       *block_out_[4];
+    size_t       block_frames_;
+    size_t       block_offset_; // where the chunk being collected starts
+    float        input_peak_, input_energy_;
+};
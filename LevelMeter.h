@@ -0,0 +1,87 @@
+#pragma once
+
+#include "TripleBuffer.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Levels of the dry input, the wet output and the ducking, for the UI.
+ *
+ *  The audio path adds the peak and energy of each block, which it
+ *  measures in one pass over each buffer, and the lowest ducking gain.
+ *  Once per period they are turned into a Levels snapshot and published
+ *  through a TripleBuffer, so the reader never waits and never sees a
+ *  half-written snapshot. Per sample this costs a compare and a
+ *  multiply-add per channel of each signal; the rest is per block.
+ */
+class LevelMeter {
+  public:
+    struct Levels {
+        float    in_peak, in_rms;
+        float    wet_peak, wet_rms;
+        float    duck_gain; // lowest ducking gain over the period, 1 when not ducking
+        uint32_t count;     // periods published so far
+    };
+
+    LevelMeter() {}
+    ~LevelMeter() {}
+
+    /** \param rate snapshots per second */
+    void Init(float samplerate, float rate) {
+        period_frames_ = size_t(samplerate / rate);
+        count_ = 0;
+        Clear();
+        levels_.Init(Levels{0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0});
+    }
+
+    /** Writer side, once per block.
+     *  \param in_energy, wet_energy sums of squares over both channels
+     */
+    void Add(size_t frames, float in_peak, float in_energy, float wet_peak, float wet_energy, float duck_gain) {
+        frames_ += frames;
+        in_peak_ = fmaxf(in_peak_, in_peak);
+        in_energy_ += in_energy;
+        wet_peak_ = fmaxf(wet_peak_, wet_peak);
+        wet_energy_ += wet_energy;
+        duck_gain_ = fminf(duck_gain_, duck_gain);
+        if (frames_ >= period_frames_) {
+            Publish();
+        }
+    }
+
+    /** Reader side: the levels over the last complete period. */
+    const Levels &Read() { return levels_.Read(); }
+
+  private:
+    void Publish() {
+        Levels &levels = levels_.WriteBuffer();
+        float samples = float(2 * frames_);
+        levels.in_peak = in_peak_;
+        levels.in_rms = sqrtf(in_energy_ / samples);
+        levels.wet_peak = wet_peak_;
+        levels.wet_rms = sqrtf(wet_energy_ / samples);
+        levels.duck_gain = duck_gain_;
+        levels.count = ++count_;
+        levels_.Publish();
+        Clear();
+    }
+
+    void Clear() {
+        frames_ = 0;
+        in_peak_ = 0.0f;
+        in_energy_ = 0.0f;
+        wet_peak_ = 0.0f;
+        wet_energy_ = 0.0f;
+        duck_gain_ = 1.0f;
+    }
+
+    TripleBuffer<Levels> levels_;
+
+    size_t   period_frames_ = 1;
+    size_t   frames_ = 0;
+    float    in_peak_, in_energy_;
+    float    wet_peak_, wet_energy_;
+    float    duck_gain_;
+    uint32_t count_ = 0;
+};
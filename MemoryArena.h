@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Memory regions of the Daisy Seed (STM32H750), fastest first
+enum MemoryRegion {
+    MEMORY_DTCM,     // 128 kB data TCM, core speed, shared with the stack
+    MEMORY_AXI_SRAM, // 512 kB D1 SRAM, where .bss goes
+    MEMORY_D2_SRAM,  // 256 kB of SRAM1-3 in D2 past the uncached DMA window, see KVerb_d2.ld
+    MEMORY_SDRAM,    // 64 MB external SDRAM, .sdram_bss
+    MEMORY_REGION_COUNT
+};
+
+static const char *memory_region_strings[MEMORY_REGION_COUNT] = {"DTCM", "AXI", "D2", "SDRAM"};
+
+/** Fixed-capacity bump allocator over one block of memory.
+ *
+ *  Allocations are aligned to a cache line and only ever freed all at
+ *  once by Reset(). The bytes are added up per owner name for the memory
+ *  map.
+ */
+class MemoryArena {
+  public:
+    static constexpr size_t kAlignment = 32;
+    static constexpr size_t kMaxAllocations = 8;
+
+    struct Allocation {
+        const char *owner;
+        size_t      bytes;
+    };
+
+    MemoryArena() {}
+    ~MemoryArena() {}
+
+    void Init(void *base, size_t capacity) {
+        base_ = static_cast<uint8_t *>(base);
+        capacity_ = capacity;
+        Reset();
+    }
+
+    void Reset() {
+        used_ = 0;
+        count_ = 0;
+    }
+
+    /** \return bytes of memory, or nullptr if there is not enough left */
+    void *Allocate(const char *owner, size_t bytes) {
+        size_t start = (used_ + kAlignment - 1) & ~(kAlignment - 1);
+        if (!base_ || start > capacity_ || bytes > capacity_ - start) {
+            return nullptr;
+        }
+        used_ = start + bytes;
+
+        size_t a = 0;
+        while (a < count_ && strcmp(allocations_[a].owner, owner) != 0) {
+            a++;
+        }
+        if (a < count_) {
+            allocations_[a].bytes += bytes;
+        }
+        else if (count_ < kMaxAllocations) {
+            allocations_[count_++] = {owner, bytes};
+        }
+        return base_ + start;
+    }
+
+    size_t GetUsed() const { return used_; }
+    size_t GetCapacity() const { return capacity_; }
+    size_t GetAllocationCount() const { return count_; }
+    const Allocation &GetAllocation(size_t index) const { return allocations_[index]; }
+
+  private:
+    uint8_t   *base_ = nullptr;
+    size_t     capacity_ = 0;
+    size_t     used_ = 0;
+    Allocation allocations_[kMaxAllocations];
+    size_t     count_ = 0;
+};
+
+/** An arena per memory region.
+ *
+ *  A component asks for the fastest region its access pattern needs and
+ *  gets the first arena from there towards SDRAM with room for it, so
+ *  small, hot state ends up close to the core and large, streamed buffers
+ *  in SDRAM.
+ */
+class MemoryMap {
+  public:
+    MemoryMap() {}
+    ~MemoryMap() {}
+
+    void Init(MemoryRegion region, void *base, size_t capacity) { arenas_[region].Init(base, capacity); }
+
+    /** Frees everything in every region. */
+    void Reset() {
+        for (int r = 0; r < MEMORY_REGION_COUNT; r++) {
+            arenas_[r].Reset();
+        }
+    }
+
+    /** \return count uninitialized objects of T, or nullptr if no region
+     *          from fastest on has room
+     */
+    template <typename T>
+    T *Allocate(const char *owner, size_t count, MemoryRegion fastest) {
+        for (int r = fastest; r < MEMORY_REGION_COUNT; r++) {
+            void *memory = arenas_[r].Allocate(owner, count * sizeof(T));
+            if (memory) {
+                return static_cast<T *>(memory);
+            }
+        }
+        return nullptr;
+    }
+
+    const MemoryArena &GetArena(MemoryRegion region) const { return arenas_[region]; }
+
+  private:
+    MemoryArena arenas_[MEMORY_REGION_COUNT];
+};
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/** MIDI control changes from a serial input, timestamped as they arrive
+ *  and scheduled to sample offsets in the audio blocks.
+ *
+ *  The UART receive interrupt hands each batch of bytes to Receive(). The
+ *  bytes are parsed there, with running status and with real-time bytes
+ *  and SysEx skipped, and every control change is queued in a
+ *  single-producer, single-consumer ring with the time its last byte
+ *  arrived.
+ *
+ *  The receiver is a circular DMA buffer that reports whenever it reaches
+ *  a half, and when the line goes idle for a byte in between. So a batch
+ *  that ends on a half ended as the interrupt came, any other one a byte
+ *  earlier, and a byte waits at most a half of the buffer less one byte
+ *  to be reported.
+ *
+ *  The audio callback calls BeginBlock() with its own start time and takes
+ *  the messages due in the block with Next(). A message is due one block
+ *  period plus that longest wait after its last byte, so every message is
+ *  delayed by the same time, to within a sample, wherever it falls
+ *  relative to the blocks and the reports.
+ *
+ *  Times are ticks of any free-running 32-bit counter, and may wrap. They
+ *  are as good as the receive interrupt's latency.
+ */
+template <size_t kSize = 64>
+class MidiInput {
+  public:
+    static_assert((kSize & (kSize - 1)) == 0, "the ring size must be a power of two");
+
+    // 31250 baud with a start and a stop bit
+    static constexpr float kBytesPerSecond = 3125.0f;
+
+    struct ControlChange {
+        uint32_t time; // when the last byte ended
+        uint8_t  channel; // 0-15
+        uint8_t  controller;
+        uint8_t  value;
+    };
+
+    MidiInput() {}
+    ~MidiInput() {}
+
+    /** \param tick_rate ticks per second of the time base
+     *  \param half_size bytes in each half of the receive buffer
+     */
+    void Init(float tick_rate, size_t half_size) {
+        byte_ticks_ = uint32_t(tick_rate / kBytesPerSecond + 0.5f);
+        half_size_ = half_size;
+        received_ = 0;
+        wait_ = uint32_t(half_size > 2 ? half_size - 1 : 1) * byte_ticks_;
+        status_ = 0;
+        count_ = 0;
+        started_ = false;
+    }
+
+    /** Writer side, from the receive interrupt. Drops messages while the
+     *  ring is full.
+     *  \param now time of the call, the bytes are dated back from there
+     *         one byte time each
+     */
+    void Receive(const uint8_t *data, size_t size, uint32_t now) {
+        received_ = (received_ + size) % half_size_;
+        uint32_t end = received_ == 0 ? now : now - byte_ticks_;
+        for (size_t i = 0; i < size; i++) {
+            Parse(data[i], end - uint32_t(size - 1 - i) * byte_ticks_);
+        }
+    }
+
+    /** Reader side: the following Next() calls are for the block starting
+     *  at time. The block period is measured from the one before.
+     */
+    void BeginBlock(uint32_t time, size_t frames) {
+        period_ = started_ ? time - block_start_ : 0;
+        block_start_ = time;
+        frames_ = frames;
+        started_ = true;
+    }
+
+    /** Delay from the last byte of a message to its offset, in ticks */
+    uint32_t GetLatency() const { return period_ + wait_; }
+
+    /** Reader side: the next message for the current block, in order.
+     *  \param offset frame of the block it applies from
+     *  \return false once the rest are due in later blocks
+     */
+    bool Next(ControlChange &message, size_t &offset) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        const ControlChange &next = messages_[tail & kMask];
+        int32_t due = int32_t(next.time + GetLatency() - block_start_);
+        if (due >= int32_t(period_)) {
+            return false;
+        }
+
+        // overdue messages, from before the audio (re)started, go first
+        offset = due > 0 ? size_t(uint64_t(uint32_t(due)) * frames_ / period_) : 0;
+        message = next;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Reader side: the next BeginBlock() starts the timeline again, call
+     *  while the audio is stopped.
+     */
+    void Reset() { started_ = false; }
+
+  private:
+    static constexpr size_t kMask = kSize - 1;
+
+    void Parse(uint8_t byte, uint32_t time) {
+        if (byte >= 0xF8) {
+            // real-time, can come between the bytes of any message
+            return;
+        }
+        if (byte & 0x80) {
+            // system common and SysEx cancel the running status, their
+            // data bytes are ignored until the next channel message
+            status_ = byte < 0xF0 ? byte : 0;
+            count_ = 0;
+            return;
+        }
+        if (status_ == 0) {
+            return;
+        }
+
+        data_[count_++] = byte;
+        uint8_t type = status_ & 0xF0;
+        if (count_ < (type == 0xC0 || type == 0xD0 ? 1u : 2u)) {
+            return;
+        }
+        // running status, the next data byte starts another message
+        count_ = 0;
+        if (type == 0xB0) {
+            Push({time, uint8_t(status_ & 0x0F), data_[0], data_[1]});
+        }
+    }
+
+    void Push(const ControlChange &message) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= kSize) {
+            return;
+        }
+        messages_[head & kMask] = message;
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    ControlChange       messages_[kSize];
+    std::atomic<size_t> head_{0}; // messages queued, owned by the writer
+    std::atomic<size_t> tail_{0}; // messages taken, owned by the reader
+
+    // writer state: the receiver's position and the parser
+    uint32_t byte_ticks_ = 0;
+    size_t   half_size_ = 1;
+    size_t   received_ = 0;
+    uint8_t  status_ = 0;
+    uint8_t  data_[2] = {};
+    unsigned count_ = 0;
+
+    // reader state: the block being processed and its period
+    uint32_t wait_ = 0;
+    uint32_t block_start_ = 0;
+    uint32_t period_ = 0;
+    size_t   frames_ = 0;
+    bool     started_ = false;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+
+// Response curve applied to a destination after the sources are summed
+enum ModCurve {
+    CURVE_LINEAR,
+    CURVE_EXP,
+    CURVE_LOG,
+    CURVE_S,
+    CURVE_COUNT
+};
+
+/** The response curves as lookup tables.
+ *
+ *  Built once, by the constructor of mod_curves before main(), and only
+ *  read after that, so the audio callback can map values with any curve
+ *  while the mapping is being edited.
+ */
+class ModCurveTables {
+  public:
+    // Points in each curve table, linearly interpolated in between
+    static constexpr size_t kSize = 33;
+
+    ModCurveTables() {
+        for (int c = 0; c < CURVE_COUNT; c++) {
+            for (size_t i = 0; i < kSize; i++) {
+                points_[c][i] = Shape(static_cast<ModCurve>(c), float(i) / float(kSize - 1));
+            }
+            // repeat the last point so a value of exactly 1 interpolates in range
+            points_[c][kSize] = points_[c][kSize - 1];
+        }
+    }
+    ~ModCurveTables() {}
+
+    /** Clamps value to 0-1 and applies curve. */
+    float Map(ModCurve curve, float value) const {
+        value = fminf(fmaxf(value, 0.0f), 1.0f);
+
+        float  position = value * float(kSize - 1);
+        size_t index = size_t(position);
+        float  fraction = position - float(index);
+        const float *points = points_[curve];
+        return points[index] + (points[index + 1] - points[index]) * fraction;
+    }
+
+  private:
+    static float Shape(ModCurve curve, float x) {
+        // e^4 - 1, sets how strongly the exponential and logarithmic curves bend
+        const float bend = 53.59815f;
+        switch (curve) {
+            case CURVE_EXP: return (expf(4.0f * x) - 1.0f) / bend;
+            case CURVE_LOG: return logf(1.0f + bend * x) / 4.0f;
+            case CURVE_S: return x * x * (3.0f - 2.0f * x);
+            default: return x;
+        }
+    }
+
+    float points_[CURVE_COUNT][kSize + 1];
+};
+
+static const ModCurveTables mod_curves;
+
+/** Control-rate modulation matrix.
+ *
+ *  Each destination is bias + sum(coefficient * source), clamped to 0-1
+ *  and shaped by its response curve. The mapping is kept as a dense
+ *  coefficient matrix and a curve per destination from mod_curves, so
+ *  Process() is the same branch-free multiply-add whatever the mapping
+ *  is.
+ */
+template <size_t kDestinations, size_t kSources>
+class ModMatrix {
+  public:
+    ModMatrix() {}
+    ~ModMatrix() {}
+
+    /** Clears all coefficients and biases, curves back to linear. */
+    void Init() {
+        for (size_t d = 0; d < kDestinations; d++) {
+            bias_[d] = 0.0f;
+            for (size_t s = 0; s < kSources; s++) {
+                coefficients_[d][s] = 0.0f;
+            }
+            SetCurve(d, CURVE_LINEAR);
+        }
+    }
+
+    void SetBias(size_t destination, float bias) { bias_[destination] = bias; }
+    float GetBias(size_t destination) const { return bias_[destination]; }
+
+    void SetCoefficient(size_t destination, size_t source, float coefficient) {
+        coefficients_[destination][source] = coefficient;
+    }
+    float GetCoefficient(size_t destination, size_t source) const { return coefficients_[destination][source]; }
+
+    void SetCurve(size_t destination, ModCurve curve) { curves_[destination] = curve; }
+    ModCurve GetCurve(size_t destination) const { return curves_[destination]; }
+
+    /** \param sources kSources control values
+     *  \param out kDestinations values in the 0-1 range
+     */
+    void Process(const float *sources, float *out) const {
+        for (size_t d = 0; d < kDestinations; d++) {
+            float value = bias_[d];
+            for (size_t s = 0; s < kSources; s++) {
+                value += coefficients_[d][s] * sources[s];
+            }
+            out[d] = Map(d, value);
+        }
+    }
+
+    /** Clamps a summed value to 0-1 and applies the destination's curve,
+     *  for callers that do the sum themselves, e.g. per sample.
+     */
+    float Map(size_t destination, float value) const { return mod_curves.Map(curves_[destination], value); }
+
+  private:
+    float    coefficients_[kDestinations][kSources];
+    float    bias_[kDestinations];
+    ModCurve curves_[kDestinations];
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/* Memory placement for release builds on the Daisy Seed (STM32H750).
+ *
+ * KVERB_ITCM puts a function in the 64 kB instruction TCM, which runs at
+ * core speed with no flash wait states or cache misses. KVERB_DTCM puts a
+ * small object in the 128 kB data TCM, next to the stack. Both are
+ * no-ops in debug and host builds.
+ *
+ * ITCM code is linked by KVerb_itcm.ld and copied from flash by LoadItcm(),
+ * which has to run before any KVERB_ITCM function is called. DTCM objects
+ * are not zeroed at startup, so they need their own Init().
+ */
+#if defined(KVERB_RELEASE) && defined(__arm__)
+#define KVERB_ITCM __attribute__((section(".itcm_text")))
+#define KVERB_DTCM __attribute__((section(".dtcmram_bss")))
+
+// from KVerb_itcm.ld
+extern uint32_t _sitcm_text, _eitcm_text, _siitcm_text;
+
+inline void LoadItcm() {
+    memcpy(&_sitcm_text, &_siitcm_text, size_t(&_eitcm_text - &_sitcm_text) * sizeof(uint32_t));
+}
+#else
+#define KVERB_ITCM
+#define KVERB_DTCM
+
+inline void LoadItcm() {}
+#endif
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "daisy.h"
+
+#ifdef __arm__
+#include "stm32h7xx.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** A bank of kPresets preset slots in QSPI flash, read in place through
+ *  the memory-mapped QSPI.
+ *
+ *  Stores are appended as records (slot, CRC, data) to a log in one of two
+ *  flash sectors. A RAM index points at the newest valid record of each
+ *  slot, so Get() is a table lookup that returns a pointer into flash,
+ *  without copying or scanning.
+ *
+ *  When the log sector is full, the newest record of every slot is copied
+ *  to the other sector, which was erased ahead of time while idle, and the
+ *  sector header is written last. At boot the committed sector with the
+ *  highest generation wins, so an interrupted copy falls back to the old
+ *  sector, and an interrupted store to the slot's previous record.
+ *
+ *  Flash is only erased or written from Process(), in the main loop.
+ *  PresetStruct must be trivially copyable.
+ */
+template <typename PresetStruct, size_t kPresets>
+class PresetBank {
+  public:
+    // Two sectors, one holding the log and one spare
+    static constexpr uint32_t kSectorSize = 4096;
+    static constexpr uint32_t kRegionSize = 2 * kSectorSize;
+
+    PresetBank(daisy::QSPIHandle &qspi) : qspi_(qspi) {}
+    ~PresetBank() {}
+
+    /** Builds the index from flash.
+     *  \param address_offset start of the kRegionSize flash region
+     */
+    void Init(uint32_t address_offset) {
+        address_offset_ = address_offset;
+        active_ = -1;
+        generation_ = 0;
+        head_ = 1;
+        pending_ = false;
+        for (size_t p = 0; p < kPresets; p++) {
+            latest_[p] = nullptr;
+        }
+
+        for (int s = 0; s < 2; s++) {
+            const Record *header = RecordAt(s, 0);
+            if (header && header->slot == kHeaderSlot && IsValid(*header)
+                && (active_ < 0 || int32_t(header->generation - generation_) > 0)) {
+                active_ = s;
+                generation_ = header->generation;
+            }
+        }
+
+        if (active_ >= 0) {
+            // records are appended in order, the last valid one of a slot wins
+            for (head_ = 1; head_ < kRecordsPerSector; head_++) {
+                const Record *record = RecordAt(active_, head_);
+                if (record->magic == kErasedMagic) {
+                    break;
+                }
+                if (record->slot < kPresets && IsValid(*record)) {
+                    latest_[record->slot] = record;
+                }
+            }
+        }
+
+        spare_erased_ = IsErased(Spare());
+    }
+
+    /** The preset stored in slot, in flash, or nullptr if it is empty.
+     *  Valid until the next Process().
+     */
+    const PresetStruct *Get(size_t slot) const {
+        return latest_[slot] ? &latest_[slot]->data : nullptr;
+    }
+
+    /** Queues preset to be stored in slot by the next Process().
+     *  \return false if the previous store is still pending
+     */
+    bool Store(size_t slot, const PresetStruct &preset) {
+        if (pending_) {
+            return false;
+        }
+        pending_slot_ = slot;
+        pending_data_ = preset;
+        pending_ = true;
+        return true;
+    }
+
+    bool IsPending() const { return pending_; }
+
+    /** Call regularly from the main loop. Does at most one erase, or one
+     *  store, which copies the bank to the spare sector when the log is full.
+     *  \return true if it erased or wrote flash
+     */
+    bool Process() {
+        if (pending_) {
+            if (active_ >= 0 && head_ < kRecordsPerSector) {
+                pending_ = false;
+                if (Append(active_, head_, pending_slot_, pending_data_)) {
+                    latest_[pending_slot_] = RecordAt(active_, head_);
+                }
+                // a failed write leaves garbage, skip over it either way
+                head_++;
+                return true;
+            }
+            if (!spare_erased_) {
+                EraseSpare();
+                return true;
+            }
+            pending_ = false;
+            Compact();
+            return true;
+        }
+
+        if (!spare_erased_) {
+            // ahead of the next copy
+            EraseSpare();
+            return true;
+        }
+        return false;
+    }
+
+  private:
+    struct Record {
+        uint16_t     magic;
+        uint8_t      slot; // or kHeaderSlot
+        uint8_t      reserved;
+        uint32_t     generation; // sector headers only
+        uint32_t     crc;
+        PresetStruct data;
+    };
+
+    static constexpr uint16_t kMagic = 0x4B50; // "KP"
+    static constexpr uint16_t kErasedMagic = 0xFFFF;
+    static constexpr uint8_t  kHeaderSlot = 0xFF;
+    static constexpr size_t   kRecordsPerSector = kSectorSize / sizeof(Record);
+
+    static_assert(kPresets < kHeaderSlot, "too many presets");
+    static_assert(kRecordsPerSector >= kPresets + 2, "a sector must hold the header and every preset");
+
+    uint32_t SectorAddress(int sector) const { return address_offset_ + uint32_t(sector) * kSectorSize; }
+    uint32_t RecordAddress(int sector, size_t index) const {
+        return SectorAddress(sector) + uint32_t(index * sizeof(Record));
+    }
+    int Spare() const { return active_ == 0 ? 1 : 0; }
+
+    const Record *RecordAt(int sector, size_t index) const {
+        return reinterpret_cast<const Record *>(qspi_.GetData(RecordAddress(sector, index)));
+    }
+
+    static uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc = 0xFFFFFFFF) {
+        for (size_t i = 0; i < size; i++) {
+            crc ^= data[i];
+            for (int b = 0; b < 8; b++) {
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+            }
+        }
+        return crc;
+    }
+
+    static uint32_t RecordCrc(const Record &record) {
+        uint32_t crc = Crc32(&record.slot, sizeof(record.slot));
+        crc = Crc32(reinterpret_cast<const uint8_t *>(&record.generation), sizeof(record.generation), crc);
+        return ~Crc32(reinterpret_cast<const uint8_t *>(&record.data), sizeof(record.data), crc);
+    }
+
+    static bool IsValid(const Record &record) { return record.magic == kMagic && record.crc == RecordCrc(record); }
+
+    bool IsErased(int sector) const {
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(qspi_.GetData(SectorAddress(sector)));
+        if (!data) {
+            return false;
+        }
+        for (size_t i = 0; i < kSectorSize; i++) {
+            if (data[i] != 0xFF) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The memory-mapped reads go through the D-cache, which does not see
+    // erases and writes
+    void InvalidateCache(uint32_t address, uint32_t size) {
+#ifdef __arm__
+        uintptr_t start = reinterpret_cast<uintptr_t>(qspi_.GetData(address)) & ~uintptr_t(31);
+        uintptr_t end = reinterpret_cast<uintptr_t>(qspi_.GetData(address + size));
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(start), int32_t(end - start + 31) & ~31);
+#else
+        (void)address;
+        (void)size;
+#endif
+    }
+
+    void EraseSpare() {
+        uint32_t address = SectorAddress(Spare());
+        qspi_.Erase(address, address + kSectorSize);
+        InvalidateCache(address, kSectorSize);
+        spare_erased_ = true;
+    }
+
+    bool Write(int sector, size_t index) {
+        uint32_t address = RecordAddress(sector, index);
+        bool ok = qspi_.Write(address, sizeof(Record), reinterpret_cast<uint8_t *>(&record_)) == daisy::QSPIHandle::Result::OK;
+        InvalidateCache(address, sizeof(Record));
+        return ok;
+    }
+
+    bool Append(int sector, size_t index, size_t slot, const PresetStruct &data) {
+        // staged in RAM, the flash is not mapped while it is written
+        record_.magic = kMagic;
+        record_.slot = uint8_t(slot);
+        record_.reserved = 0xFF;
+        record_.generation = 0;
+        record_.data = data;
+        record_.crc = RecordCrc(record_);
+        return Write(sector, index);
+    }
+
+    // Copies the newest record of every slot and the pending store to the
+    // erased spare sector, then commits it by writing its header
+    void Compact() {
+        int    target = Spare();
+        size_t index = 1;
+        const Record *copied[kPresets];
+
+        spare_erased_ = false;
+        for (size_t p = 0; p < kPresets; p++) {
+            const PresetStruct *data = p == pending_slot_ ? &pending_data_ : Get(p);
+            copied[p] = nullptr;
+            if (data) {
+                if (!Append(target, index, p, *data)) {
+                    return;
+                }
+                copied[p] = RecordAt(target, index);
+                index++;
+            }
+        }
+
+        record_.magic = kMagic;
+        record_.slot = kHeaderSlot;
+        record_.reserved = 0xFF;
+        record_.generation = generation_ + 1;
+        record_.data = pending_data_;
+        record_.crc = RecordCrc(record_);
+        if (!Write(target, 0)) {
+            return;
+        }
+
+        generation_++;
+        active_ = target;
+        head_ = index;
+        for (size_t p = 0; p < kPresets; p++) {
+            latest_[p] = copied[p];
+        }
+        // the old sector is the spare now and is erased ahead of the next copy
+        spare_erased_ = false;
+    }
+
+    daisy::QSPIHandle &qspi_;
+    uint32_t           address_offset_ = 0;
+
+    const Record *latest_[kPresets]; // newest valid record of each slot
+    int           active_ = -1;      // sector holding the log, -1 before the first store
+    uint32_t      generation_ = 0;
+    size_t        head_ = 1;         // next free record in the active sector
+    bool          spare_erased_ = false;
+
+    Record       record_; // staging buffer for the flash writes
+    PresetStruct pending_data_;
+    size_t       pending_slot_ = 0;
+    bool         pending_ = false;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "daisysp.h"
+#include "Placement.h"
+
+#include <stddef.h>
+
+/** A stereo reverb algorithm that KVerbEngine can run.
+ *
+ *  All implementations share ReverbSc's controls: SetFeedback() takes
+ *  0-1, where 1 sustains forever, and SetLpFreq() sets the cutoff of the
+ *  damping low-pass inside the feedback loop, in Hz.
+ */
+class ReverbEngine {
+  public:
+    virtual ~ReverbEngine() {}
+
+    /** Clears all state, may take a while for the larger engines. */
+    virtual void Init(float samplerate) = 0;
+
+    virtual void SetFeedback(float feedback) = 0;
+    virtual void SetLpFreq(float freq) = 0;
+
+    /** Processes one block, out may not alias in. */
+    virtual void Process(const float *inL, const float *inR, float *outL, float *outR, size_t size) = 0;
+};
+
+/** daisysp::ReverbSc: eight modulated delay lines, about 400 kB. */
+class ReverbScEngine : public ReverbEngine {
+  public:
+    ReverbScEngine() {}
+    ~ReverbScEngine() {}
+
+    void Init(float samplerate) override { verb_.Init(samplerate); }
+    void SetFeedback(float feedback) override { verb_.SetFeedback(feedback); }
+    void SetLpFreq(float freq) override { verb_.SetLpFreq(freq); }
+
+    KVERB_ITCM void Process(const float *inL, const float *inR, float *outL, float *outR, size_t size) override {
+        for (size_t i = 0; i < size; i++) {
+            verb_.Process(inL[i], inR[i], &outL[i], &outR[i]);
+        }
+    }
+
+  private:
+    daisysp::ReverbSc verb_;
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "daisy.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/** Wear-leveled, power-loss safe storage of a settings struct in QSPI flash.
+ *
+ *  Drop-in replacement for daisy::PersistentStorage. Saves are coalesced:
+ *  RequestSave() only records the latest settings, and Process(), called
+ *  from the main loop, writes them once the user has been idle for
+ *  kIdleMs and only if they differ from what is already stored.
+ *
+ *  Each save goes to the next of kSlots flash sectors as a record with a
+ *  sequence number and a CRC. At boot the newest record with a valid CRC
+ *  wins, so an interrupted write falls back to the previous save. The
+ *  sector for the following save is erased ahead of time, while idle, so
+ *  a save itself only has to program a few bytes.
+ *
+ *  SettingStruct must be trivially copyable and provide operator!=.
+ */
+template <typename SettingStruct, size_t kSlots = 4>
+class SettingsJournal {
+  public:
+    static_assert(kSlots >= 2, "need at least two slots to survive an interrupted write");
+
+    // Time without further changes before a requested save is written
+    static constexpr uint32_t kIdleMs = 2000;
+
+    // One flash sector per slot
+    static constexpr uint32_t kSlotSize = 4096;
+
+    // Flash used from the address offset on
+    static constexpr uint32_t kRegionSize = kSlots * kSlotSize;
+
+    SettingsJournal(daisy::QSPIHandle &qspi) : qspi_(qspi) {}
+    ~SettingsJournal() {}
+
+    /** Loads the newest valid record, or defaults if there is none.
+     *  \param address_offset start of the kSlots * kSlotSize flash region
+     */
+    void Init(const SettingStruct &defaults, uint32_t address_offset = 0) {
+        address_offset_ = address_offset;
+        settings_ = defaults;
+        sequence_ = 0;
+        slot_ = kSlots - 1;
+        pending_ = false;
+
+        bool found = false;
+        for (size_t s = 0; s < kSlots; s++) {
+            const Record *record = reinterpret_cast<const Record *>(qspi_.GetData(SlotAddress(s)));
+            if (record && IsValid(*record) && (!found || int32_t(record->sequence - sequence_) > 0)) {
+                settings_ = record->data;
+                sequence_ = record->sequence;
+                slot_ = s;
+                found = true;
+            }
+        }
+
+        // the slot after the newest one is overwritten next
+        erase_needed_ = !IsErased(NextSlot());
+    }
+
+    /** The settings as last loaded or saved. */
+    const SettingStruct &GetSettings() const { return settings_; }
+
+    /** Records settings to be saved once the user has been idle for kIdleMs. */
+    void RequestSave(const SettingStruct &settings, uint32_t now) {
+        requested_ = settings;
+        request_time_ = now;
+        pending_ = true;
+    }
+
+    /** True while a requested save has not been written yet. */
+    bool IsPending() const { return pending_; }
+
+    /** Call regularly from the main loop, does at most one flash operation.
+     *  \return true if it erased or wrote flash
+     */
+    bool Process(uint32_t now) {
+        if (pending_) {
+            if (now - request_time_ < kIdleMs) {
+                return false;
+            }
+            pending_ = false;
+            if (requested_ != settings_) {
+                Write(requested_);
+                return true;
+            }
+            return false;
+        }
+
+        if (erase_needed_) {
+            erase_needed_ = false;
+            EraseSlot(NextSlot());
+            return true;
+        }
+        return false;
+    }
+
+  private:
+    struct Record {
+        uint32_t      magic;
+        uint32_t      size;
+        uint32_t      sequence;
+        uint32_t      crc;
+        SettingStruct data;
+    };
+
+    static_assert(sizeof(Record) <= kSlotSize, "settings do not fit in a slot");
+
+    static constexpr uint32_t kMagic = 0x4B564A31; // "KVJ1"
+
+    uint32_t SlotAddress(size_t slot) const { return address_offset_ + uint32_t(slot) * kSlotSize; }
+    size_t NextSlot() const { return (slot_ + 1) % kSlots; }
+
+    static uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc = 0xFFFFFFFF) {
+        for (size_t i = 0; i < size; i++) {
+            crc ^= data[i];
+            for (int b = 0; b < 8; b++) {
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+            }
+        }
+        return crc;
+    }
+
+    static uint32_t RecordCrc(const Record &record) {
+        uint32_t crc = Crc32(reinterpret_cast<const uint8_t *>(&record.sequence), sizeof(record.sequence));
+        return ~Crc32(reinterpret_cast<const uint8_t *>(&record.data), sizeof(record.data), crc);
+    }
+
+    static bool IsValid(const Record &record) {
+        // a size mismatch means the struct layout changed since the save
+        return record.magic == kMagic && record.size == sizeof(SettingStruct) && record.crc == RecordCrc(record);
+    }
+
+    bool IsErased(size_t slot) {
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(qspi_.GetData(SlotAddress(slot)));
+        if (!data) {
+            return false;
+        }
+        for (size_t i = 0; i < sizeof(Record); i++) {
+            if (data[i] != 0xFF) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The memory-mapped reads go through the D-cache, which does not see
+    // erases and writes
+    void InvalidateCache(uint32_t address, uint32_t size) {
+#ifdef __arm__
+        uintptr_t start = reinterpret_cast<uintptr_t>(qspi_.GetData(address)) & ~uintptr_t(31);
+        uintptr_t end = reinterpret_cast<uintptr_t>(qspi_.GetData(address + size));
+        SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(start), int32_t(end - start + 31) & ~31);
+#else
+        (void)address;
+        (void)size;
+#endif
+    }
+
+    void EraseSlot(size_t slot) {
+        uint32_t address = SlotAddress(slot);
+        qspi_.Erase(address, address + kSlotSize);
+        InvalidateCache(address, kSlotSize);
+    }
+
+    void Write(const SettingStruct &settings) {
+        size_t slot = NextSlot();
+        uint32_t address = SlotAddress(slot);
+
+        if (erase_needed_) {
+            // no idle time since the last save to erase ahead of it
+            EraseSlot(slot);
+        }
+
+        record_.magic = kMagic;
+        record_.size = sizeof(SettingStruct);
+        record_.sequence = sequence_ + 1;
+        record_.data = settings;
+        record_.crc = RecordCrc(record_);
+
+        bool ok = qspi_.Write(address, sizeof(Record), reinterpret_cast<uint8_t *>(&record_)) == daisy::QSPIHandle::Result::OK;
+        InvalidateCache(address, sizeof(Record));
+        if (!ok) {
+            // keep the previous slot as the newest one and retry after the next change
+            erase_needed_ = true;
+            return;
+        }
+
+        settings_ = settings;
+        sequence_ = record_.sequence;
+        slot_ = slot;
+        erase_needed_ = true;
+    }
+
+    daisy::QSPIHandle &qspi_;
+    uint32_t           address_offset_ = 0;
+
+    SettingStruct settings_;  // newest record in flash
+    SettingStruct requested_; // waiting for the idle timeout
+    Record        record_;    // staging buffer for the flash write
+
+    uint32_t sequence_ = 0;
+    size_t   slot_ = 0;
+    uint32_t request_time_ = 0;
+    bool     pending_ = false;
+    bool     erase_needed_ = false;
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/** Storage format of a delay line sample.
+ *  float is stored as is. int16_t stores -kHeadroom..kHeadroom with plain
+ *  rounding and no dither, which keeps the noise floor around -90 dBFS
+ *  while halving the memory footprint and bus traffic.
+ */
+template <typename T>
+struct DelaySample;
+
+template <>
+struct DelaySample<float> {
+    static inline float Encode(float in) { return in; }
+    static inline float Decode(float in) { return in; }
+};
+
+template <>
+struct DelaySample<int16_t> {
+    // The send can overshoot full scale a little after the high-pass
+    static constexpr float kHeadroom = 2.0f;
+
+    static inline int16_t Encode(float in) {
+        float scaled = in * (32767.0f / kHeadroom);
+        scaled = scaled > 32767.0f ? 32767.0f : (scaled < -32767.0f ? -32767.0f : scaled);
+        return int16_t(scaled + (scaled >= 0.0f ? 0.5f : -0.5f));
+    }
+    static inline float Decode(int16_t in) { return float(in) * (kHeadroom / 32767.0f); }
+};
+
+/** Stereo delay line with fractional reads and caller-owned memory.
+ *
+ *  Left and right are interleaved, so one frame is fetched with a single
+ *  access, 32 bits for int16_t storage. Delays are in samples with the
+ *  same convention as daisysp::DelayLine: after Write(), Read(1.0f)
+ *  returns the sample just written.
+ *
+ *  Process() handles a whole block at once and only touches the delay
+ *  memory in contiguous spans, which suits external SDRAM much better
+ *  than one scattered read per sample.
+ */
+template <typename T>
+class StereoPreDelay {
+  public:
+    struct Frame {
+        T left;
+        T right;
+    };
+
+    StereoPreDelay() {}
+    ~StereoPreDelay() {}
+
+    /** \param buffer storage for size frames, e.g. in SDRAM */
+    void Init(Frame *buffer, size_t size) {
+        buffer_ = buffer;
+        size_ = size;
+        Reset();
+    }
+
+    void Reset() {
+        for (size_t i = 0; i < size_; i++) {
+            buffer_[i].left = T(0);
+            buffer_[i].right = T(0);
+        }
+        write_ptr_ = 0;
+    }
+
+    /** Longest delay that can be read back, in samples. */
+    float GetMaxDelay() const { return float(size_ - 2); }
+
+    inline void Write(float left, float right) {
+        buffer_[write_ptr_].left = DelaySample<T>::Encode(left);
+        buffer_[write_ptr_].right = DelaySample<T>::Encode(right);
+        write_ptr_ = write_ptr_ + 1 < size_ ? write_ptr_ + 1 : 0;
+    }
+
+    /** \param delay in samples, 1 to GetMaxDelay() */
+    inline void Read(float delay, float *left, float *right) const {
+        ReadFrom(write_ptr_, delay, left, right);
+    }
+
+    /** Writes a block and replaces it with the delayed signal, the same as
+     *  Write() followed by Read() for every frame.
+     *
+     *  The delay ramps linearly from delay_start by delay_step per frame and
+     *  must stay within 1 to GetMaxDelay() - size. The span of the line the
+     *  block reads from is first copied into staging, in at most two chunks
+     *  around the wrap point, and interpolated from there. Spans longer than
+     *  staging_size, from very fast delay sweeps, are read frame by frame.
+     *
+     *  \param staging scratch space in fast internal memory
+     */
+    void Process(float *left, float *right, size_t size, float delay_start, float delay_step,
+                 Frame *staging, size_t staging_size) {
+        if (size == 0) {
+            return;
+        }
+
+        // frame i interpolates between positions base + i + 1 - int(delay)
+        // and the one before it; the extremes are at the ends of the ramp
+        float   delay_end = delay_start + delay_step * float(size - 1);
+        int32_t first_tap = 1 - int32_t(delay_start);
+        int32_t last_tap = int32_t(size) - int32_t(delay_end);
+        int32_t lowest = (first_tap < last_tap ? first_tap : last_tap) - 1;
+        int32_t highest = first_tap > last_tap ? first_tap : last_tap;
+
+        Delays(left, right, size, lowest, highest, staging, staging_size,
+               [=](size_t i) { return delay_start + delay_step * float(i); });
+    }
+
+    /** Process() with a delay per frame instead of a ramp, each within 1
+     *  to GetMaxDelay() - size.
+     */
+    void Process(float *left, float *right, size_t size, const float *delay,
+                 Frame *staging, size_t staging_size) {
+        if (size == 0) {
+            return;
+        }
+
+        // the delay can move either way, so look at every frame's taps
+        int32_t lowest = 1 - int32_t(delay[0]);
+        int32_t highest = lowest;
+        for (size_t i = 1; i < size; i++) {
+            int32_t tap = int32_t(i) + 1 - int32_t(delay[i]);
+            lowest = tap < lowest ? tap : lowest;
+            highest = tap > highest ? tap : highest;
+        }
+
+        Delays(left, right, size, lowest - 1, highest, staging, staging_size,
+               [=](size_t i) { return delay[i]; });
+    }
+
+  private:
+    // Writes the block and reads it back delayed by delay_at(i), from
+    // positions lowest to highest relative to the block start
+    template <typename DelayAt>
+    void Delays(float *left, float *right, size_t size, int32_t lowest, int32_t highest,
+                Frame *staging, size_t staging_size, DelayAt delay_at) {
+        // write the block, wrapping at most once
+        size_t base = write_ptr_;
+        size_t first = size < size_ - base ? size : size_ - base;
+        for (size_t i = 0; i < first; i++) {
+            buffer_[base + i].left = DelaySample<T>::Encode(left[i]);
+            buffer_[base + i].right = DelaySample<T>::Encode(right[i]);
+        }
+        for (size_t i = first; i < size; i++) {
+            buffer_[i - first].left = DelaySample<T>::Encode(left[i]);
+            buffer_[i - first].right = DelaySample<T>::Encode(right[i]);
+        }
+        write_ptr_ = (base + size) % size_;
+
+        size_t span = size_t(highest - lowest + 1);
+        if (span > staging_size) {
+            for (size_t i = 0; i < size; i++) {
+                ReadFrom((base + i + 1) % size_, delay_at(i), &left[i], &right[i]);
+            }
+            return;
+        }
+
+        size_t start = size_t((int32_t(base) + lowest + int32_t(size_)) % int32_t(size_));
+        size_t chunk = span < size_ - start ? span : size_ - start;
+        memcpy(staging, &buffer_[start], chunk * sizeof(Frame));
+        memcpy(&staging[chunk], buffer_, (span - chunk) * sizeof(Frame));
+
+        for (size_t i = 0; i < size; i++) {
+            float   delay = delay_at(i);
+            int32_t delay_integral = int32_t(delay);
+            float   delay_fractional = delay - float(delay_integral);
+
+            const Frame &a = staging[int32_t(i) + 1 - delay_integral - lowest];
+            const Frame &b = staging[int32_t(i) - delay_integral - lowest];
+
+            float al = DelaySample<T>::Decode(a.left);
+            float ar = DelaySample<T>::Decode(a.right);
+            left[i] = al + (DelaySample<T>::Decode(b.left) - al) * delay_fractional;
+            right[i] = ar + (DelaySample<T>::Decode(b.right) - ar) * delay_fractional;
+        }
+    }
+
+    // Read() as if write_ptr_ was at position, which must be below size_
+    inline void ReadFrom(size_t position, float delay, float *left, float *right) const {
+        size_t delay_integral = static_cast<size_t>(delay);
+        float  delay_fractional = delay - static_cast<float>(delay_integral);
+
+        size_t a = position >= delay_integral ? position - delay_integral : position + size_ - delay_integral;
+        size_t b = a > 0 ? a - 1 : size_ - 1;
+
+        float al = DelaySample<T>::Decode(buffer_[a].left);
+        float ar = DelaySample<T>::Decode(buffer_[a].right);
+        *left = al + (DelaySample<T>::Decode(buffer_[b].left) - al) * delay_fractional;
+        *right = ar + (DelaySample<T>::Decode(buffer_[b].right) - ar) * delay_fractional;
+    }
+
+    Frame *buffer_ = nullptr;
+    size_t size_ = 0;
+    size_t write_ptr_ = 0;
+};
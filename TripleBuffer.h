@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/** Lock-free "latest value" mailbox between one writer and one reader.
+ *
+ *  The writer fills WriteBuffer() and calls Publish(), the reader calls
+ *  Read() and always gets the most recently published value, complete.
+ *  Neither side ever waits on the other, so it is safe to use between the
+ *  main loop and an interrupt in either direction, or between threads.
+ */
+template <typename T>
+class TripleBuffer {
+  public:
+    TripleBuffer() {}
+    ~TripleBuffer() {}
+
+    /** Sets all three buffers to value, call before either side starts. */
+    void Init(const T &value) {
+        for (int i = 0; i < 3; i++) {
+            buffers_[i] = value;
+        }
+        back_ = 0;
+        front_ = 1;
+        middle_.store(2, std::memory_order_relaxed);
+    }
+
+    /** Writer side: the buffer to fill before the next Publish(). */
+    T &WriteBuffer() { return buffers_[back_]; }
+
+    /** Writer side: hands the filled buffer over to the reader. */
+    void Publish() {
+        back_ = middle_.exchange(back_ | kFresh, std::memory_order_acq_rel) & kIndexMask;
+    }
+
+    /** Reader side: the latest published value. */
+    const T &Read() {
+        if (middle_.load(std::memory_order_relaxed) & kFresh) {
+            front_ = middle_.exchange(front_, std::memory_order_acq_rel) & kIndexMask;
+        }
+        return buffers_[front_];
+    }
+
+  private:
+    static constexpr uint8_t kIndexMask = 0x3;
+    static constexpr uint8_t kFresh = 0x4;
+
+    T buffers_[3];
+    uint8_t back_ = 0;  // owned by the writer
+    uint8_t front_ = 1; // owned by the reader
+    std::atomic<uint8_t> middle_{2};
+};
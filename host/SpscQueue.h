@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+/** Fixed-size single-producer, single-consumer queue.
+ *
+ *  One thread Push()es and one other thread Pop()s, without locks or
+ *  allocation, so either side can be an audio thread. Indices only ever
+ *  grow, and wrap into the ring by mask.
+ */
+template <typename T, size_t kSize>
+class SpscQueue {
+  public:
+    static_assert((kSize & (kSize - 1)) == 0, "the queue size must be a power of two");
+
+    SpscQueue() {}
+    ~SpscQueue() {}
+
+    /** Producer side. \return false, dropping item, if the queue is full */
+    bool Push(const T &item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= kSize) {
+            return false;
+        }
+        items_[head & kMask] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Consumer side. \return false if the queue is empty */
+    bool Pop(T &item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items_[tail & kMask];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    static constexpr size_t kMask = kSize - 1;
+
+    T items_[kSize];
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
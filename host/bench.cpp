@@ -0,0 +1,1352 @@
+// Host benchmark and offline renderer for the KVerb DSP chain.
+//
+// Runs the KVerbEngine used by AudioCallback in KVerb.cpp, with the
+// Bluemchen hardware layer replaced by WAV files / a generated test signal
+// and fixed parameter values instead of the pots and CVs. The original
+// per-sample callback is kept alongside as the baseline, broken down by stage.
+//
+// usage: kverb_bench [-i in.wav] [-o out.wav] [-r reverb] [-m midi.txt] [-s seconds] [-g ghz] [param=value ...]
+
+#include "CvSampler.h"
+#include "Diagnostics.h"
+#include "DspMemory.h"
+#include "IrBank.h"
+#include "MidiInput.h"
+#include "ModMatrix.h"
+#include "engine.h"
+#include "wav.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace daisysp;
+
+// A patch that exercises every stage, including ducking
+static float param_values[PARAM_COUNT] = {1.0f, 0.5f, 0.6f, 0.2f, 0.7f, 0.5f, 0.1f, 0.0f};
+
+// Reverb used for rendering, -r
+static int render_reverb = REVERB_SC;
+
+static const float samplerates[] = {32000.0f, 48000.0f, 96000.0f};
+static const size_t block_sizes[] = {4, 8, 16, 32, 48, 128};
+
+// The DSP state of the original AudioCallback, processed one sample at a time
+// through all stages, exactly as the firmware did before KVerbEngine
+struct LegacyChain {
+    ReverbSc   verb;
+    DcBlock    blk[2];
+    Compressor sidechain[2];
+    Svf        hpf[2];
+    DelayLine<float, PRE_DELAY_BUFFER_SIZE> predelay[2];
+    float      samplerate;
+
+    void Init(float sr) {
+        samplerate = sr;
+        verb.Init(samplerate);
+        sidechain[0].Init(samplerate);
+        sidechain[1].Init(samplerate);
+        sidechain[0].AutoMakeup(false);
+        sidechain[1].AutoMakeup(false);
+        hpf[0].Init(samplerate);
+        hpf[1].Init(samplerate);
+        hpf[0].SetRes(0.5f);
+        hpf[1].SetRes(0.5f);
+        predelay[0].Init();
+        predelay[1].Init();
+        predelay[0].SetDelay(1.0f);
+        predelay[1].SetDelay(1.0f);
+        blk[0].Init(samplerate);
+        blk[1].Init(samplerate);
+    }
+
+    void SetDuck(float duck_amount) {
+        float threshold = -30.0f + (duck_amount * 25.0f);
+        float ratio = 1.0f + (duck_amount * 9.0f);
+        float attack = 0.001f + ((1.0f - duck_amount) * 0.019f);
+        float release = 0.05f + ((1.0f - duck_amount) * 0.45f);
+        for (int c = 0; c < 2; c++) {
+            sidechain[c].SetThreshold(threshold);
+            sidechain[c].SetRatio(ratio);
+            sidechain[c].SetAttack(attack);
+            sidechain[c].SetRelease(release);
+        }
+    }
+
+    // Body of AudioCallback without the control handling
+    void Process(const float *const *in, float **out, size_t size) {
+        float dryL, dryR, wetL, wetR, sendL, sendR;
+
+        float duck_amount = param_values[DUCK];
+        if (duck_amount > 0.01f) {
+            SetDuck(duck_amount);
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            verb.SetFeedback(param_values[FEED]);
+
+            float lpf_freq = param_values[LPF] * 100.0f;
+            lpf_freq = lpf_freq * lpf_freq * 2.0f;
+            verb.SetLpFreq(lpf_freq);
+
+            float hpf_freq = param_values[HPF] * 100.0f;
+            hpf_freq = hpf_freq * hpf_freq * 2.0f;
+            hpf[0].SetFreq(hpf_freq);
+            hpf[1].SetFreq(hpf_freq);
+
+            dryL = in[0][i];
+            dryR = in[1][i];
+
+            sendL = dryL * param_values[WET];
+            sendR = dryR * param_values[WET];
+
+            hpf[0].Process(sendL);
+            sendL = hpf[0].High();
+            hpf[1].Process(sendR);
+            sendR = hpf[1].High();
+
+            float predly_samples = param_values[PREDLY] * samplerate;
+            predelay[0].Write(sendL);
+            predelay[1].Write(sendR);
+            sendL = predelay[0].Read(predly_samples);
+            sendR = predelay[1].Read(predly_samples);
+
+            verb.Process(sendL, sendR, &wetL, &wetR);
+
+            wetL = blk[0].Process(wetL);
+            wetR = blk[1].Process(wetR);
+
+            if (duck_amount > 0.01f) {
+                wetL = sidechain[0].Process(wetL, dryL);
+                wetR = sidechain[1].Process(wetR, dryR);
+            }
+
+            out[0][i] = (dryL * param_values[DRY]) + wetL;
+            out[1][i] = (dryR * param_values[DRY]) + wetR;
+            out[2][i] = wetL;
+            out[3][i] = wetR;
+        }
+    }
+};
+
+// Planar stereo buffer holding one signal for the whole benchmark run
+struct Signal {
+    std::vector<float> ch[2];
+
+    void Resize(size_t frames) {
+        ch[0].assign(frames, 0.0f);
+        ch[1].assign(frames, 0.0f);
+    }
+    size_t Frames() const { return ch[0].size(); }
+};
+
+// The per-stage loops below replay one stage of the legacy callback on its own,
+// fed with the recorded output of the previous stage, so that each stage
+// can be timed without the others in the cache.
+enum Stage {
+    STAGE_SEND,
+    STAGE_HPF,
+    STAGE_PREDELAY,
+    STAGE_REVERB,
+    STAGE_DCBLOCK,
+    STAGE_DUCK,
+    STAGE_MIX,
+    STAGE_COUNT
+};
+
+static const char *stage_strings[STAGE_COUNT] = {"send", "hpf", "predelay", "reverb", "dcblock", "duck", "mix"};
+
+static void RunStage(LegacyChain &chain, Stage stage, const Signal &dry, const Signal &src, Signal &dst, size_t start, size_t size) {
+    for (size_t i = start; i < start + size; i++) {
+        switch (stage) {
+            case STAGE_SEND:
+                dst.ch[0][i] = src.ch[0][i] * param_values[WET];
+                dst.ch[1][i] = src.ch[1][i] * param_values[WET];
+                break;
+            case STAGE_HPF: {
+                float hpf_freq = param_values[HPF] * 100.0f;
+                hpf_freq = hpf_freq * hpf_freq * 2.0f;
+                for (int c = 0; c < 2; c++) {
+                    chain.hpf[c].SetFreq(hpf_freq);
+                    chain.hpf[c].Process(src.ch[c][i]);
+                    dst.ch[c][i] = chain.hpf[c].High();
+                }
+                break;
+            }
+            case STAGE_PREDELAY: {
+                float predly_samples = param_values[PREDLY] * chain.samplerate;
+                for (int c = 0; c < 2; c++) {
+                    chain.predelay[c].Write(src.ch[c][i]);
+                    dst.ch[c][i] = chain.predelay[c].Read(predly_samples);
+                }
+                break;
+            }
+            case STAGE_REVERB: {
+                chain.verb.SetFeedback(param_values[FEED]);
+                float lpf_freq = param_values[LPF] * 100.0f;
+                lpf_freq = lpf_freq * lpf_freq * 2.0f;
+                chain.verb.SetLpFreq(lpf_freq);
+                chain.verb.Process(src.ch[0][i], src.ch[1][i], &dst.ch[0][i], &dst.ch[1][i]);
+                break;
+            }
+            case STAGE_DCBLOCK:
+                dst.ch[0][i] = chain.blk[0].Process(src.ch[0][i]);
+                dst.ch[1][i] = chain.blk[1].Process(src.ch[1][i]);
+                break;
+            case STAGE_DUCK:
+                if (i == start) {
+                    chain.SetDuck(param_values[DUCK]);
+                }
+                dst.ch[0][i] = chain.sidechain[0].Process(src.ch[0][i], dry.ch[0][i]);
+                dst.ch[1][i] = chain.sidechain[1].Process(src.ch[1][i], dry.ch[1][i]);
+                break;
+            case STAGE_MIX:
+                dst.ch[0][i] = (dry.ch[0][i] * param_values[DRY]) + src.ch[0][i];
+                dst.ch[1][i] = (dry.ch[1][i] * param_values[DRY]) + src.ch[1][i];
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Decaying noise bursts, a rough stand-in for percussive program material
+static void GenerateTestSignal(Signal &sig, float samplerate, float seconds) {
+    sig.Resize(size_t(samplerate * seconds));
+    uint32_t seed = 0x12345678;
+    size_t period = size_t(samplerate * 0.5f);
+    for (size_t i = 0; i < sig.Frames(); i++) {
+        float env = expf(-float(i % period) / (samplerate * 0.05f));
+        for (int c = 0; c < 2; c++) {
+            seed = seed * 1664525u + 1013904223u;
+            sig.ch[c][i] = env * 0.5f * (float(seed >> 8) / 8388608.0f - 1.0f);
+        }
+    }
+}
+
+static double NowNs() {
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Estimates the core clock from the time stamp counter, where there is one
+static double EstimateGhz() {
+#if defined(__x86_64__) || defined(__i386__)
+    double t0 = NowNs();
+    uint64_t c0 = __rdtsc();
+    while (NowNs() - t0 < 100e6) {
+    }
+    uint64_t c1 = __rdtsc();
+    double t1 = NowNs();
+    return double(c1 - c0) / (t1 - t0);
+#else
+    return 0.0;
+#endif
+}
+
+static void PrintResult(float samplerate, size_t block, const char *name, double ns, size_t frames, double ghz) {
+    double ns_per_sample = ns / double(frames);
+    printf("%6.0f  %5zu  %-9s  %9.2f", samplerate, block, name, ns_per_sample);
+    if (ghz > 0.0) {
+        printf("  %9.1f", ns_per_sample * ghz);
+    }
+    else {
+        printf("  %9s", "-");
+    }
+    // share of the real-time budget on this machine
+    printf("  %6.2f%%\n", 100.0 * ns_per_sample * samplerate / 1e9);
+}
+
+// Runs the signal through a stereo pre-delay with storage type T, sweeping
+// the delay time like a slowly turned knob, and returns the time taken.
+// block 0 reads sample by sample, otherwise whole blocks are staged.
+template <typename T>
+static double RunPreDelay(const Signal &src, Signal &dst, float samplerate, size_t block) {
+    std::vector<typename StereoPreDelay<T>::Frame> buffer(PRE_DELAY_BUFFER_SIZE);
+    std::vector<typename StereoPreDelay<T>::Frame> staging(KVerbEngine::kPreDelayStagingSize);
+    StereoPreDelay<T> line;
+    line.Init(buffer.data(), buffer.size());
+
+    size_t frames = src.Frames();
+    float delay_step = 0.05f * samplerate / float(frames);
+    dst = src;
+
+    double t0 = NowNs();
+    if (block == 0) {
+        for (size_t i = 0; i < frames; i++) {
+            line.Write(src.ch[0][i], src.ch[1][i]);
+            line.Read(0.1f * samplerate + delay_step * float(i), &dst.ch[0][i], &dst.ch[1][i]);
+        }
+    }
+    else {
+        for (size_t start = 0; start < frames; start += block) {
+            size_t size = std::min(block, frames - start);
+            line.Process(&dst.ch[0][start], &dst.ch[1][start], size, 0.1f * samplerate + delay_step * float(start), delay_step,
+                         staging.data(), staging.size());
+        }
+    }
+    return NowNs() - t0;
+}
+
+// Compares 16-bit pre-delay storage against float, read per sample (block 1)
+// and staged per block: cost and signal-to-noise ratio
+static void ComparePreDelay(const Signal &dry, float samplerate, double ghz) {
+    Signal ref, compact;
+    ref.Resize(dry.Frames());
+    compact.Resize(dry.Frames());
+
+    PrintResult(samplerate, 1, "pd-f32", RunPreDelay<float>(dry, ref, samplerate, 0), dry.Frames(), ghz);
+    PrintResult(samplerate, 1, "pd-i16", RunPreDelay<int16_t>(dry, compact, samplerate, 0), dry.Frames(), ghz);
+    for (size_t block : block_sizes) {
+        Signal staged;
+        PrintResult(samplerate, block, "pd-f32", RunPreDelay<float>(dry, staged, samplerate, block), dry.Frames(), ghz);
+        PrintResult(samplerate, block, "pd-i16", RunPreDelay<int16_t>(dry, staged, samplerate, block), dry.Frames(), ghz);
+    }
+
+    double signal = 0.0, noise = 0.0;
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = 0; i < dry.Frames(); i++) {
+            double err = double(compact.ch[c][i]) - double(ref.ch[c][i]);
+            signal += double(ref.ch[c][i]) * double(ref.ch[c][i]);
+            noise += err * err;
+        }
+    }
+    printf("%6.0f         pd-i16 SNR vs float: %.1f dB\n", samplerate, 10.0 * log10(signal / std::max(noise, 1e-30)));
+}
+
+// Runs a reverb over src followed by as much silence, with the bench patch
+static void RunReverb(ReverbEngine *verb, const Signal &src, Signal &dst, float samplerate) {
+    size_t frames = src.Frames();
+    std::vector<float> silence(frames, 0.0f);
+    dst.Resize(frames * 2);
+    verb->Init(samplerate);
+    verb->SetFeedback(param_values[FEED]);
+    verb->SetLpFreq(param_values[LPF] * 100.0f * param_values[LPF] * 100.0f * 2.0f);
+    for (size_t start = 0, size = 0; start < frames * 2; start += size) {
+        // No block straddles the end of src
+        size_t end = start < frames ? frames : frames * 2;
+        size = std::min(size_t(48), end - start);
+        const float *inL = start < frames ? &src.ch[0][start] : &silence[start - frames];
+        const float *inR = start < frames ? &src.ch[1][start] : &silence[start - frames];
+        verb->Process(inL, inR, &dst.ch[0][start], &dst.ch[1][start], size);
+    }
+}
+
+// RMS of frames from..to of a signal, in dB
+static double LevelDb(const Signal &sig, size_t from, size_t to) {
+    double sum = 0.0;
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = from; i < to; i++) {
+            sum += double(sig.ch[c][i]) * double(sig.ch[c][i]);
+        }
+    }
+    return 10.0 * log10(std::max(sum / double(2 * (to - from)), 1e-30));
+}
+
+// Compares the 16-bit FDN delay lines against float: signal-to-noise ratio
+// while the input plays, and the level of the tail at the end of the
+// silence that follows it
+static void CompareReverbPrecision(const Signal &dry, float samplerate) {
+    std::unique_ptr<Reverbs> reverbs(new Reverbs);
+    const int pairs[2][2] = {{REVERB_FDN8, REVERB_FDN8_Q15}, {REVERB_FDN4, REVERB_FDN4_Q15}};
+    size_t frames = dry.Frames();
+    size_t last = frames * 2 - std::min(frames, size_t(samplerate / 4.0f));
+
+    for (const int *pair : pairs) {
+        Signal ref, compact;
+        RunReverb(reverbs->Get(pair[0]), dry, ref, samplerate);
+        RunReverb(reverbs->Get(pair[1]), dry, compact, samplerate);
+
+        double signal = 0.0, noise = 0.0;
+        for (int c = 0; c < 2; c++) {
+            for (size_t i = 0; i < frames; i++) {
+                double err = double(compact.ch[c][i]) - double(ref.ch[c][i]);
+                signal += double(ref.ch[c][i]) * double(ref.ch[c][i]);
+                noise += err * err;
+            }
+        }
+        printf("%6.0f         %-5s SNR vs float: %.1f dB, tail %.1f dB (float %.1f dB)\n", samplerate,
+               reverb_strings[pair[1]], 10.0 * log10(signal / std::max(noise, 1e-30)),
+               LevelDb(compact, last, frames * 2), LevelDb(ref, last, frames * 2));
+    }
+}
+
+// Largest difference between two signals, in dB relative to the peak of ref
+static double ErrorDb(const Signal &ref, const Signal &test) {
+    double peak = 0.0, err = 0.0;
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = 0; i < ref.Frames(); i++) {
+            peak = std::max(peak, double(fabsf(ref.ch[c][i])));
+            err = std::max(err, double(fabsf(test.ch[c][i] - ref.ch[c][i])));
+        }
+    }
+    return 20.0 * log10(std::max(err, 1e-30) / std::max(peak, 1e-30));
+}
+
+// Block kernels must stay this close to the per-sample DaisySP stages
+static const double kKernelToleranceDb = -100.0;
+
+// Times the block kernels the engine uses for the send gain, high-pass,
+// DC block, ducking and mix stages, and checks their output against the legacy
+// per-sample stages. Returns false if any kernel is out of tolerance.
+static bool BenchmarkKernels(const Signal &dry, float samplerate, double ghz) {
+    size_t frames = dry.Frames();
+    std::unique_ptr<LegacyChain> chain(new LegacyChain);
+
+    // legacy reference for each stage, fed from the previous one
+    Signal ref[STAGE_COUNT + 1];
+    ref[0] = dry;
+    chain->Init(samplerate);
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        ref[s + 1].Resize(frames);
+        RunStage(*chain, Stage(s), dry, ref[s], ref[s + 1], 0, frames);
+    }
+
+    // the engine's per-frame gains, held at the bench patch
+    std::vector<float> wet_gains(frames, param_values[WET]);
+    std::vector<float> dry_gains(frames, param_values[DRY]);
+
+    const Stage stages[] = {STAGE_SEND, STAGE_HPF, STAGE_DCBLOCK, STAGE_MIX};
+    bool ok = true;
+    for (Stage stage : stages) {
+        double error = -1000.0;
+        for (size_t block : block_sizes) {
+            StereoHighPass hpf;
+            StereoDcBlock  blk;
+            hpf.Init(samplerate);
+            hpf.SetRes(0.5f);
+            hpf.SetFreq(param_values[HPF] * 100.0f * param_values[HPF] * 100.0f * 2.0f);
+            blk.Init();
+
+            const Signal &src = ref[stage];
+            Signal dst = src;
+            double t0 = NowNs();
+            for (size_t start = 0; start < frames; start += block) {
+                size_t size = std::min(block, frames - start);
+                float *l = &dst.ch[0][start], *r = &dst.ch[1][start];
+                switch (stage) {
+                    case STAGE_SEND:
+                        ScaleGains(l, &wet_gains[start], l, size);
+                        ScaleGains(r, &wet_gains[start], r, size);
+                        break;
+                    case STAGE_HPF: hpf.Process(l, r, size); break;
+                    case STAGE_DCBLOCK: blk.Process(l, r, size); break;
+                    case STAGE_MIX:
+                        MixGains(&dry.ch[0][start], &dry_gains[start], l, l, size);
+                        MixGains(&dry.ch[1][start], &dry_gains[start], r, r, size);
+                        break;
+                    default: break;
+                }
+            }
+            char name[16];
+            snprintf(name, sizeof(name), "k-%s", stage_strings[stage]);
+            PrintResult(samplerate, block, name, NowNs() - t0, frames, ghz);
+            error = std::max(error, ErrorDb(ref[stage + 1], dst));
+        }
+        bool pass = error < kKernelToleranceDb;
+        printf("%6.0f         k-%s error vs DaisySP: %.1f dB %s\n", samplerate, stage_strings[stage], error, pass ? "ok" : "FAIL");
+        ok = ok && pass;
+    }
+
+    // The linked ducker applies one gain to both channels, so it only
+    // matches the two legacy compressors when the key is the same on both.
+    Signal mono_key = dry;
+    mono_key.ch[1] = mono_key.ch[0];
+    Signal duck_ref = ref[STAGE_DUCK];
+    chain->Init(samplerate);
+    RunStage(*chain, STAGE_DUCK, mono_key, ref[STAGE_DUCK], duck_ref, 0, frames);
+
+    double error = -1000.0;
+    for (size_t block : block_sizes) {
+        Ducker ducker;
+        ducker.Init(samplerate);
+        ducker.SetAmount(param_values[DUCK]);
+
+        Signal dst = ref[STAGE_DUCK];
+        double t0 = NowNs();
+        for (size_t start = 0; start < frames; start += block) {
+            size_t size = std::min(block, frames - start);
+            ducker.Process(&mono_key.ch[0][start], &mono_key.ch[1][start], &dst.ch[0][start], &dst.ch[1][start], size);
+        }
+        PrintResult(samplerate, block, "k-duck", NowNs() - t0, frames, ghz);
+        error = std::max(error, ErrorDb(duck_ref, dst));
+    }
+    bool pass = error < kKernelToleranceDb;
+    printf("%6.0f         k-duck error vs DaisySP (mono key): %.1f dB %s\n", samplerate, error, pass ? "ok" : "FAIL");
+    return ok && pass;
+}
+
+// What metering should cost per frame on the hardware, two cycles for each
+// of the input and wet output samples. Reported against the 48-frame rows,
+// not checked: host timings are too noisy to gate the exit code on.
+static const double kMeterBudgetCycles = 8.0;
+
+// Runs the metering passes over the whole signal, as the engine does per
+// block. Returns the input peak, and the summed input energy in energy.
+static float MeterPasses(const Signal &dry, const Signal &wet, size_t block, LevelMeter &meter, double &energy) {
+    size_t frames = dry.Frames();
+    float peak = 0.0f;
+    energy = 0.0;
+    for (size_t start = 0; start < frames; start += block) {
+        size_t size = std::min(block, frames - start);
+        float in_energy, wet_energy;
+        float in_peak = PeakEnergy(&dry.ch[0][start], &dry.ch[1][start], size, in_energy);
+        float wet_peak = PeakEnergy(&wet.ch[0][start], &wet.ch[1][start], size, wet_energy);
+        meter.Add(size, in_peak, in_energy, wet_peak, wet_energy, 1.0f);
+        energy += in_energy;
+        peak = fmaxf(peak, in_peak);
+    }
+    return peak;
+}
+
+// The peak-only passes the sleep detection made before metering
+static float PeakPasses(const Signal &dry, const Signal &wet, size_t block) {
+    size_t frames = dry.Frames();
+    float peak = 0.0f;
+    for (size_t start = 0; start < frames; start += block) {
+        size_t size = std::min(block, frames - start);
+        peak = fmaxf(peak, PeakLevel(&dry.ch[0][start], &dry.ch[1][start], size));
+        peak = fmaxf(peak, PeakLevel(&wet.ch[0][start], &wet.ch[1][start], size));
+    }
+    return peak;
+}
+
+// Times the level metering the engine does per block: one pass over the
+// input and one over the wet output for peak and energy, and the meter
+// snapshot. The k-peak row is the peak-only passes the sleep detection
+// made before. Each is run once untimed first, so both start warm. Checks
+// the levels against a double precision sum over the whole signal and
+// returns false if they are off.
+static bool BenchmarkMeters(const Signal &dry, float samplerate, double ghz) {
+    size_t frames = dry.Frames();
+    Signal wet = dry;
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = 0; i < frames; i++) {
+            wet.ch[c][i] *= 0.25f;
+        }
+    }
+
+    double ref_peak = 0.0, ref_energy = 0.0;
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = 0; i < frames; i++) {
+            ref_peak = std::max(ref_peak, double(fabsf(dry.ch[c][i])));
+            ref_energy += double(dry.ch[c][i]) * double(dry.ch[c][i]);
+        }
+    }
+
+    bool ok = true;
+    double cycles = 0.0, error = 0.0;
+    for (size_t block : block_sizes) {
+        float warm_peak = PeakPasses(dry, wet, block);
+        double t0 = NowNs();
+        float peak = PeakPasses(dry, wet, block);
+        PrintResult(samplerate, block, "k-peak", NowNs() - t0, frames, ghz);
+        ok = ok && double(warm_peak) == ref_peak && double(peak) == ref_peak;
+
+        LevelMeter meter;
+        meter.Init(samplerate, KVerbEngine::kMeterRate);
+        double energy;
+        MeterPasses(dry, wet, block, meter, energy);
+        t0 = NowNs();
+        peak = MeterPasses(dry, wet, block, meter, energy);
+        double ns = NowNs() - t0;
+        PrintResult(samplerate, block, "k-meter", ns, frames, ghz);
+        if (block == 48) {
+            cycles = ns / double(frames) * ghz;
+        }
+        error = std::max(error, fabs(10.0 * log10(std::max(energy, 1e-30) / std::max(ref_energy, 1e-30))));
+        ok = ok && double(peak) == ref_peak;
+    }
+    ok = ok && error < 1e-3;
+    printf("%6.0f         k-meter energy error %.5f dB %s, %.2f cycles/sample at 48 frames (target %.0f)\n", samplerate, error,
+           ok ? "ok" : "FAIL", cycles, kMeterBudgetCycles);
+    return ok;
+}
+
+// Response lengths the early reflections are timed with, in samples
+static const size_t er_lengths[] = {1024, 2048, EarlyReflections::kMaxLength};
+
+// The partitioned convolution must stay this close to the direct form
+static const double kConvolutionToleranceDb = -90.0;
+
+// Frames checked against direct convolution, which is slow
+static const size_t kConvolutionCheckFrames = 8192;
+
+// A decaying noise burst, so every partition of the response is busy
+static void MakeResponse(std::vector<float> &left, std::vector<float> &right, size_t length) {
+    left.resize(length);
+    right.resize(length);
+    uint32_t random = 0x1234567;
+    for (size_t i = 0; i < length; i++) {
+        float decay = expf(-3.0f * float(i) / float(length));
+        random = random * 1664525u + 1013904223u;
+        left[i] = (float(random >> 8) / 8388608.0f - 1.0f) * 0.1f * decay;
+        random = random * 1664525u + 1013904223u;
+        right[i] = (float(random >> 8) / 8388608.0f - 1.0f) * 0.1f * decay;
+    }
+}
+
+// Times the early reflections for each response length and block size:
+// per sample as the other rows, and the slowest calls, which is what the
+// audio deadline sees. The 99.9th percentile leaves out the odd call the
+// host OS preempts. Checks the longest response against direct
+// convolution, and times the engine with them mixed in. Returns false if
+// the convolution is out of tolerance.
+static bool BenchmarkEarlyReflections(const Signal &dry, float samplerate, double ghz) {
+    size_t frames = dry.Frames();
+    std::unique_ptr<EarlyReflections::History> history(new EarlyReflections::History);
+    std::unique_ptr<EarlyReflections::Impulse> impulse(new EarlyReflections::Impulse);
+    std::unique_ptr<EarlyReflections> er(new EarlyReflections);
+    EarlyReflections::Fft fft;
+    fft.Init();
+    Signal wet;
+    wet.Resize(frames);
+
+    std::vector<float> left, right;
+    for (size_t length : er_lengths) {
+        MakeResponse(left, right, length);
+        EarlyReflections::Prepare(fft, *impulse, left.data(), right.data(), length);
+
+        for (size_t block : block_sizes) {
+            er->Init(history.get());
+            er->SetImpulse(impulse.get());
+            er->Reset();
+            std::vector<double> calls;
+            calls.reserve(frames / block + 1);
+            double t0 = NowNs();
+            for (size_t start = 0; start < frames; start += block) {
+                size_t size = std::min(block, frames - start);
+                double t1 = NowNs();
+                er->Process(&dry.ch[0][start], &dry.ch[1][start], &wet.ch[0][start], &wet.ch[1][start], size);
+                calls.push_back(NowNs() - t1);
+            }
+            double ns = NowNs() - t0;
+            auto slow = calls.begin() + ptrdiff_t(double(calls.size() - 1) * 0.999);
+            std::nth_element(calls.begin(), slow, calls.end());
+            double worst = *slow;
+            char name[16];
+            snprintf(name, sizeof(name), "er-%zu", length);
+            PrintResult(samplerate, block, name, ns, frames, ghz);
+            printf("%6.0f  %5zu  %-9s  p99.9 call %.2f us, %.1f%% of the block\n", samplerate, block, name,
+                   worst / 1000.0, 100.0 * worst * samplerate / 1e9 / double(block));
+        }
+    }
+
+    // the output of the last run is the response from its second partition
+    // on, in step with the input
+    size_t check = std::min(frames, kConvolutionCheckFrames);
+    Signal ref, test;
+    ref.Resize(check);
+    test.Resize(check);
+    const float *response[2] = {left.data(), right.data()};
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = 0; i < check; i++) {
+            double sum = 0.0;
+            for (size_t j = EarlyReflections::kPartitionSize; j < left.size() && j <= i; j++) {
+                sum += double(response[c][j]) * double(dry.ch[c][i - j]);
+            }
+            ref.ch[c][i] = float(sum);
+            test.ch[c][i] = wet.ch[c][i];
+        }
+    }
+    double error = ErrorDb(ref, test);
+    bool pass = error < kConvolutionToleranceDb;
+    printf("%6.0f         er error vs direct convolution: %.1f dB %s\n", samplerate, error, pass ? "ok" : "FAIL");
+
+    // the engine with the built-in hall mixed in
+    std::unique_ptr<KVerbEngine> engine(new KVerbEngine);
+    std::unique_ptr<Reverbs> reverbs(new Reverbs);
+    std::vector<PreDelayLine::Frame> predelay(PRE_DELAY_BUFFER_SIZE);
+    std::vector<float> out[4];
+    for (int c = 0; c < 4; c++) {
+        out[c].assign(frames, 0.0f);
+    }
+    IrBank bank;
+    bank.Init(nullptr);
+    left.resize(EarlyReflections::kMaxLength);
+    right.resize(EarlyReflections::kMaxLength);
+    size_t length = bank.Load(2, samplerate, left.data(), right.data(), left.size());
+    EarlyReflections::Prepare(fft, *impulse, left.data(), right.data(), length);
+    float values[PARAM_COUNT];
+    std::copy(param_values, param_values + PARAM_COUNT, values);
+    values[EARLY] = 0.5f;
+
+    for (size_t block : block_sizes) {
+        engine->Init(samplerate, reverbs->Get(REVERB_SC), predelay.data(), predelay.size(), history.get());
+        engine->SetEarlyReflections(impulse.get());
+        double t0 = NowNs();
+        for (size_t start = 0; start < frames; start += block) {
+            size_t size = std::min(block, frames - start);
+            const float *in[2] = {&dry.ch[0][start], &dry.ch[1][start]};
+            float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+            engine->SetParams(values);
+            engine->Process(in, o, size);
+            engine->ClearReverb();
+        }
+        PrintResult(samplerate, block, "eng-er", NowNs() - t0, frames, ghz);
+    }
+    return pass;
+}
+
+// Places the firmware's DSP memory in arenas of DSP_ARENA_SIZES, as
+// allocateDsp in KVerb.cpp does, and prints each region's use and its
+// components. Fails if the plan does not fit at this rate.
+static bool CheckMemoryMap(float samplerate) {
+    std::vector<uint8_t> pools[MEMORY_REGION_COUNT];
+    std::unique_ptr<MemoryMap> map(new MemoryMap);
+    for (int r = 0; r < MEMORY_REGION_COUNT; r++) {
+        pools[r].resize(DSP_ARENA_SIZES[r] + MemoryArena::kAlignment);
+        uintptr_t base = (reinterpret_cast<uintptr_t>(pools[r].data()) + MemoryArena::kAlignment - 1) & ~uintptr_t(MemoryArena::kAlignment - 1);
+        map->Init(static_cast<MemoryRegion>(r), reinterpret_cast<void *>(base), DSP_ARENA_SIZES[r]);
+    }
+
+    DspMemory dsp;
+    bool pass = dsp.Allocate(*map, samplerate);
+    for (int r = 0; r < MEMORY_REGION_COUNT; r++) {
+        const MemoryArena &arena = map->GetArena(static_cast<MemoryRegion>(r));
+        printf("%6.0f         mem-%-5s %8zu of %8zu bytes\n", samplerate, memory_region_strings[r], arena.GetUsed(), arena.GetCapacity());
+        for (size_t a = 0; a < arena.GetAllocationCount(); a++) {
+            printf("%6.0f           %-5s   %8zu bytes\n", samplerate, arena.GetAllocation(a).owner, arena.GetAllocation(a).bytes);
+        }
+    }
+    printf("%6.0f         mem fits DSP_ARENA_SIZES: %s\n", samplerate, pass ? "ok" : "FAIL");
+    if (pass) {
+        dsp.verb_sc->~ReverbScEngine();
+        dsp.verb_fdn8->~FdnReverb();
+        dsp.verb_fdn4->~FdnReverb();
+        dsp.verb_fdn8_q15->~FdnReverb();
+        dsp.verb_fdn4_q15->~FdnReverb();
+    }
+    return pass;
+}
+
+#ifdef KVERB_DIAGNOSTICS
+// The engine's own instrumentation, as shown on the diagnostics page
+static void PrintDiagnostics(float samplerate, size_t block) {
+    printf("%6.0f  %5zu  diag       load avg %.2f%% peak %.2f%% max %.2f%%, %lu overruns\n", samplerate, block,
+           diagnostics.GetAverageLoad(), diagnostics.GetPeakLoad(), diagnostics.GetWorstLoad(),
+           (unsigned long)diagnostics.GetOverruns());
+    for (int t = 0; t <= Diagnostics::TIMER_CALLBACK; t++) {
+        const Diagnostics::TimerStats &stats = diagnostics.GetTimer(Diagnostics::Timer(t));
+        printf("%6.0f  %5zu  diag-%-5s  avg %8.3f us  max %8.3f us\n", samplerate, block,
+               Diagnostics::GetTimerName(Diagnostics::Timer(t)), stats.average_us, stats.worst_us);
+    }
+}
+#endif
+
+static void Benchmark(const Signal &dry, float samplerate, double ghz) {
+    size_t frames = dry.Frames();
+    std::unique_ptr<LegacyChain> chain(new LegacyChain);
+    std::unique_ptr<KVerbEngine> engine(new KVerbEngine);
+    std::unique_ptr<Reverbs> reverbs(new Reverbs);
+    std::vector<PreDelayLine::Frame> predelay(PRE_DELAY_BUFFER_SIZE);
+    std::unique_ptr<EarlyReflections::History> er_history(new EarlyReflections::History);
+
+    // stage inputs: the dry signal, then each stage's output in turn
+    Signal stage_io[STAGE_COUNT + 1];
+    stage_io[0] = dry;
+    for (int s = 1; s <= STAGE_COUNT; s++) {
+        stage_io[s].Resize(frames);
+    }
+
+    std::vector<float> out[4];
+    for (int c = 0; c < 4; c++) {
+        out[c].assign(frames, 0.0f);
+    }
+
+    Signal idle = dry;
+    for (int c = 0; c < 2; c++) {
+        std::fill(idle.ch[c].begin() + std::min(frames, size_t(samplerate)), idle.ch[c].end(), 0.0f);
+    }
+
+    for (size_t block : block_sizes) {
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            chain->Init(samplerate);
+            double t0 = NowNs();
+            for (size_t start = 0; start < frames; start += block) {
+                size_t size = std::min(block, frames - start);
+                RunStage(*chain, Stage(s), dry, stage_io[s], stage_io[s + 1], start, size);
+            }
+            PrintResult(samplerate, block, stage_strings[s], NowNs() - t0, frames, ghz);
+        }
+
+        chain->Init(samplerate);
+        double t0 = NowNs();
+        for (size_t start = 0; start < frames; start += block) {
+            size_t size = std::min(block, frames - start);
+            const float *in[2] = {&dry.ch[0][start], &dry.ch[1][start]};
+            float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+            chain->Process(in, o, size);
+        }
+        PrintResult(samplerate, block, "legacy", NowNs() - t0, frames, ghz);
+
+        // each reverb on its own, fed with the legacy pre-delay output
+        for (int r = 0; r < REVERB_COUNT; r++) {
+            ReverbEngine *verb = reverbs->Get(r);
+            verb->Init(samplerate);
+            verb->SetFeedback(param_values[FEED]);
+            verb->SetLpFreq(param_values[LPF] * 100.0f * param_values[LPF] * 100.0f * 2.0f);
+            const Signal &src = stage_io[STAGE_REVERB];
+            Signal &dst = stage_io[STAGE_REVERB + 1];
+            t0 = NowNs();
+            for (size_t start = 0; start < frames; start += block) {
+                size_t size = std::min(block, frames - start);
+                verb->Process(&src.ch[0][start], &src.ch[1][start], &dst.ch[0][start], &dst.ch[1][start], size);
+            }
+            char name[16];
+            snprintf(name, sizeof(name), "rv-%s", reverb_strings[r]);
+            PrintResult(samplerate, block, name, NowNs() - t0, frames, ghz);
+        }
+
+        // the whole engine with each of the cheaper reverbs
+        for (int r = REVERB_SC + 1; r < REVERB_COUNT; r++) {
+            engine->Init(samplerate, reverbs->Get(r), predelay.data(), predelay.size(), er_history.get());
+            t0 = NowNs();
+            for (size_t start = 0; start < frames; start += block) {
+                size_t size = std::min(block, frames - start);
+                const float *in[2] = {&dry.ch[0][start], &dry.ch[1][start]};
+                float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+                engine->SetParams(param_values);
+                engine->Process(in, o, size);
+                engine->ClearReverb();
+            }
+            char name[16];
+            snprintf(name, sizeof(name), "eng-%s", reverb_strings[r]);
+            PrintResult(samplerate, block, name, NowNs() - t0, frames, ghz);
+        }
+
+        engine->Init(samplerate, reverbs->Get(REVERB_SC), predelay.data(), predelay.size(), er_history.get());
+#ifdef KVERB_DIAGNOSTICS
+        diagnostics.Init(samplerate);
+#endif
+        t0 = NowNs();
+        for (size_t start = 0; start < frames; start += block) {
+            size_t size = std::min(block, frames - start);
+            const float *in[2] = {&dry.ch[0][start], &dry.ch[1][start]};
+            float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+            KVERB_DIAG_BEGIN_CALLBACK();
+            engine->SetParams(param_values);
+            engine->Process(in, o, size);
+            KVERB_DIAG_END_CALLBACK(size);
+            engine->ClearReverb();
+        }
+        PrintResult(samplerate, block, "engine", NowNs() - t0, frames, ghz);
+#ifdef KVERB_DIAGNOSTICS
+        PrintDiagnostics(samplerate, block);
+#endif
+
+        // the first second of the signal and then silence, which lets the
+        // engine go to sleep once the tail has decayed
+        engine->Init(samplerate, reverbs->Get(REVERB_SC), predelay.data(), predelay.size(), er_history.get());
+        size_t sleeping = 0;
+        t0 = NowNs();
+        for (size_t start = 0; start < frames; start += block) {
+            size_t size = std::min(block, frames - start);
+            const float *in[2] = {&idle.ch[0][start], &idle.ch[1][start]};
+            float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+            engine->SetParams(param_values);
+            engine->Process(in, o, size);
+            engine->ClearReverb();
+            sleeping += engine->IsSleeping() ? size : 0;
+        }
+        PrintResult(samplerate, block, "idle", NowNs() - t0, frames, ghz);
+        printf("%6.0f  %5zu  idle       asleep %.0f%% of the time\n", samplerate, block, 100.0 * double(sleeping) / double(frames));
+    }
+}
+
+// Slow LFOs standing in for CV1 and CV2 in the modulation rows
+static void CvAt(double seconds, float *cv) {
+    cv[0] = sinf(float(2.0 * M_PI * 3.0 * seconds));
+    cv[1] = sinf(float(2.0 * M_PI * 0.5 * seconds));
+}
+
+// The two ways the firmware applies CV1 and CV2 to dry, wet and pre-delay:
+// cv-blk maps one value per block, cv-smp ramps them through engine
+// spans at the points of an 8 kHz CvSampler, as ProcessMapped in KVerb.cpp
+// does
+static void BenchmarkCv(const Signal &dry, float samplerate, double ghz) {
+    const float cv_rate = 8000.0f;
+    const int   audio_rate_params[3] = {DRY, WET, PREDLY};
+    size_t frames = dry.Frames();
+
+    std::unique_ptr<KVerbEngine> engine(new KVerbEngine);
+    std::unique_ptr<Reverbs> reverbs(new Reverbs);
+    std::vector<PreDelayLine::Frame> predelay(PRE_DELAY_BUFFER_SIZE);
+    std::unique_ptr<EarlyReflections::History> er_history(new EarlyReflections::History);
+    std::vector<float> out[4];
+    for (int c = 0; c < 4; c++) {
+        out[c].assign(frames, 0.0f);
+    }
+
+    ModMatrix<PARAM_COUNT, 2> matrix;
+    matrix.Init();
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        matrix.SetBias(p, param_values[p]);
+    }
+    matrix.SetCoefficient(DRY, 0, -0.2f);
+    matrix.SetCoefficient(WET, 0, 0.3f);
+    matrix.SetCoefficient(PREDLY, 1, 0.05f);
+
+    for (size_t block : block_sizes) {
+        for (int audio_rate = 0; audio_rate < 2; audio_rate++) {
+            engine->Init(samplerate, reverbs->Get(REVERB_SC), predelay.data(), predelay.size(), er_history.get());
+            CvSampler<2> sampler;
+            sampler.Reset(cv_rate / samplerate);
+            size_t pushed = 0;
+            float  cv[2], values[PARAM_COUNT];
+
+            double t0 = NowNs();
+            for (size_t start = 0; start < frames; start += block) {
+                size_t size = std::min(block, frames - start);
+                const float *in[2] = {&dry.ch[0][start], &dry.ch[1][start]};
+                float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+
+                // the control task's share, once per block either way
+                CvAt(double(start) / samplerate, cv);
+                matrix.Process(cv, values);
+
+                if (!audio_rate) {
+                    engine->SetParams(values);
+                    engine->Process(in, o, size);
+                    engine->ClearReverb();
+                    continue;
+                }
+
+                // the timer's points for this block
+                while (double(pushed) < double(start + size) * cv_rate / samplerate) {
+                    CvAt(double(pushed) / cv_rate, cv);
+                    sampler.Push(cv);
+                    pushed++;
+                }
+                engine->BeginBlock(in, o, size);
+                for (size_t offset = 0; offset < size;) {
+                    size_t span = sampler.Advance(size - offset, cv);
+                    for (int p : audio_rate_params) {
+                        values[p] = matrix.Map(p, matrix.GetBias(p) + matrix.GetCoefficient(p, 0) * cv[0]
+                                                                    + matrix.GetCoefficient(p, 1) * cv[1]);
+                    }
+                    engine->AddSpan(span, values);
+                    offset += span;
+                }
+                engine->EndBlock();
+                engine->ClearReverb();
+            }
+            PrintResult(samplerate, block, audio_rate ? "cv-smp" : "cv-blk", NowNs() - t0, frames, ghz);
+        }
+    }
+}
+
+// One MIDI message as captured, with the time its first byte started
+struct MidiEvent {
+    double  seconds;
+    uint8_t bytes[3];
+    size_t  size;
+};
+
+// Reads a recorded stream, one message per line as the time in seconds
+// followed by its bytes in hex, e.g. "1.2345 b0 01 7f". # starts a comment.
+static bool LoadMidiEvents(const char *path, std::vector<MidiEvent> &events) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        MidiEvent event = {};
+        char *p = line;
+        char *end;
+        event.seconds = strtod(p, &end);
+        if (end == p) {
+            continue;
+        }
+        for (p = end; event.size < 3; p = end) {
+            unsigned long byte = strtoul(p, &end, 16);
+            if (end == p) {
+                break;
+            }
+            event.bytes[event.size++] = uint8_t(byte);
+        }
+        events.push_back(event);
+    }
+    fclose(file);
+    std::sort(events.begin(), events.end(), [](const MidiEvent &a, const MidiEvent &b) { return a.seconds < b.seconds; });
+    return true;
+}
+
+// A stand-in for a recorded performance: two controllers swept in bursts
+// as fast as the line allows, in running status, with notes in between
+// that are not control changes, and a 120 BPM clock
+static void GenerateMidiEvents(std::vector<MidiEvent> &events, double seconds) {
+    srand(7);
+    const double byte_time = 1.0 / 3125.0;
+    double t = 0.01;
+    while (t < seconds) {
+        // a burst of one knob turn, back to back on the line
+        int controller = rand() % 2 ? 1 : 11;
+        int value = rand() % 128;
+        int steps = 1 + rand() % 24;
+        events.push_back({t, {0xB0, uint8_t(controller), uint8_t(value)}, 3});
+        t += 3 * byte_time;
+        for (int s = 1; s < steps; s++) {
+            value = (value + 1 + rand() % 4) % 128;
+            events.push_back({t, {uint8_t(controller), uint8_t(value)}, 2});
+            t += 2 * byte_time * (rand() % 4 == 0 ? 2.0 + rand() % 8 : 1.0);
+        }
+        if (rand() % 4 == 0) {
+            events.push_back({t, {0x90, 60, 100}, 3});
+            t += 3 * byte_time;
+        }
+        t += 0.001 * (1 + rand() % 40);
+    }
+    for (double clock = 0.0; clock < seconds; clock += 0.5 / 24.0) {
+        events.push_back({clock, {0xF8}, 1});
+    }
+    std::stable_sort(events.begin(), events.end(), [](const MidiEvent &a, const MidiEvent &b) { return a.seconds < b.seconds; });
+}
+
+// TIM2, which System::GetTick() reads on the Seed
+static const double kMidiTickRate = 200e6;
+
+// Interrupt latency of the audio callback's GetTick(), drawn at random up
+// to this, in seconds
+static const double kCallbackJitter = 2e-6;
+
+// Halves of the firmware's circular receive buffer, MIDI_RX_SIZE
+static const size_t kMidiHalfSize = 3;
+
+// A batch of bytes as the UART interrupt hands it over
+struct MidiReport {
+    double               seconds;
+    std::vector<uint8_t> bytes;
+};
+
+// Puts a stream on the line at 31250 baud, with real-time bytes going out
+// at the next byte boundary, between the bytes of a message if need be.
+// Returns the reports of the firmware's receiver: at each half of the
+// buffer and when the line is idle for a byte, and the control changes
+// with the time of their last byte.
+static void SendMidi(const std::vector<MidiEvent> &events, std::vector<MidiReport> &reports, std::vector<std::pair<double, int>> &expected) {
+    const double byte_time = 1.0 / 3125.0;
+    std::vector<double> clocks;
+    std::vector<std::pair<double, uint8_t>> line;
+    for (const MidiEvent &event : events) {
+        if (event.size == 1 && event.bytes[0] >= 0xF8) {
+            clocks.push_back(event.seconds);
+        }
+    }
+
+    double  free_at = 0.0;
+    size_t  clock = 0;
+    uint8_t status = 0;
+    for (const MidiEvent &event : events) {
+        if (event.size == 1 && event.bytes[0] >= 0xF8) {
+            continue;
+        }
+        double t = std::max(event.seconds, free_at);
+        for (size_t b = 0; b < event.size; b++) {
+            for (; clock < clocks.size() && clocks[clock] <= t; clock++) {
+                t = std::max(t, clocks[clock]) + byte_time;
+                line.emplace_back(t, 0xF8);
+            }
+            t += byte_time;
+            line.emplace_back(t, event.bytes[b]);
+            if (event.bytes[b] & 0x80) {
+                status = event.bytes[b] < 0xF0 ? event.bytes[b] : 0;
+            }
+        }
+        if (event.size >= 2 && (status & 0xF0) == 0xB0 && !(event.bytes[event.size - 1] & 0x80)) {
+            expected.emplace_back(t, event.bytes[event.size - 1]);
+        }
+        free_at = t;
+    }
+    for (; clock < clocks.size(); clock++) {
+        line.emplace_back(std::max(free_at, clocks[clock]) + byte_time, 0xF8);
+        free_at = line.back().first;
+    }
+
+    MidiReport report;
+    for (size_t b = 0; b < line.size(); b++) {
+        report.bytes.push_back(line[b].second);
+        bool half = (b + 1) % kMidiHalfSize == 0;
+        bool idle = b + 1 == line.size() || line[b + 1].first - line[b].first > 1.5 * byte_time;
+        if (half || idle) {
+            report.seconds = line[b].first + (half ? 0.0 : byte_time);
+            reports.push_back(report);
+            report.bytes.clear();
+        }
+    }
+}
+
+// Replays a MIDI stream through MidiInput and the engine as the firmware
+// does, with the reports of SendMidi. Each block is split at the control
+// changes' offsets, as ProcessMapped in KVerb.cpp does, with MIDI1 on wet.
+// The tick counter starts just before it wraps.
+// Every control change must come through, in order, with the same latency
+// to within a sample plus the callback jitter. Returns false if not.
+static bool CheckMidi(const std::vector<MidiEvent> &events, const Signal &dry, float samplerate, double ghz) {
+    const uint32_t tick_origin = 0u - uint32_t(kMidiTickRate);
+    std::vector<MidiReport> reports;
+    std::vector<std::pair<double, int>> expected;
+    SendMidi(events, reports, expected);
+
+    size_t frames = dry.Frames();
+    double end = double(frames) / samplerate;
+
+    std::unique_ptr<KVerbEngine> engine(new KVerbEngine);
+    std::unique_ptr<Reverbs> reverbs(new Reverbs);
+    std::vector<PreDelayLine::Frame> predelay(PRE_DELAY_BUFFER_SIZE);
+    std::unique_ptr<EarlyReflections::History> er_history(new EarlyReflections::History);
+    std::vector<float> out[4];
+    for (int c = 0; c < 4; c++) {
+        out[c].assign(frames, 0.0f);
+    }
+
+    ModMatrix<PARAM_COUNT, 1> matrix;
+    matrix.Init();
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        matrix.SetBias(p, param_values[p]);
+    }
+    matrix.SetCoefficient(WET, 0, 0.5f);
+
+    bool pass = true;
+    for (size_t block : block_sizes) {
+        engine->Init(samplerate, reverbs->Get(REVERB_SC), predelay.data(), predelay.size(), er_history.get());
+        std::unique_ptr<MidiInput<>> midi(new MidiInput<>);
+        midi->Init(float(kMidiTickRate), kMidiHalfSize);
+        srand(11);
+
+        size_t reported = 0, received = 0;
+        bool   in_order = true;
+        double latency = 0.0, min_error = 0.0, max_error = 0.0;
+        float  midi_value = 0.0f, values[PARAM_COUNT];
+        MidiInput<>::ControlChange message;
+        size_t message_offset;
+
+        double t0 = NowNs();
+        for (size_t start = 0; start < frames; start += block) {
+            size_t size = std::min(block, frames - start);
+            double block_start = double(start) / samplerate + kCallbackJitter * double(rand()) / RAND_MAX;
+
+            // the UART interrupts that came before the callback
+            for (; reported < reports.size() && reports[reported].seconds < block_start; reported++) {
+                const MidiReport &report = reports[reported];
+                midi->Receive(report.bytes.data(), report.bytes.size(), tick_origin + uint32_t(llround(report.seconds * kMidiTickRate)));
+            }
+
+            const float *in[2] = {&dry.ch[0][start], &dry.ch[1][start]};
+            float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+            midi->BeginBlock(tick_origin + uint32_t(llround(block_start * kMidiTickRate)), size);
+            if (start > 0) {
+                latency = double(midi->GetLatency()) / kMidiTickRate;
+            }
+            bool have_message = midi->Next(message, message_offset);
+            engine->BeginBlock(in, o, size);
+            for (size_t offset = 0; offset < size;) {
+                while (have_message && message_offset <= offset) {
+                    if (received < expected.size()) {
+                        in_order = in_order && message.value == expected[received].second;
+                        double error = double(start + message_offset) / samplerate - expected[received].first
+                                     - (double(block) / samplerate + double(kMidiHalfSize - 1) / 3125.0);
+                        min_error = std::min(min_error, error);
+                        max_error = std::max(max_error, error);
+                    }
+                    received++;
+                    midi_value = message.controller == 1 ? float(message.value) / 127.0f : midi_value;
+                    have_message = midi->Next(message, message_offset);
+                }
+                size_t span = (have_message ? message_offset : size) - offset;
+
+                matrix.Process(&midi_value, values);
+                engine->AddSpan(span, values);
+                offset += span;
+            }
+            engine->EndBlock();
+            engine->ClearReverb();
+        }
+        PrintResult(samplerate, block, "midi", NowNs() - t0, frames, ghz);
+
+        // what was due before the last block has to have come through
+        size_t due = 0;
+        while (due < expected.size() && expected[due].first + 2.0 * latency < end) {
+            due++;
+        }
+        double bound = 1.0 / samplerate + 2.0 * kCallbackJitter;
+        bool ok = in_order && received >= due && received <= expected.size() && min_error > -bound && max_error < bound;
+        printf("%6.0f  %5zu  midi       %zu/%zu CCs, latency %.2f ms %+.2f/%+.2f samples%s\n", samplerate, block,
+               received, due, latency * 1000.0, min_error * samplerate, max_error * samplerate, ok ? "" : "  FAIL");
+        pass = pass && ok;
+    }
+    return pass;
+}
+
+static bool Render(const char *in_path, const char *out_path) {
+    WavReader reader;
+    if (!reader.Open(in_path)) {
+        fprintf(stderr, "could not read %s\n", in_path);
+        return false;
+    }
+    WavWriter writer;
+    if (!writer.Open(out_path, 4, reader.SampleRate())) {
+        fprintf(stderr, "could not write %s\n", out_path);
+        return false;
+    }
+
+    std::unique_ptr<KVerbEngine> engine(new KVerbEngine);
+    std::unique_ptr<Reverbs> reverbs(new Reverbs);
+    std::vector<PreDelayLine::Frame> predelay(PRE_DELAY_BUFFER_SIZE);
+    std::unique_ptr<EarlyReflections::History> er_history(new EarlyReflections::History);
+    engine->Init(reader.SampleRate(), reverbs->Get(render_reverb), predelay.data(), predelay.size(), er_history.get());
+
+    const size_t block = 48;
+    size_t channels = reader.Channels();
+    std::vector<float> interleaved(block * channels);
+    float dry[2][block], wet[4][block], frame[block * 4];
+    const float *in[2] = {dry[0], dry[1]};
+    float *out[4] = {wet[0], wet[1], wet[2], wet[3]};
+
+    size_t got;
+    while ((got = reader.Read(interleaved.data(), block)) > 0) {
+        for (size_t i = 0; i < got; i++) {
+            dry[0][i] = interleaved[i * channels];
+            dry[1][i] = interleaved[i * channels + (channels > 1 ? 1 : 0)];
+        }
+        engine->SetParams(param_values);
+        engine->Process(in, out, got);
+        engine->ClearReverb();
+        for (size_t i = 0; i < got; i++) {
+            for (int c = 0; c < 4; c++) {
+                frame[i * 4 + c] = wet[c][i];
+            }
+        }
+        writer.Write(frame, got);
+    }
+    return true;
+}
+
+static bool ParseParam(const char *arg) {
+    const char *eq = strchr(arg, '=');
+    if (!eq) {
+        return false;
+    }
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        if (strncmp(arg, parameter_strings[p], size_t(eq - arg)) == 0
+            && parameter_strings[p][eq - arg] == '\0') {
+            param_values[p] = std::min(std::max(float(atof(eq + 1)), 0.0f), 1.0f);
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    FlushDenormals();
+
+    const char *in_path = nullptr;
+    const char *out_path = nullptr;
+    const char *midi_path = nullptr;
+    float seconds = 10.0f;
+    double ghz = -1.0;
+    bool ok = true;
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-i") == 0 && a + 1 < argc) {
+            in_path = argv[++a];
+        }
+        else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+            out_path = argv[++a];
+        }
+        else if (strcmp(argv[a], "-r") == 0 && a + 1 < argc) {
+            a++;
+            render_reverb = FindReverb(argv[a]);
+            if (render_reverb < 0) {
+                fprintf(stderr, "unknown reverb %s\n", argv[a]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[a], "-m") == 0 && a + 1 < argc) {
+            midi_path = argv[++a];
+        }
+        else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc) {
+            seconds = float(atof(argv[++a]));
+        }
+        else if (strcmp(argv[a], "-g") == 0 && a + 1 < argc) {
+            ghz = atof(argv[++a]);
+        }
+        else if (!ParseParam(argv[a])) {
+            fprintf(stderr, "usage: %s [-i in.wav] [-o out.wav] [-r sc|fdn8|fdn4|fdn8q|fdn4q] [-m midi.txt] [-s seconds] [-g ghz] [param=value ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (out_path) {
+        if (!in_path) {
+            fprintf(stderr, "-o needs an input file\n");
+            return 1;
+        }
+        return Render(in_path, out_path) ? 0 : 1;
+    }
+
+    std::vector<MidiEvent> midi_events;
+    if (midi_path && !LoadMidiEvents(midi_path, midi_events)) {
+        fprintf(stderr, "could not read %s\n", midi_path);
+        return 1;
+    }
+
+    if (ghz < 0.0) {
+        ghz = EstimateGhz();
+    }
+
+    printf("params:");
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        printf(" %s=%.2f", parameter_strings[p], param_values[p]);
+    }
+    printf("\n    sr  block  stage      ns/sample  cycles/sa    load\n");
+
+    for (float samplerate : samplerates) {
+        Signal dry;
+        if (in_path) {
+            WavReader reader;
+            if (!reader.Open(in_path)) {
+                fprintf(stderr, "could not read %s\n", in_path);
+                return 1;
+            }
+            size_t channels = reader.Channels();
+            std::vector<float> interleaved(reader.Frames() * channels);
+            dry.Resize(reader.Read(interleaved.data(), reader.Frames()));
+            for (size_t i = 0; i < dry.Frames(); i++) {
+                dry.ch[0][i] = interleaved[i * channels];
+                dry.ch[1][i] = interleaved[i * channels + (channels > 1 ? 1 : 0)];
+            }
+        }
+        else {
+            GenerateTestSignal(dry, samplerate, seconds);
+        }
+        Benchmark(dry, samplerate, ghz);
+        BenchmarkCv(dry, samplerate, ghz);
+        ComparePreDelay(dry, samplerate, ghz);
+        CompareReverbPrecision(dry, samplerate);
+        ok = BenchmarkKernels(dry, samplerate, ghz) && ok;
+        ok = BenchmarkMeters(dry, samplerate, ghz) && ok;
+        ok = BenchmarkEarlyReflections(dry, samplerate, ghz) && ok;
+        if (!midi_path) {
+            midi_events.clear();
+            GenerateMidiEvents(midi_events, double(dry.Frames()) / samplerate);
+        }
+        ok = CheckMidi(midi_events, dry, samplerate, ghz) && ok;
+        ok = CheckMemoryMap(samplerate) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "daisysp.h"
+#include "FdnReverb.h"
+#include "KVerbEngine.h"
+
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#if defined(__SSE3__) || defined(__x86_64__)
+#include <pmmintrin.h>
+#endif
+
+// The firmware's parameter and reverb tables for the host tools, and the
+// reverb instances with their delay memory on the heap instead of SDRAM.
+
+static const char *parameter_strings[PARAM_COUNT] = {"dry", "wet", "LPF", "HPF", "feed", "duck", "prDly", "early"};
+
+// The reverb algorithms the firmware can select
+enum ReverbType {
+    REVERB_SC,
+    REVERB_FDN8,
+    REVERB_FDN4,
+    REVERB_FDN8_Q15,
+    REVERB_FDN4_Q15,
+    REVERB_COUNT
+};
+
+static const char *reverb_strings[REVERB_COUNT] = {"sc", "fdn8", "fdn4", "fdn8q", "fdn4q"};
+
+struct Reverbs {
+    std::unique_ptr<ReverbScEngine> sc{new ReverbScEngine};
+    std::vector<float> fdn8_buffer = std::vector<float>(FdnReverb<8>::kBufferSize);
+    std::vector<float> fdn4_buffer = std::vector<float>(FdnReverb<4>::kBufferSize);
+    std::vector<int16_t> fdn8_q15_buffer = std::vector<int16_t>(FdnReverb<8, int16_t>::kBufferSize);
+    std::vector<int16_t> fdn4_q15_buffer = std::vector<int16_t>(FdnReverb<4, int16_t>::kBufferSize);
+    FdnReverb<8> fdn8{fdn8_buffer.data()};
+    FdnReverb<4> fdn4{fdn4_buffer.data()};
+    FdnReverb<8, int16_t> fdn8_q15{fdn8_q15_buffer.data()};
+    FdnReverb<4, int16_t> fdn4_q15{fdn4_q15_buffer.data()};
+
+    ReverbEngine *Get(int type) {
+        switch (type) {
+            case REVERB_FDN8: return &fdn8;
+            case REVERB_FDN4: return &fdn4;
+            case REVERB_FDN8_Q15: return &fdn8_q15;
+            case REVERB_FDN4_Q15: return &fdn4_q15;
+            default: return sc.get();
+        }
+    }
+};
+
+// The reverb named name, or -1
+static int FindReverb(const char *name) {
+    for (int r = 0; r < REVERB_COUNT; r++) {
+        if (strcmp(name, reverb_strings[r]) == 0) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+// As on the Cortex-M7, denormals must not cost extra as tails decay.
+// The flags are per thread.
+static void FlushDenormals() {
+#if defined(__SSE3__) || defined(__x86_64__)
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+#endif
+}
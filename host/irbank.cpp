@@ -0,0 +1,111 @@
+// Builds the early reflection bank image for the QSPI flash.
+//
+// Packs up to IrBank::kMaxEntries WAV files into the layout IrBank.h
+// reads, named after the files. Mono files are used for both channels,
+// and responses longer than the early reflections take at 32 kHz are cut
+// off. The image is flashed after the presets, at
+// 0x90000000 + 0x6000.
+//
+// usage: kverb_irbank out.bin response.wav [response.wav ...]
+
+#include "EarlyReflections.h"
+#include "IrBank.h"
+#include "wav.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// The file name without directory and extension, cut to fit an entry
+static std::string EntryName(const char *path) {
+    std::string name = path;
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos) {
+        name = name.substr(slash + 1);
+    }
+    size_t dot = name.rfind('.');
+    if (dot != std::string::npos && dot > 0) {
+        name = name.substr(0, dot);
+    }
+    return name.substr(0, IrBank::kNameSize - 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || size_t(argc - 2) > IrBank::kMaxEntries) {
+        fprintf(stderr, "usage: %s out.bin response.wav [response.wav ...] (up to %zu)\n", argv[0], IrBank::kMaxEntries);
+        return 1;
+    }
+
+    size_t count = size_t(argc - 2);
+    std::vector<uint8_t> image(sizeof(IrBank::Header) + count * sizeof(IrBank::Entry));
+    std::vector<IrBank::Entry> entries(count);
+
+    for (size_t e = 0; e < count; e++) {
+        const char *path = argv[e + 2];
+        WavReader reader;
+        if (!reader.Open(path)) {
+            fprintf(stderr, "could not read %s\n", path);
+            return 1;
+        }
+        // no more than the early reflections take at 32 kHz, the lowest rate
+        size_t channels = reader.Channels();
+        size_t frames = std::min(reader.Frames(), EarlyReflections::kMaxLength * size_t(reader.SampleRate()) / 32000);
+        std::vector<float> interleaved(frames * channels);
+        frames = reader.Read(interleaved.data(), frames);
+        if (frames < reader.Frames()) {
+            printf("%s: cut off after %zu of %zu frames\n", path, frames, reader.Frames());
+        }
+
+        // samples start 4-byte aligned, as the QSPI mapping reads words
+        size_t offset = (image.size() + 3) & ~size_t(3);
+        if (offset + frames * 2 * sizeof(int16_t) > IrBank::kRegionSize) {
+            fprintf(stderr, "%s does not fit into the %u KB region\n", path, unsigned(IrBank::kRegionSize / 1024));
+            return 1;
+        }
+        image.resize(offset + frames * 2 * sizeof(int16_t));
+        int16_t *samples = reinterpret_cast<int16_t *>(&image[offset]);
+        for (size_t i = 0; i < frames; i++) {
+            for (size_t c = 0; c < 2; c++) {
+                float v = interleaved[i * channels + (channels > 1 ? c : 0)] * 32768.0f;
+                samples[i * 2 + c] = int16_t(std::min(std::max(v, -32768.0f), 32767.0f));
+            }
+        }
+
+        IrBank::Entry &entry = entries[e];
+        memset(&entry, 0, sizeof(entry));
+        strncpy(entry.name, EntryName(path).c_str(), IrBank::kNameSize - 1);
+        entry.samplerate = uint32_t(reader.SampleRate());
+        entry.length = uint32_t(frames);
+        entry.offset = uint32_t(offset);
+        entry.crc = IrBank::Crc32(&image[offset], frames * 2 * sizeof(int16_t));
+        printf("%-7s  %6u Hz  %5zu frames\n", entry.name, entry.samplerate, frames);
+    }
+
+    IrBank::Header header = {IrBank::kMagic, uint32_t(count)};
+    memcpy(image.data(), &header, sizeof(header));
+    memcpy(image.data() + sizeof(header), entries.data(), count * sizeof(IrBank::Entry));
+
+    // padded to the whole region as erased flash, and read back as the
+    // firmware will see it
+    IrBank bank;
+    image.resize(IrBank::kRegionSize, 0xFF);
+    bank.Init(image.data());
+    if (!bank.HasImage()) {
+        fprintf(stderr, "the image does not validate\n");
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "wb");
+    if (!file || fwrite(image.data(), 1, image.size(), file) != image.size()) {
+        fprintf(stderr, "could not write %s\n", argv[1]);
+        if (file) {
+            fclose(file);
+        }
+        return 1;
+    }
+    fclose(file);
+    return 0;
+}
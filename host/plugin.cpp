@@ -0,0 +1,431 @@
+// CLAP plugin build of the KVerb DSP chain.
+//
+// Runs the KVerbEngine used by AudioCallback in KVerb.cpp as a stereo
+// effect, with ReverbSc, the built-in "room" early reflections and the
+// Params set as automatable parameters. The engine output is outputs 1/2
+// of the module, the dry/wet mix.
+//
+// The audio thread does not allocate or lock. Host automation arrives as
+// timestamped events and the block is split at each of them. Changes made
+// on the main thread (state loads) reach the audio thread through an
+// SpscQueue, and the values the audio thread runs with are published back
+// as atomics.
+//
+// Everything is sized for the host sample rate on activation, so the
+// pre-delay takes what 3 s need at that rate instead of the firmware's
+// 96 kHz buffer.
+//
+// make -C host plugin CLAP_DIR=path/to/clap builds build/kverb.clap
+
+#include "IrBank.h"
+#include "SpscQueue.h"
+#include "engine.h"
+
+#include <clap/clap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// A parameter set on the main thread, for the audio thread
+struct ParamChange {
+    clap_id id;
+    float   value;
+};
+
+// The bench patch without ducking
+static const float default_values[PARAM_COUNT] = {1.0f, 0.5f, 0.6f, 0.2f, 0.7f, 0.0f, 0.1f, 0.0f};
+
+static float MaxValue(clap_id id) { return id == PREDLY ? PRE_DELAY_MAX_SECONDS : 1.0f; }
+
+class KVerbPlugin {
+  public:
+    // Frames per engine call: the firmware's default block size, so glides
+    // and ramps sound as on the module whatever the host buffer size
+    static constexpr uint32_t kMaxSegment = 48;
+
+    static constexpr uint32_t kStateMagic = 0x5453564B; // "KVST"
+
+    KVerbPlugin();
+    ~KVerbPlugin() {}
+
+    const clap_plugin_t *Plugin() const { return &plugin_; }
+
+    static const clap_plugin_descriptor_t descriptor;
+
+  private:
+    static KVerbPlugin *From(const clap_plugin_t *plugin) { return static_cast<KVerbPlugin *>(plugin->plugin_data); }
+
+    bool Activate(double samplerate);
+    void Deactivate();
+    void Reset();
+    clap_process_status Process(const clap_process_t *process);
+
+    // Audio thread, or the main thread while inactive
+    void ApplyEvent(const clap_event_header_t *header);
+    void ApplyEvents(const clap_input_events_t *events);
+    // Main thread
+    bool GetParamInfo(uint32_t index, clap_param_info_t *info) const;
+    bool SaveState(const clap_ostream_t *stream);
+    bool LoadState(const clap_istream_t *stream);
+
+    static const clap_plugin_audio_ports_t audio_ports_;
+    static const clap_plugin_params_t params_;
+    static const clap_plugin_state_t state_;
+
+    clap_plugin_t plugin_;
+    bool          active_ = false;
+    float         samplerate_ = 48000.0f;
+
+    // allocated on activation, for the host sample rate
+    std::unique_ptr<KVerbEngine>               engine_;
+    std::unique_ptr<ReverbScEngine>            verb_;
+    std::vector<PreDelayLine::Frame>           predelay_;
+    std::unique_ptr<EarlyReflections::History> er_history_;
+    std::unique_ptr<EarlyReflections::Impulse> er_impulse_;
+
+    float values_[PARAM_COUNT];                   // audio thread
+    std::atomic<float> published_[PARAM_COUNT];   // values_ for the main thread
+    SpscQueue<ParamChange, 64> to_audio_;
+
+    // the engine's wet outputs, unused, and the input copied out of host
+    // buffers that may be the output ones
+    float dry_[2][kMaxSegment];
+    float wet_[2][kMaxSegment];
+};
+
+static const char *const features[] = {CLAP_PLUGIN_FEATURE_AUDIO_EFFECT, CLAP_PLUGIN_FEATURE_REVERB,
+                                       CLAP_PLUGIN_FEATURE_STEREO, nullptr};
+
+const clap_plugin_descriptor_t KVerbPlugin::descriptor = {
+    CLAP_VERSION_INIT,
+    "com.henelik.kverb",
+    "KVerb",
+    "Henelik",
+    "",
+    "",
+    "",
+    "1.0.0",
+    "Reverb for the kxmx_bluemchen",
+    features,
+};
+
+KVerbPlugin::KVerbPlugin() {
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        values_[p] = default_values[p];
+        published_[p].store(default_values[p], std::memory_order_relaxed);
+    }
+
+    plugin_.desc = &descriptor;
+    plugin_.plugin_data = this;
+    plugin_.init = [](const clap_plugin_t *) { return true; };
+    plugin_.destroy = [](const clap_plugin_t *plugin) { delete From(plugin); };
+    plugin_.activate = [](const clap_plugin_t *plugin, double samplerate, uint32_t, uint32_t) {
+        return From(plugin)->Activate(samplerate);
+    };
+    plugin_.deactivate = [](const clap_plugin_t *plugin) { From(plugin)->Deactivate(); };
+    // the audio thread, where the denormal flags have to be set
+    plugin_.start_processing = [](const clap_plugin_t *) {
+        FlushDenormals();
+        return true;
+    };
+    plugin_.stop_processing = [](const clap_plugin_t *) {};
+    plugin_.reset = [](const clap_plugin_t *plugin) { From(plugin)->Reset(); };
+    plugin_.process = [](const clap_plugin_t *plugin, const clap_process_t *process) {
+        return From(plugin)->Process(process);
+    };
+    plugin_.get_extension = [](const clap_plugin_t *, const char *id) -> const void * {
+        if (strcmp(id, CLAP_EXT_AUDIO_PORTS) == 0) {
+            return &audio_ports_;
+        }
+        if (strcmp(id, CLAP_EXT_PARAMS) == 0) {
+            return &params_;
+        }
+        if (strcmp(id, CLAP_EXT_STATE) == 0) {
+            return &state_;
+        }
+        return nullptr;
+    };
+    plugin_.on_main_thread = [](const clap_plugin_t *) {};
+}
+
+bool KVerbPlugin::Activate(double samplerate) {
+    float rate = float(samplerate);
+    samplerate_ = rate;
+    engine_.reset(new KVerbEngine);
+    verb_.reset(new ReverbScEngine);
+    predelay_.assign(KVerbEngine::PreDelayFrames(rate), PreDelayLine::Frame());
+    er_history_.reset(new EarlyReflections::History);
+    er_impulse_.reset(new EarlyReflections::Impulse);
+
+    // the built-in room, rendered for this rate
+    IrBank bank;
+    bank.Init(nullptr);
+    std::vector<float> response[2] = {std::vector<float>(EarlyReflections::kMaxLength),
+                                      std::vector<float>(EarlyReflections::kMaxLength)};
+    size_t length = bank.Load(1, rate, response[0].data(), response[1].data(), EarlyReflections::kMaxLength);
+    std::unique_ptr<EarlyReflections::Fft> fft(new EarlyReflections::Fft);
+    fft->Init();
+    EarlyReflections::Prepare(*fft, *er_impulse_, response[0].data(), response[1].data(), length);
+
+    engine_->Init(rate, verb_.get(), predelay_.data(), predelay_.size(), er_history_.get());
+    engine_->SetEarlyReflections(er_impulse_.get());
+
+    // the audio thread starts from the published values, and any state
+    // loaded since the last process call
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        values_[p] = published_[p].load(std::memory_order_relaxed);
+    }
+    ParamChange change;
+    while (to_audio_.Pop(change)) {
+        values_[change.id] = change.value;
+        published_[change.id].store(change.value, std::memory_order_relaxed);
+    }
+    active_ = true;
+    return true;
+}
+
+void KVerbPlugin::Deactivate() {
+    active_ = false;
+    engine_.reset();
+    verb_.reset();
+    predelay_ = std::vector<PreDelayLine::Frame>();
+    er_history_.reset();
+    er_impulse_.reset();
+}
+
+void KVerbPlugin::Reset() {
+    // clears the tail, no allocation
+    engine_->Init(samplerate_, verb_.get(), predelay_.data(), predelay_.size(), er_history_.get());
+    engine_->SetEarlyReflections(er_impulse_.get());
+}
+
+void KVerbPlugin::ApplyEvent(const clap_event_header_t *header) {
+    if (header->space_id != CLAP_CORE_EVENT_SPACE_ID || header->type != CLAP_EVENT_PARAM_VALUE) {
+        return;
+    }
+    const clap_event_param_value_t *event = reinterpret_cast<const clap_event_param_value_t *>(header);
+    if (event->param_id >= PARAM_COUNT) {
+        return;
+    }
+    float value = std::min(std::max(float(event->value), 0.0f), MaxValue(event->param_id));
+    values_[event->param_id] = value;
+    published_[event->param_id].store(value, std::memory_order_relaxed);
+}
+
+void KVerbPlugin::ApplyEvents(const clap_input_events_t *events) {
+    uint32_t count = events->size(events);
+    for (uint32_t e = 0; e < count; e++) {
+        ApplyEvent(events->get(events, e));
+    }
+}
+
+clap_process_status KVerbPlugin::Process(const clap_process_t *process) {
+    if (process->audio_inputs_count < 1 || process->audio_outputs_count < 1) {
+        return CLAP_PROCESS_ERROR;
+    }
+    const clap_audio_buffer_t &input = process->audio_inputs[0];
+    const clap_audio_buffer_t &output = process->audio_outputs[0];
+
+    // the main thread's changes take effect at the start of the block
+    ParamChange change;
+    while (to_audio_.Pop(change)) {
+        values_[change.id] = change.value;
+        published_[change.id].store(change.value, std::memory_order_relaxed);
+    }
+
+    // events are sorted by time; split the block at each one
+    const clap_input_events_t *events = process->in_events;
+    uint32_t event_count = events->size(events);
+    uint32_t next_event = 0;
+    uint32_t frames = process->frames_count;
+
+    for (uint32_t start = 0; start < frames;) {
+        uint32_t end = std::min(start + kMaxSegment, frames);
+        for (; next_event < event_count; next_event++) {
+            const clap_event_header_t *header = events->get(events, next_event);
+            if (header->time > start) {
+                end = std::min(end, header->time);
+                break;
+            }
+            ApplyEvent(header);
+        }
+
+        uint32_t size = end - start;
+        for (int c = 0; c < 2; c++) {
+            memcpy(dry_[c], input.data32[std::min(uint32_t(c), input.channel_count - 1)] + start, size * sizeof(float));
+        }
+        const float *in[2] = {dry_[0], dry_[1]};
+        float *out[4] = {output.data32[0] + start, output.data32[1] + start, wet_[0], wet_[1]};
+        engine_->SetParams(values_);
+        engine_->Process(in, out, size);
+        // a desktop CPU clears the reverb in microseconds, so this does
+        // not need handing to the main thread
+        engine_->ClearReverb();
+        start = end;
+    }
+    // any stamped at the end of the block hold from the next one on
+    for (; next_event < event_count; next_event++) {
+        ApplyEvent(events->get(events, next_event));
+    }
+
+    return engine_->IsSleeping() ? CLAP_PROCESS_CONTINUE_IF_NOT_QUIET : CLAP_PROCESS_CONTINUE;
+}
+
+bool KVerbPlugin::GetParamInfo(uint32_t index, clap_param_info_t *info) const {
+    if (index >= PARAM_COUNT) {
+        return false;
+    }
+    memset(info, 0, sizeof(*info));
+    info->id = index;
+    info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+    snprintf(info->name, sizeof(info->name), "%s", parameter_strings[index]);
+    info->min_value = 0.0;
+    info->max_value = MaxValue(index);
+    info->default_value = default_values[index];
+    return true;
+}
+
+// Stored as the magic, PARAM_COUNT and the values, so states from a
+// build with more or fewer parameters are refused
+struct PluginState {
+    uint32_t magic;
+    uint32_t count;
+    float    values[PARAM_COUNT];
+};
+
+bool KVerbPlugin::SaveState(const clap_ostream_t *stream) {
+    PluginState state;
+    state.magic = kStateMagic;
+    state.count = PARAM_COUNT;
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        state.values[p] = published_[p].load(std::memory_order_relaxed);
+    }
+
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(&state);
+    for (size_t written = 0; written < sizeof(state);) {
+        int64_t n = stream->write(stream, data + written, sizeof(state) - written);
+        if (n <= 0) {
+            return false;
+        }
+        written += size_t(n);
+    }
+    return true;
+}
+
+bool KVerbPlugin::LoadState(const clap_istream_t *stream) {
+    PluginState state;
+    uint8_t *data = reinterpret_cast<uint8_t *>(&state);
+    for (size_t got = 0; got < sizeof(state);) {
+        int64_t n = stream->read(stream, data + got, sizeof(state) - got);
+        if (n <= 0) {
+            return false;
+        }
+        got += size_t(n);
+    }
+    if (state.magic != kStateMagic || state.count != PARAM_COUNT) {
+        return false;
+    }
+
+    for (clap_id p = 0; p < PARAM_COUNT; p++) {
+        float value = std::min(std::max(state.values[p], 0.0f), MaxValue(p));
+        if (!active_) {
+            values_[p] = value;
+            published_[p].store(value, std::memory_order_relaxed);
+        }
+        else if (!to_audio_.Push({p, value})) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const clap_plugin_audio_ports_t KVerbPlugin::audio_ports_ = {
+    [](const clap_plugin_t *, bool) -> uint32_t { return 1; },
+    [](const clap_plugin_t *, uint32_t index, bool is_input, clap_audio_port_info_t *info) {
+        if (index != 0) {
+            return false;
+        }
+        memset(info, 0, sizeof(*info));
+        info->id = 0;
+        snprintf(info->name, sizeof(info->name), "%s", is_input ? "In" : "Out");
+        info->flags = CLAP_AUDIO_PORT_IS_MAIN;
+        info->channel_count = 2;
+        info->port_type = CLAP_PORT_STEREO;
+        info->in_place_pair = CLAP_INVALID_ID;
+        return true;
+    },
+};
+
+const clap_plugin_params_t KVerbPlugin::params_ = {
+    [](const clap_plugin_t *) -> uint32_t { return PARAM_COUNT; },
+    [](const clap_plugin_t *plugin, uint32_t index, clap_param_info_t *info) {
+        return From(plugin)->GetParamInfo(index, info);
+    },
+    [](const clap_plugin_t *plugin, clap_id id, double *value) {
+        if (id >= PARAM_COUNT) {
+            return false;
+        }
+        *value = From(plugin)->published_[id].load(std::memory_order_relaxed);
+        return true;
+    },
+    [](const clap_plugin_t *, clap_id id, double value, char *text, uint32_t capacity) {
+        if (id >= PARAM_COUNT) {
+            return false;
+        }
+        if (id == PREDLY) {
+            snprintf(text, capacity, "%.0f ms", value * 1000.0);
+        }
+        else {
+            snprintf(text, capacity, "%.1f%%", value * 100.0);
+        }
+        return true;
+    },
+    [](const clap_plugin_t *, clap_id id, const char *text, double *value) {
+        if (id >= PARAM_COUNT) {
+            return false;
+        }
+        char *end;
+        double number = strtod(text, &end);
+        if (end == text) {
+            return false;
+        }
+        *value = id == PREDLY ? number / 1000.0 : number / 100.0;
+        return true;
+    },
+    // without a running process call: on the audio thread while active,
+    // else on the main thread
+    [](const clap_plugin_t *plugin, const clap_input_events_t *in, const clap_output_events_t *) {
+        From(plugin)->ApplyEvents(in);
+    },
+};
+
+const clap_plugin_state_t KVerbPlugin::state_ = {
+    [](const clap_plugin_t *plugin, const clap_ostream_t *stream) { return From(plugin)->SaveState(stream); },
+    [](const clap_plugin_t *plugin, const clap_istream_t *stream) { return From(plugin)->LoadState(stream); },
+};
+
+static const clap_plugin_factory_t factory = {
+    [](const clap_plugin_factory_t *) -> uint32_t { return 1; },
+    [](const clap_plugin_factory_t *, uint32_t index) -> const clap_plugin_descriptor_t * {
+        return index == 0 ? &KVerbPlugin::descriptor : nullptr;
+    },
+    [](const clap_plugin_factory_t *, const clap_host_t *, const char *id) -> const clap_plugin_t * {
+        if (strcmp(id, KVerbPlugin::descriptor.id) != 0) {
+            return nullptr;
+        }
+        return (new KVerbPlugin)->Plugin();
+    },
+};
+
+extern "C" CLAP_EXPORT const clap_plugin_entry_t clap_entry = {
+    CLAP_VERSION_INIT,
+    [](const char *) { return true; },
+    []() {},
+    [](const char *id) -> const void * { return strcmp(id, CLAP_PLUGIN_FACTORY_ID) == 0 ? &factory : nullptr; },
+};
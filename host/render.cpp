@@ -0,0 +1,584 @@
+// Batch renderer for the KVerb DSP chain.
+//
+// Runs every WAV file below a directory through the KVerbEngine used by
+// AudioCallback in KVerb.cpp, with the settings of a parameter file and
+// the Bluemchen knobs and CVs held at fixed values. Files are spread over
+// a pool of workers, each with its own engine, and streamed through in
+// chunks, so a library of any size renders in constant memory.
+//
+// usage: kverb_render [-p settings.txt] [-b irbank.bin] [-j threads] [-t tail_seconds] in_dir out_dir
+
+#include "IrBank.h"
+#include "ModMatrix.h"
+#include "engine.h"
+#include "wav.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The controls a mapping can take, as in KVerb.cpp
+enum ControlIndex {
+    CTRL_KNOB1,
+    CTRL_KNOB2,
+    CTRL_CV1,
+    CTRL_CV2,
+    CTRL_MIDI1,
+    CTRL_MIDI2,
+    CTRL_COUNT
+};
+
+static const char *control_strings[CTRL_COUNT] = {"Pot1", "Pot2", "CV1", "CV2", "MIDI1", "MIDI2"};
+static const char *sign_strings[3] = {"-", "0", "+"};
+static const char *multiplier_strings[5] = {"/4", "/2", "x1", "x2", "x4"};
+static const char *curve_strings[CURVE_COUNT] = {"lin", "exp", "log", "S"};
+
+static const float sign_factors[3] = {-1.0f, 0.0f, 1.0f};
+static const float multiplier_factors[5] = {0.25f, 0.5f, 1.0f, 2.0f, 4.0f};
+
+// The sound fields of the firmware's Settings, plus the positions the
+// knobs, CVs and MIDI CCs are held at while rendering
+struct RenderSettings {
+    float  biases[PARAM_COUNT];
+    int    mapping_indices[PARAM_COUNT][CTRL_COUNT * 2]; // sign, multiplier per control
+    int    curves[PARAM_COUNT];
+    int    reverb;
+    std::string reflections; // IrBank entry name
+    size_t blocksize;
+    float  controls[CTRL_COUNT];
+};
+
+// The firmware's DefaultSettings, with both knobs at noon and no CV
+static RenderSettings DefaultRenderSettings() {
+    RenderSettings settings;
+    const float biases[PARAM_COUNT] = {1.0f, 0.0f, 1.0f, 0.2f, 0.5f, 0.0f, 0.0f, 0.0f};
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        settings.biases[p] = biases[p];
+        for (int c = 0; c < CTRL_COUNT; c++) {
+            settings.mapping_indices[p][c * 2] = 1;     // 0
+            settings.mapping_indices[p][c * 2 + 1] = 2; // x1
+        }
+        settings.curves[p] = CURVE_LINEAR;
+    }
+    settings.mapping_indices[DRY][CTRL_KNOB1 * 2] = 0;
+    settings.mapping_indices[WET][CTRL_KNOB1 * 2] = 2;
+    settings.mapping_indices[FEED][CTRL_KNOB2 * 2] = 2;
+    settings.mapping_indices[PREDLY][CTRL_KNOB2 * 2] = 2;
+    settings.reverb = REVERB_SC;
+    settings.reflections = "room";
+    settings.blocksize = 48;
+    settings.controls[CTRL_KNOB1] = 0.5f;
+    settings.controls[CTRL_KNOB2] = 0.5f;
+    settings.controls[CTRL_CV1] = 0.0f;
+    settings.controls[CTRL_CV2] = 0.0f;
+    settings.controls[CTRL_MIDI1] = 0.0f;
+    settings.controls[CTRL_MIDI2] = 0.0f;
+    return settings;
+}
+
+static int FindString(const char *const *strings, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(name, strings[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static char *Trim(char *s) {
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+// Parses one "key = value" line of a settings file
+static bool ParseSetting(RenderSettings &settings, char *key, char *value) {
+    char *field = strchr(key, '.');
+    if (field) {
+        *field++ = '\0';
+    }
+    int param = FindString(parameter_strings, PARAM_COUNT, key);
+
+    if (param >= 0 && !field) {
+        settings.biases[param] = std::min(std::max(float(atof(value)), 0.0f), 1.0f);
+        return true;
+    }
+    if (param >= 0 && strcasecmp(field, "curve") == 0) {
+        settings.curves[param] = FindString(curve_strings, CURVE_COUNT, value);
+        return settings.curves[param] >= 0;
+    }
+    int control = field ? FindString(control_strings, CTRL_COUNT, field) : -1;
+    if (param >= 0 && control >= 0) {
+        // sign and multiplier, e.g. "+ x2"
+        char *multiplier = strchr(value, ' ');
+        if (multiplier) {
+            *multiplier++ = '\0';
+        }
+        int sign = FindString(sign_strings, 3, value);
+        int mult = multiplier ? FindString(multiplier_strings, 5, Trim(multiplier)) : 2;
+        if (sign < 0 || mult < 0) {
+            return false;
+        }
+        settings.mapping_indices[param][control * 2] = sign;
+        settings.mapping_indices[param][control * 2 + 1] = mult;
+        return true;
+    }
+    if (field) {
+        return false;
+    }
+
+    control = FindString(control_strings, CTRL_COUNT, key);
+    if (control >= 0) {
+        float min = control == CTRL_CV1 || control == CTRL_CV2 ? -1.0f : 0.0f;
+        settings.controls[control] = std::min(std::max(float(atof(value)), min), 1.0f);
+        return true;
+    }
+    if (strcasecmp(key, "reverb") == 0) {
+        settings.reverb = FindReverb(value);
+        return settings.reverb >= 0;
+    }
+    if (strcasecmp(key, "reflections") == 0) {
+        // checked against the bank once it is loaded
+        settings.reflections = value;
+        return true;
+    }
+    if (strcasecmp(key, "blocksize") == 0) {
+        settings.blocksize = size_t(atoi(value));
+        return settings.blocksize >= 1;
+    }
+    return false;
+}
+
+/** Loads a settings file: one field per line, "#" starts a comment.
+ *
+ *      dry = 1            bias of a parameter, 0-1
+ *      wet.Pot1 = + x1    mapping of a control onto it: - 0 +, /4 /2 x1 x2 x4
+ *      wet.curve = exp    its curve: lin exp log S
+ *      reverb = fdn8      sc fdn8 fdn4 fdn8q fdn4q
+ *      reflections = hall early reflection response, mixed in by "early":
+ *                         off room hall slap, or an entry of the -b bank
+ *      blocksize = 48     frames per engine call, as the audio callback
+ *      Pot1 = 0.5         knob position 0-1, CV1 and CV2 -1..1, MIDI1 and
+ *                         MIDI2 0-1
+ *
+ *  Fields that are not given keep the firmware defaults.
+ */
+static bool LoadSettings(const char *path, RenderSettings &settings) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    int  number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *key = Trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+        char *eq = strchr(key, '=');
+        if (eq) {
+            *eq = '\0';
+        }
+        if (!eq || !ParseSetting(settings, Trim(key), Trim(eq + 1))) {
+            fprintf(stderr, "%s:%d: bad setting\n", path, number);
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// The parameter values the settings hold the engine at, through the same
+// modulation matrix as the firmware's control loop
+static void ComputeParams(const RenderSettings &settings, float *values) {
+    ModMatrix<PARAM_COUNT, CTRL_COUNT> matrix;
+    matrix.Init();
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        matrix.SetBias(p, settings.biases[p]);
+        for (int c = 0; c < CTRL_COUNT; c++) {
+            matrix.SetCoefficient(p, c, sign_factors[settings.mapping_indices[p][c * 2]]
+                                        * multiplier_factors[settings.mapping_indices[p][c * 2 + 1]]);
+        }
+        matrix.SetCurve(p, static_cast<ModCurve>(settings.curves[p]));
+    }
+    matrix.Process(settings.controls, values);
+}
+
+// Adds the paths of all WAV files below dir/sub, relative to dir
+static void FindWavFiles(const std::string &dir, const std::string &sub, std::vector<std::string> &files) {
+    DIR *d = opendir((dir + "/" + sub).c_str());
+    if (!d) {
+        return;
+    }
+    while (struct dirent *entry = readdir(d)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string path = sub.empty() ? entry->d_name : sub + "/" + entry->d_name;
+        struct stat st;
+        if (stat((dir + "/" + path).c_str(), &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            FindWavFiles(dir, path, files);
+        }
+        else if (path.size() > 4 && strcasecmp(path.c_str() + path.size() - 4, ".wav") == 0) {
+            files.push_back(path);
+        }
+    }
+    closedir(d);
+}
+
+static off_t FileSize(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Creates the directories leading up to path
+static bool MakeParentDirs(const std::string &path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        if (mkdir(path.substr(0, slash).c_str(), 0777) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** A deque of jobs per worker. A worker takes from the front of its own
+ *  deque and, once that is empty, steals from the back of the others',
+ *  so the long files dealt out first are not stuck behind one worker.
+ *  All jobs are pushed before the workers start.
+ */
+class JobQueues {
+  public:
+    JobQueues(size_t workers) : queues_(new Queue[workers]), workers_(workers) {}
+    ~JobQueues() {}
+
+    void Push(size_t worker, size_t job) { queues_[worker].jobs.push_back(job); }
+
+    bool Pop(size_t worker, size_t &job) {
+        for (size_t i = 0; i < workers_; i++) {
+            Queue &queue = queues_[(worker + i) % workers_];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.jobs.empty()) {
+                if (i == 0) {
+                    job = queue.jobs.front();
+                    queue.jobs.pop_front();
+                }
+                else {
+                    job = queue.jobs.back();
+                    queue.jobs.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+  private:
+    struct Queue {
+        std::mutex         mutex;
+        std::deque<size_t> jobs;
+    };
+
+    std::unique_ptr<Queue[]> queues_;
+    size_t                   workers_;
+};
+
+// The IrBank index of name, or -1
+static int FindReflections(const IrBank &bank, const std::string &name) {
+    for (size_t i = 0; i < bank.Count(); i++) {
+        if (strcasecmp(name.c_str(), bank.Name(i)) == 0) {
+            return int(i);
+        }
+    }
+    return -1;
+}
+
+// One engine per worker, with its own reverbs, pre-delay and early
+// reflection memory
+struct Worker {
+    std::unique_ptr<KVerbEngine> engine{new KVerbEngine};
+    std::unique_ptr<Reverbs>     reverbs{new Reverbs};
+    std::vector<PreDelayLine::Frame> predelay = std::vector<PreDelayLine::Frame>(PRE_DELAY_BUFFER_SIZE);
+    std::unique_ptr<EarlyReflections::History> er_history{new EarlyReflections::History};
+    std::unique_ptr<EarlyReflections::Impulse> er_impulse{new EarlyReflections::Impulse};
+    std::vector<float>    er_response[2] = {std::vector<float>(EarlyReflections::kMaxLength),
+                                            std::vector<float>(EarlyReflections::kMaxLength)};
+    EarlyReflections::Fft er_fft;
+
+    size_t files = 0;
+    double audio_seconds = 0.0;
+    double busy_seconds = 0.0;
+};
+
+// Frames read and written per chunk
+static const size_t kChunkFrames = 4096;
+
+/** Renders one file: the stereo mix of outputs 1/2, followed by the tail
+ *  until the engine goes to sleep or tail_seconds have passed.
+ *  \param seconds length rendered
+ */
+static bool RenderFile(Worker &worker, const RenderSettings &settings, const float *values, const IrBank &bank,
+                       int reflections, const std::string &in_path, const std::string &out_path, float tail_seconds, double &seconds) {
+    WavReader reader;
+    if (!reader.Open(in_path.c_str())) {
+        fprintf(stderr, "could not read %s\n", in_path.c_str());
+        return false;
+    }
+    WavWriter writer;
+    if (!MakeParentDirs(out_path) || !writer.Open(out_path.c_str(), 2, reader.SampleRate())) {
+        fprintf(stderr, "could not write %s\n", out_path.c_str());
+        return false;
+    }
+
+    KVerbEngine &engine = *worker.engine;
+    engine.Init(reader.SampleRate(), worker.reverbs->Get(settings.reverb), worker.predelay.data(), worker.predelay.size(),
+                worker.er_history.get());
+    // the response is rendered for the file's sample rate
+    size_t er_length = bank.Load(size_t(reflections), float(reader.SampleRate()), worker.er_response[0].data(),
+                                 worker.er_response[1].data(), EarlyReflections::kMaxLength);
+    EarlyReflections::Prepare(worker.er_fft, *worker.er_impulse, worker.er_response[0].data(),
+                              worker.er_response[1].data(), er_length);
+    engine.SetEarlyReflections(worker.er_impulse.get());
+
+    size_t channels = reader.Channels();
+    size_t tail_frames = size_t(tail_seconds * reader.SampleRate());
+    size_t frames = 0;
+    std::vector<float> interleaved(kChunkFrames * channels);
+    std::vector<float> mix(kChunkFrames * 2);
+    std::vector<float> dry[2], out[4];
+    for (auto &ch : dry) {
+        ch.resize(kChunkFrames);
+    }
+    for (auto &ch : out) {
+        ch.resize(kChunkFrames);
+    }
+
+    bool input_done = false;
+    while (true) {
+        size_t got = 0;
+        if (!input_done) {
+            got = reader.Read(interleaved.data(), kChunkFrames);
+            input_done = got < kChunkFrames;
+            for (size_t i = 0; i < got; i++) {
+                dry[0][i] = interleaved[i * channels];
+                dry[1][i] = interleaved[i * channels + (channels > 1 ? 1 : 0)];
+            }
+        }
+        // then silence for the tail
+        size_t size = got;
+        if (input_done && tail_frames > 0 && !engine.IsSleeping()) {
+            size = std::min(kChunkFrames, got + tail_frames);
+            std::fill(dry[0].begin() + got, dry[0].begin() + size, 0.0f);
+            std::fill(dry[1].begin() + got, dry[1].begin() + size, 0.0f);
+            tail_frames -= size - got;
+        }
+        if (size == 0) {
+            break;
+        }
+
+        // one engine call per audio callback, as on the hardware
+        for (size_t start = 0; start < size; start += settings.blocksize) {
+            size_t block = std::min(settings.blocksize, size - start);
+            const float *in[2] = {&dry[0][start], &dry[1][start]};
+            float *o[4] = {&out[0][start], &out[1][start], &out[2][start], &out[3][start]};
+            engine.SetParams(values);
+            engine.Process(in, o, block);
+            engine.ClearReverb();
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            mix[i * 2] = out[0][i];
+            mix[i * 2 + 1] = out[1][i];
+        }
+        if (!writer.Write(mix.data(), size)) {
+            fprintf(stderr, "could not write %s\n", out_path.c_str());
+            return false;
+        }
+        frames += size;
+    }
+    seconds = double(frames) / double(reader.SampleRate());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *settings_path = nullptr;
+    const char *bank_path = nullptr;
+    const char *in_dir = nullptr;
+    const char *out_dir = nullptr;
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    float  tail_seconds = 10.0f;
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-p") == 0 && a + 1 < argc) {
+            settings_path = argv[++a];
+        }
+        else if (strcmp(argv[a], "-b") == 0 && a + 1 < argc) {
+            bank_path = argv[++a];
+        }
+        else if (strcmp(argv[a], "-j") == 0 && a + 1 < argc) {
+            threads = size_t(std::max(atoi(argv[++a]), 1));
+        }
+        else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc) {
+            tail_seconds = std::max(float(atof(argv[++a])), 0.0f);
+        }
+        else if (argv[a][0] != '-' && !in_dir) {
+            in_dir = argv[a];
+        }
+        else if (argv[a][0] != '-' && !out_dir) {
+            out_dir = argv[a];
+        }
+        else {
+            in_dir = nullptr;
+            break;
+        }
+    }
+    if (!in_dir || !out_dir) {
+        fprintf(stderr, "usage: %s [-p settings.txt] [-b irbank.bin] [-j threads] [-t tail_seconds] in_dir out_dir\n", argv[0]);
+        return 1;
+    }
+
+    RenderSettings settings = DefaultRenderSettings();
+    if (settings_path && !LoadSettings(settings_path, settings)) {
+        return 1;
+    }
+    float values[PARAM_COUNT];
+    ComputeParams(settings, values);
+
+    // the image kverb_irbank builds for the QSPI flash, read from a file
+    std::vector<uint8_t> bank_image;
+    if (bank_path) {
+        FILE *file = fopen(bank_path, "rb");
+        if (!file) {
+            fprintf(stderr, "could not read %s\n", bank_path);
+            return 1;
+        }
+        bank_image.assign(IrBank::kRegionSize, 0);
+        if (fread(bank_image.data(), 1, bank_image.size(), file) == 0) {
+            bank_image.clear();
+        }
+        fclose(file);
+    }
+    IrBank bank;
+    bank.Init(bank_image.empty() ? nullptr : bank_image.data());
+    if (bank_path && !bank.HasImage()) {
+        fprintf(stderr, "%s is not an early reflection bank\n", bank_path);
+        return 1;
+    }
+    int reflections = FindReflections(bank, settings.reflections);
+    if (reflections < 0) {
+        fprintf(stderr, "unknown reflections %s\n", settings.reflections.c_str());
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    FindWavFiles(in_dir, "", files);
+    if (files.empty()) {
+        fprintf(stderr, "no WAV files in %s\n", in_dir);
+        return 1;
+    }
+
+    // largest first, dealt out round robin
+    std::vector<off_t> sizes(files.size());
+    for (size_t f = 0; f < files.size(); f++) {
+        sizes[f] = FileSize(std::string(in_dir) + "/" + files[f]);
+    }
+    std::vector<size_t> order(files.size());
+    for (size_t f = 0; f < files.size(); f++) {
+        order[f] = f;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    threads = std::min(threads, files.size());
+    JobQueues queues(threads);
+    for (size_t f = 0; f < order.size(); f++) {
+        queues.Push(f % threads, order[f]);
+    }
+
+    printf("params:");
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        printf(" %s=%.2f", parameter_strings[p], values[p]);
+    }
+    printf(" reverb=%s reflections=%s block=%zu\n", reverb_strings[settings.reverb], bank.Name(size_t(reflections)),
+           settings.blocksize);
+    printf("rendering %zu files on %zu workers\n", files.size(), threads);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t w = 0; w < threads; w++) {
+        workers.emplace_back(new Worker);
+    }
+    std::atomic<size_t> failed{0};
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (size_t w = 0; w < threads; w++) {
+        pool.emplace_back([&, w]() {
+            FlushDenormals();
+            Worker &worker = *workers[w];
+            worker.er_fft.Init();
+            size_t job;
+            while (queues.Pop(w, job)) {
+                auto t0 = std::chrono::steady_clock::now();
+                std::string in_path = std::string(in_dir) + "/" + files[job];
+                double seconds = 0.0;
+                bool ok = RenderFile(worker, settings, values, bank, reflections, in_path,
+                                     std::string(out_dir) + "/" + files[job], tail_seconds, seconds);
+                worker.busy_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                if (!ok) {
+                    failed++;
+                    continue;
+                }
+                worker.files++;
+                worker.audio_seconds += seconds;
+            }
+        });
+    }
+    for (auto &thread : pool) {
+        thread.join();
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double audio = 0.0;
+    for (size_t w = 0; w < threads; w++) {
+        const Worker &worker = *workers[w];
+        printf("worker %2zu  %5zu files  %9.1f s audio  %7.2f s busy  %7.1fx realtime\n", w, worker.files,
+               worker.audio_seconds, worker.busy_seconds, worker.audio_seconds / std::max(worker.busy_seconds, 1e-9));
+        audio += worker.audio_seconds;
+    }
+    printf("%.1f s of audio in %.2f s: %.1fx realtime, %.1fx realtime per core\n", audio, wall,
+           audio / wall, audio / wall / double(threads));
+
+    if (failed > 0) {
+        fprintf(stderr, "%zu files failed\n", failed.load());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+// Minimal streaming RIFF/WAVE reader and writer for the host tools.
+// Reads 16/24/32-bit PCM and 32-bit float, always writes 32-bit float.
+// Samples are exchanged as interleaved floats in the -1..1 range.
+
+class WavReader {
+  public:
+    WavReader() {}
+    ~WavReader() { Close(); }
+
+    bool Open(const char *path) {
+        Close();
+        file_ = fopen(path, "rb");
+        if (!file_) {
+            return false;
+        }
+
+        uint8_t riff[12];
+        if (fread(riff, 1, sizeof(riff), file_) != sizeof(riff)
+            || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+            Close();
+            return false;
+        }
+
+        // walk the chunks until we have seen both "fmt " and "data"
+        bool have_fmt = false;
+        while (true) {
+            uint8_t header[8];
+            if (fread(header, 1, sizeof(header), file_) != sizeof(header)) {
+                Close();
+                return false;
+            }
+            uint32_t size = ReadU32(header + 4);
+
+            if (memcmp(header, "fmt ", 4) == 0) {
+                uint8_t fmt[40] = {0};
+                size_t want = size < sizeof(fmt) ? size : sizeof(fmt);
+                if (fread(fmt, 1, want, file_) != want) {
+                    Close();
+                    return false;
+                }
+                fseek(file_, long(size - want + (size & 1)), SEEK_CUR);
+
+                format_ = ReadU16(fmt);
+                channels_ = ReadU16(fmt + 2);
+                samplerate_ = ReadU32(fmt + 4);
+                bits_ = ReadU16(fmt + 14);
+                if (format_ == 0xFFFE && size >= 26) {
+                    // WAVE_FORMAT_EXTENSIBLE, the sub-format tag lives in the GUID
+                    format_ = ReadU16(fmt + 24);
+                }
+                have_fmt = true;
+            }
+            else if (memcmp(header, "data", 4) == 0) {
+                if (!have_fmt || channels_ == 0) {
+                    Close();
+                    return false;
+                }
+                bytes_per_sample_ = bits_ / 8;
+                frames_ = size / (bytes_per_sample_ * channels_);
+                frames_left_ = frames_;
+                break;
+            }
+            else {
+                fseek(file_, long(size + (size & 1)), SEEK_CUR);
+            }
+        }
+
+        bool supported = (format_ == 1 && (bits_ == 16 || bits_ == 24 || bits_ == 32))
+                      || (format_ == 3 && bits_ == 32);
+        if (!supported) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        if (file_) {
+            fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+    // Reads up to frames interleaved frames into out, returns the number read.
+    size_t Read(float *out, size_t frames) {
+        if (!file_) {
+            return 0;
+        }
+        if (frames > frames_left_) {
+            frames = frames_left_;
+        }
+
+        size_t samples = frames * channels_;
+        raw_.resize(samples * bytes_per_sample_);
+        size_t got = fread(raw_.data(), bytes_per_sample_ * channels_, frames, file_);
+        samples = got * channels_;
+
+        const uint8_t *p = raw_.data();
+        for (size_t i = 0; i < samples; i++, p += bytes_per_sample_) {
+            if (format_ == 3) {
+                memcpy(&out[i], p, 4);
+            }
+            else if (bits_ == 16) {
+                out[i] = int16_t(ReadU16(p)) / 32768.0f;
+            }
+            else if (bits_ == 24) {
+                int32_t v = int32_t(uint32_t(p[0]) << 8 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 24);
+                out[i] = (v >> 8) / 8388608.0f;
+            }
+            else {
+                out[i] = int32_t(ReadU32(p)) / 2147483648.0f;
+            }
+        }
+
+        frames_left_ -= got;
+        return got;
+    }
+
+    size_t Channels() const { return channels_; }
+    size_t Frames() const { return frames_; }
+    float SampleRate() const { return float(samplerate_); }
+
+  private:
+    static uint16_t ReadU16(const uint8_t *p) { return uint16_t(p[0] | p[1] << 8); }
+    static uint32_t ReadU32(const uint8_t *p) { return uint32_t(p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24); }
+
+    FILE *file_ = nullptr;
+    uint16_t format_ = 0;
+    size_t channels_ = 0;
+    uint32_t samplerate_ = 0;
+    uint16_t bits_ = 0;
+    size_t bytes_per_sample_ = 0;
+    size_t frames_ = 0;
+    size_t frames_left_ = 0;
+    std::vector<uint8_t> raw_;
+};
+
+class WavWriter {
+  public:
+    WavWriter() {}
+    ~WavWriter() { Close(); }
+
+    bool Open(const char *path, size_t channels, float samplerate) {
+        Close();
+        file_ = fopen(path, "wb");
+        if (!file_) {
+            return false;
+        }
+        channels_ = channels;
+        samplerate_ = uint32_t(samplerate);
+        frames_ = 0;
+        WriteHeader();
+        return true;
+    }
+
+    // Appends frames interleaved frames from in.
+    bool Write(const float *in, size_t frames) {
+        if (!file_) {
+            return false;
+        }
+        size_t written = fwrite(in, sizeof(float) * channels_, frames, file_);
+        frames_ += written;
+        return written == frames;
+    }
+
+    // Patches the chunk sizes and closes the file.
+    void Close() {
+        if (file_) {
+            fseek(file_, 0, SEEK_SET);
+            WriteHeader();
+            fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+  private:
+    void WriteHeader() {
+        uint32_t data_size = uint32_t(frames_ * channels_ * sizeof(float));
+        uint8_t h[44];
+        memcpy(h, "RIFF", 4);
+        PutU32(h + 4, 36 + data_size);
+        memcpy(h + 8, "WAVEfmt ", 8);
+        PutU32(h + 16, 16);
+        PutU16(h + 20, 3); // IEEE float
+        PutU16(h + 22, uint16_t(channels_));
+        PutU32(h + 24, samplerate_);
+        PutU32(h + 28, uint32_t(samplerate_ * channels_ * sizeof(float)));
+        PutU16(h + 32, uint16_t(channels_ * sizeof(float)));
+        PutU16(h + 34, 32);
+        memcpy(h + 36, "data", 4);
+        PutU32(h + 40, data_size);
+        fwrite(h, 1, sizeof(h), file_);
+    }
+
+    static void PutU16(uint8_t *p, uint16_t v) { p[0] = uint8_t(v); p[1] = uint8_t(v >> 8); }
+    static void PutU32(uint8_t *p, uint32_t v) { PutU16(p, uint16_t(v)); PutU16(p + 2, uint16_t(v >> 16)); }
+
+    FILE *file_ = nullptr;
+    size_t channels_ = 0;
+    uint32_t samplerate_ = 0;
+    size_t frames_ = 0;
+};